@@ -0,0 +1,380 @@
+// Measures generated code: assembles a .asm file, runs it headless counting cycles until it halts or waits for a key
+// and prints the result as JSON, with the ROM and cycles of each function. Functions are the labels without a '$', as the translator writes them.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#define SPAN_IMPL
+#include "ulib/Span.h"
+
+#define BUFFER_IMPL
+#include "ulib/Buffer.h"
+
+#define OS_STDC_IMPL
+#include "ulib/OsStdc.h"
+
+#define HASH_IMPL
+#include "ulib/Hash.h"
+
+#define ROMSIZE (1 << 15)
+#define RAMSIZE (1 << 15)
+#define MAXFILESIZE (1 << 24)
+
+static uint16_t Rom[ROMSIZE];
+static int32_t RomLen = 0;
+static int16_t Ram[RAMSIZE];
+static uint64_t Cycles[ROMSIZE]; // Per instruction
+
+/* SYMBOLS */
+
+#define EXP 14
+#define LOADFACTOR 60
+#define MAXLEN (1 << EXP) * LOADFACTOR / 100
+
+typedef struct {
+  Span symbol;
+  int32_t value;
+} Entry;
+
+typedef struct {
+  Entry entries[1<<EXP];
+  int32_t len;
+  int32_t nextVariable;
+} SymbolTable;
+
+static SymbolTable Symbols = { .nextVariable = 16 };
+
+// Returns NULL when full
+Entry* STFind(SymbolTable* st, Span symbol) {
+  uint64_t h = HashString(symbol.ptr, symbol.len);
+  for(int32_t i = h;;) {
+    i = HashLookup(h, EXP, i);
+    Entry* e = &st->entries[i];
+    if(SpanEqual(symbol, e->symbol)) return e;
+    if(e->symbol.ptr == 0) {
+      if(MAXLEN < st->len) return NULL;
+      st->len += 1;
+      *e = (Entry) { symbol, -1 };
+      return e;
+    }
+  }
+}
+
+void predefine(void) {
+  #define PREDEFINED X(SP, 0) X(LCL, 1) X(ARG, 2) X(THIS, 3) X(THAT, 4) X(SCREEN, 16384) X(KBD, 24576)
+  #define X(_n, _v) STFind(&Symbols, S(#_n))->value = _v;
+  PREDEFINED
+  #undef X
+
+  static const char* registers[] = { "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "R9", "R10", "R11", "R12",
+                                     "R13", "R14", "R15" };
+  for(int i = 0; i < 16; i++) STFind(&Symbols, SpanFromString(registers[i]))->value = i;
+}
+
+/* FUNCTIONS */
+
+#define MAXFUNCTIONS (1 << 12)
+
+typedef struct {
+  Span name;
+  int32_t start; // In ROM, it ends where the next one starts
+} Function;
+
+static Function Functions[MAXFUNCTIONS] = { { .name = { .ptr = (Byte*)"start", .len = 5 }, .start = 0 } };
+static int32_t FunctionCount = 1;
+
+/* ASSEMBLER */
+
+// a bit and the six ALU bits. Both orders are accepted for the operations that commute.
+#define COMP \
+  X(0, 0101010) X(1, 0111111) X(-1, 0111010) X(D, 0001100) X(A, 0110000) X(!D, 0001101) X(!A, 0110001) \
+  X(-D, 0001111) X(-A, 0110011) X(D+1, 0011111) X(A+1, 0110111) X(D-1, 0001110) X(A-1, 0110010) \
+  X(D+A, 0000010) X(A+D, 0000010) X(D-A, 0010011) X(A-D, 0000111) X(D&A, 0000000) X(A&D, 0000000) \
+  X(D|A, 0010101) X(A|D, 0010101) \
+  X(M, 1110000) X(!M, 1110001) X(-M, 1110011) X(M+1, 1110111) X(M-1, 1110010) X(D+M, 1000010) X(M+D, 1000010) \
+  X(D-M, 1010011) X(M-D, 1000111) X(D&M, 1000000) X(M&D, 1000000) X(D|M, 1010101) X(M|D, 1010101)
+
+#define JUMP X(JGT, 1) X(JEQ, 2) X(JGE, 3) X(JLT, 4) X(JNE, 5) X(JLE, 6) X(JMP, 7)
+
+int compBits(Span c) {
+  #define X(_n, _b) if(SpanEqual(c, S(#_n))) return strtol(#_b, NULL, 2);
+  COMP
+  #undef X
+  return -1;
+}
+
+int jumpBits(Span j) {
+  if(j.len == 0) return 0;
+  #define X(_n, _b) if(SpanEqual(j, S(#_n))) return _b;
+  JUMP
+  #undef X
+  return -1;
+}
+
+int destBits(Span d) {
+  int bits = 0;
+  for(Size i = 0; i < d.len; i++) {
+    if(d.ptr[i] == 'A') bits |= 4;
+    else if(d.ptr[i] == 'D') bits |= 2;
+    else if(d.ptr[i] == 'M') bits |= 1;
+    else return -1;
+  }
+  return bits;
+}
+
+// The instruction on a line without comments and spaces, or an empty span
+Span instruction(Span line, Byte* buf) {
+  Size n = 0;
+  for(Size i = 0; i < line.len; i++) {
+    if(line.ptr[i] == '/' && i + 1 < line.len && line.ptr[i + 1] == '/') break;
+    if(!isspace(line.ptr[i])) buf[n++] = line.ptr[i];
+  }
+  return SPAN(buf, n);
+}
+
+// Labels first, then the instructions. Symbols point into the source, which outlives them.
+char* assemble(Span source) {
+  static Byte buf[1024];
+  int32_t pc = 0;
+
+  for(Span s = source; s.len > 0;) {
+    SpanPair sp = SpanCut(s, '\n');
+    s = sp.tail;
+    if(sp.head.len >= (Size)sizeof(buf)) return "Line too long.";
+    Span in = instruction(sp.head, buf);
+    if(in.len == 0) continue;
+    if(in.ptr[0] != '(') {
+      pc += 1;
+      continue;
+    }
+
+    // Labels are found in the source, not in buf
+    Byte* open = memchr(sp.head.ptr, '(', sp.head.len);
+    Byte* close = memchr(sp.head.ptr, ')', sp.head.len);
+    if(!close) return "Unclosed label.";
+    Span name = SpanTrim(SPAN(open + 1, close - open - 1));
+    Entry* e = STFind(&Symbols, name);
+    if(!e) return "Too many symbols.";
+    e->value = pc;
+
+    if(!memchr(name.ptr, '$', name.len)) {
+      if(FunctionCount == MAXFUNCTIONS) return "Too many functions.";
+      Functions[FunctionCount++] = (Function) { name, pc };
+    }
+  }
+  if(pc > ROMSIZE) return "Program too big for the ROM.";
+
+  for(Span s = source; s.len > 0;) {
+    SpanPair sp = SpanCut(s, '\n');
+    s = sp.tail;
+    Span in = instruction(sp.head, buf);
+    if(in.len == 0 || in.ptr[0] == '(') continue;
+
+    if(in.ptr[0] == '@') {
+      Span a = SpanSub(in, 1, in.len);
+      if(a.len > 0 && isdigit(a.ptr[0])) {
+        Rom[RomLen++] = (uint16_t)SpanToUlong(a) & 0x7FFF;
+        continue;
+      }
+      // The symbol is in buf, which gets overwritten, so it is looked up in the source again
+      Byte* at = memchr(sp.head.ptr, '@', sp.head.len);
+      Span name = SpanTrim(SpanCut(SPAN(at + 1, sp.head.ptr + sp.head.len - at - 1), '/').head);
+      Entry* e = STFind(&Symbols, name);
+      if(!e) return "Too many symbols.";
+      if(e->value < 0) e->value = Symbols.nextVariable++;
+      Rom[RomLen++] = (uint16_t)e->value;
+      continue;
+    }
+
+    SpanPair dest = SpanCut(in, '=');
+    if(dest.tail.len == 0 && !memchr(in.ptr, '=', in.len)) dest = (SpanPair) { SPAN0, in };
+    SpanPair jump = SpanCut(dest.tail, ';');
+    int d = destBits(dest.head), c = compBits(jump.head), j = jumpBits(jump.tail);
+    if(d < 0 || c < 0 || j < 0) {
+      fprintf(stderr, "Bad instruction: %.*s\n", (int)in.len, (char*)in.ptr);
+      return "Cannot assemble.";
+    }
+    Rom[RomLen++] = 0xE000 | c << 6 | d << 3 | j;
+  }
+  return NULL;
+}
+
+/* EXECUTOR */
+
+static inline int16_t alu(int16_t x, int16_t y, int bits) {
+  if(bits & 32) x = 0;
+  if(bits & 16) x = ~x;
+  if(bits & 8) y = 0;
+  if(bits & 4) y = ~y;
+  int16_t out = bits & 2 ? (int16_t)(x + y) : x & y;
+  return bits & 1 ? ~out : out;
+}
+
+static inline bool jumps(int16_t out, int j) {
+  return ((j & 4) && out < 0) || ((j & 2) && out == 0) || ((j & 1) && out > 0);
+}
+
+// RAM is tracked by a sum of its words, each one weighted by a different odd number, which changes with every
+// write. If a jump lands where an earlier one did with the same A, D and RAM, the program will loop forever:
+// it halted or it waits for a key.
+typedef struct {
+  bool seen;
+  int16_t a, d;
+  uint64_t ram;
+} JumpState;
+
+static JumpState Jumps[ROMSIZE];
+
+static inline uint64_t weight(int32_t addr) {
+  return 0x9E3779B97F4A7C15ull * (uint64_t)(addr + 1) | 1;
+}
+
+// Runs until the program loops without changing anything, leaves the ROM or uses up max cycles.
+// Returns true if it stopped on its own.
+bool run(uint64_t max, uint64_t* total) {
+  int16_t a = 0, d = 0;
+  int32_t pc = 0;
+  uint64_t n = 0, ram = 0;
+
+  for(; n < max; n++) {
+    if(pc < 0 || pc >= RomLen) break;
+    uint16_t i = Rom[pc];
+    Cycles[pc] += 1;
+
+    if(!(i & 0x8000)) {
+      a = i;
+      pc += 1;
+      continue;
+    }
+    int32_t addr = (uint16_t)a & (RAMSIZE - 1);
+    int16_t y = i & 0x1000 ? Ram[addr] : a;
+    int16_t out = alu(d, y, i >> 6 & 63);
+    int32_t target = (uint16_t)a;
+
+    if(i & 8) {
+      ram += (uint64_t)((int64_t)out - Ram[addr]) * weight(addr);
+      Ram[addr] = out;
+    }
+    if(i & 16) d = out;
+    if(i & 32) a = out;
+
+    if(!jumps(out, i & 7)) {
+      pc += 1;
+      continue;
+    }
+    JumpState* j = &Jumps[target & (ROMSIZE - 1)];
+    if(j->seen && j->a == a && j->d == d && j->ram == ram) {
+      n += 1;
+      break;
+    }
+    *j = (JumpState) { true, a, d, ram };
+    pc = target;
+  }
+  *total = n;
+  return n < max;
+}
+
+/* REPORT */
+
+// The line of the baseline file for this program, as written by report
+bool baseline(char* path, char* program, long* rom, unsigned long long* cycles) {
+  FILE* f = fopen(path, "r");
+  if(!f) return false;
+
+  char line[1 << 16], key[1024];
+  snprintf(key, sizeof(key), "{\"program\": \"%s\", ", program);
+  bool found = false;
+  while(!found && fgets(line, sizeof(line), f)) {
+    if(strncmp(line, key, strlen(key))) continue;
+    found = sscanf(line + strlen(key), "\"rom\": %ld, \"cycles\": %llu", rom, cycles) == 2;
+  }
+  fclose(f);
+  return found;
+}
+
+// One line for the program, so that the Taskfile can put the lines of all the programs in an array
+void report(char* program, bool halted, uint64_t total, char* baselinePath) {
+  printf("{\"program\": \"%s\", \"rom\": %d, \"cycles\": %llu, \"halted\": %s", program, RomLen,
+         (unsigned long long)total, halted ? "true" : "false");
+
+  long rom;
+  unsigned long long cycles;
+  if(baselinePath && baseline(baselinePath, program, &rom, &cycles)) {
+    printf(", \"baseline\": {\"rom\": %ld, \"cycles\": %llu}", rom, cycles);
+  }
+
+  // Labels such as End are written once per file, they are added up under one name
+  printf(", \"functions\": {");
+  bool first = true;
+  for(int32_t f = 0; f < FunctionCount; f++) {
+    int32_t rom = 0;
+    uint64_t c = 0;
+    bool repeated = false;
+    for(int32_t g = 0; g < FunctionCount && !repeated; g++) {
+      if(!SpanEqual(Functions[g].name, Functions[f].name)) continue;
+      if(g < f) repeated = true;
+      int32_t end = g + 1 < FunctionCount ? Functions[g + 1].start : RomLen;
+      rom += end - Functions[g].start;
+      for(int32_t pc = Functions[g].start; pc < end; pc++) c += Cycles[pc];
+    }
+    if(repeated || rom == 0) continue;
+    printf("%s\"%.*s\": {\"rom\": %d, \"cycles\": %llu}", first ? "" : ", ", (int)Functions[f].name.len,
+           (char*)Functions[f].name.ptr, rom, (unsigned long long)c);
+    first = false;
+  }
+  printf("}}\n");
+}
+
+int themain(int argc, char** argv) {
+  uint64_t max = 100000000;
+  char* baselinePath = NULL;
+
+  int first = 1;
+  for(; first < argc && argv[first][0] == '-'; first++) {
+    char* a = argv[first];
+    int addr, value;
+    if(a[1] == 'n' && atoll(a + 2) > 0) max = atoll(a + 2);
+    else if(a[1] == 's' && sscanf(a + 2, "%d=%d", &addr, &value) == 2 && addr >= 0 && addr < RAMSIZE) Ram[addr] = value;
+    else if(a[1] == 'b' && a[2]) baselinePath = a + 2;
+    else {
+      fprintf(stderr, "Unknown option %s\n", a);
+      return -1;
+    }
+  }
+
+  if(argc - first != 2) {
+    fprintf(stderr, "Usage: %s [-n<cycles>] [-s<addr>=<value>]... [-b<baseline.json>] <name> <file.asm>\n",
+            argv[0]);
+    fprintf(stderr, "  -n<cycles>        stop after this many cycles (default %llu)\n", (unsigned long long)max);
+    fprintf(stderr, "  -s<addr>=<value>  set RAM[addr] before running\n");
+    fprintf(stderr, "  -b<file>          add the numbers for the same program name in this earlier output\n");
+    return -1;
+  }
+
+  static Byte filein[MAXFILESIZE];
+  Buffer bufin = BufferInit(filein, MAXFILESIZE);
+  SpanResult sr = OsSlurp(argv[first + 1], MAXFILESIZE, &bufin);
+  if(sr.error) {
+    fprintf(stderr, "Error reading file %s.\n%s\n", argv[first + 1], sr.error);
+    return -1;
+  }
+
+  predefine();
+  char* err = assemble(sr.data);
+  if(err) {
+    fprintf(stderr, "ERROR: %s\n", err);
+    return -1;
+  }
+
+  uint64_t total;
+  bool halted = run(max, &total);
+  report(argv[first], halted, total, baselinePath);
+  return 0;
+}
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -7,6 +9,14 @@
 #include <stdio.h>
 #include <ctype.h>
 
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
 #define SPAN_IMPL
 #include "ulib/Span.h"
 
@@ -94,15 +104,368 @@ Token parseLine(Span line) {
   return (Token) {tt, arg1, arg2};
 }
 
-/* CODE */
-
-#define Handle(_n) char* _n##f(Token t, Buffer* bufout)
+#define CheckF(...) { char* _err = __VA_ARGS__; if(_err) return _err; }
 
 #define WriteSpan(_k) if(BufferCopy(_k,bufout).error) return "Writing buffer too small"
 #define WriteStr(_s) WriteSpan(SpanFromString(_s))
 #define WriteStrNL(_s) WriteStr((_s));WriteStr("\n")
 #define WriteA(_i) WriteStr("@");WriteSpan((_i));WriteStr("\n")
 #define WriteLabel(_i) WriteStr("(");WriteSpan((_i));WriteStr(")\n")
+// SpanFromUlong uses a static buffer, not safe with many files translated at once
+#define WriteNum(_n) { char _nb[32]; sprintf(_nb, "%lu", (unsigned long)(_n)); WriteStr(_nb); }
+
+/* BINARY FORMAT */
+
+// A .vmb file is "VMB1", the count of strings and then each string as its length and bytes, followed by the
+// commands. A command is its TokenType as one byte, then for push and pop a segment byte and the index, for label,
+// goto and if-goto the string of the label, for function and call the string of the name and the count. Numbers
+// are varints: 7 bits per byte, low bits first, the top bit set on all bytes but the last.
+#define VMBMAGIC "VMB1"
+#define MAXSTRINGS (1 << 16)
+
+#define SEGMENTS X(argument) X(local) X(static) X(constant) X(this) X(that) X(pointer) X(temp)
+
+#define X(_n) #_n,
+static char* SegmentNames[] = { SEGMENTS };
+static char* CommandNames[] = { INSTR "goto", "if-goto", "return" };
+#undef X
+#define SEGMENTCOUNT (Size)(sizeof(SegmentNames) / sizeof(*SegmentNames))
+
+int segmentId(Span segment) {
+  for(int i = 0; i < SEGMENTCOUNT; i++) if(SpanEqual(segment, SpanFromString(SegmentNames[i]))) return i;
+  return -1;
+}
+
+// Returns -1 past the end of s
+long readVarint(Span* s) {
+  long n = 0;
+  for(int shift = 0; s->len > 0 && shift < 63; shift += 7) {
+    Byte b = *s->ptr;
+    *s = SpanSub(*s, 1, s->len);
+    n |= (long)(b & 0x7F) << shift;
+    if(!(b & 0x80)) return n;
+  }
+  return -1;
+}
+
+char* writeVarint(Size n, Buffer* bufout) {
+  do {
+    if(BufferPushByte(bufout, (Byte)((n & 0x7F) | (n > 0x7F ? 0x80 : 0))).error) return "Writing buffer too small";
+    n >>= 7;
+  } while(n > 0);
+  return NULL;
+}
+
+// Writes the commands of bin as VM text, one per line with single spaces, as the compiler writes them
+char* vmbToText(Span bin, Buffer* bufout) {
+  static Span strings[MAXSTRINGS];
+
+  if(bin.len < 4 || memcmp(bin.ptr, VMBMAGIC, 4)) return "Not a binary VM file.";
+  Span s = SpanSub(bin, 4, bin.len);
+  long count = readVarint(&s);
+  if(count < 0 || count > MAXSTRINGS) return "Bad string table.";
+  for(long i = 0; i < count; i++) {
+    long len = readVarint(&s);
+    if(len < 0 || len > s.len) return "Bad string table.";
+    strings[i] = SpanSub(s, 0, len);
+    s = SpanSub(s, len, s.len);
+  }
+
+  while(s.len > 0) {
+    Byte op = *s.ptr;
+    s = SpanSub(s, 1, s.len);
+    if(op > returne) return "Bad command in binary VM file.";
+    WriteStr(CommandNames[op]);
+
+    if(op == push || op == pop) {
+      Byte seg = s.len > 0 ? *s.ptr : SEGMENTCOUNT;
+      s = SpanSub(s, s.len > 0, s.len);
+      long i = readVarint(&s);
+      if(seg >= SEGMENTCOUNT || i < 0) return "Bad push or pop in binary VM file.";
+      WriteStr(" ");
+      WriteStr(SegmentNames[seg]);
+      WriteStr(" ");
+      WriteNum(i);
+    } else if(op == label || op == gotoe || op == gotoeif || op == function || op == call) {
+      long id = readVarint(&s);
+      if(id < 0 || id >= count) return "Bad string in binary VM file.";
+      WriteStr(" ");
+      WriteSpan(strings[id]);
+      if(op == function || op == call) {
+        long n = readVarint(&s);
+        if(n < 0) return "Bad count in binary VM file.";
+        WriteStr(" ");
+        WriteNum(n);
+      }
+    }
+    WriteStr("\n");
+  }
+  return NULL;
+}
+
+// Interns s, returning its index. Strings are kept in order in the table, for writing it out.
+typedef struct {
+  Span entries[MAXSTRINGS];
+  int32_t ids[MAXSTRINGS];
+  Span inOrder[MAXSTRINGS];
+  int32_t len;
+} StringTable;
+
+int32_t internString(StringTable* st, Span s) {
+  uint64_t h = HashString(s.ptr, s.len);
+  for(int32_t i = h;;) {
+    i = HashLookup(h, 16, i);
+    if(st->entries[i].ptr == 0) {
+      if(st->len == MAXSTRINGS / 2) return -1; // Keeps the table half empty
+      st->entries[i] = s;
+      st->ids[i] = st->len;
+      st->inOrder[st->len] = s;
+      return st->len++;
+    }
+    if(SpanEqual(st->entries[i], s)) return st->ids[i];
+  }
+}
+
+// The other way around, comments and blank lines are lost
+char* textToVmb(Span text, Buffer* bufout) {
+  static StringTable strings;
+  static Byte commandBytes[1 << 20];
+  memset(&strings, 0, sizeof(strings));
+  Buffer commands = BufferInit(commandBytes, sizeof(commandBytes));
+
+  while(text.len > 0) {
+    SpanPair sp = SpanCut(text, '\n');
+    text = sp.tail;
+
+    Token t = parseLine(sp.head);
+    if(t.type == Empty) continue;
+    if(t.type == Error) return "Unknown command.";
+    if(BufferPushByte(&commands, (Byte)t.type).error) return "Writing buffer too small";
+
+    if(t.type == push || t.type == pop) {
+      int seg = segmentId(t.arg1);
+      if(seg < 0) return "Unknown segment.";
+      if(BufferPushByte(&commands, (Byte)seg).error) return "Writing buffer too small";
+      CheckF(writeVarint(SpanToUlong(t.arg2), &commands));
+    } else if(t.type == label || t.type == gotoe || t.type == gotoeif || t.type == function || t.type == call) {
+      int32_t id = internString(&strings, t.arg1);
+      if(id < 0) return "Too many names.";
+      CheckF(writeVarint(id, &commands));
+      if(t.type == function || t.type == call) CheckF(writeVarint(SpanToUlong(t.arg2), &commands));
+    }
+  }
+
+  WriteStr(VMBMAGIC);
+  CheckF(writeVarint(strings.len, bufout));
+  for(int32_t i = 0; i < strings.len; i++) {
+    CheckF(writeVarint(strings.inOrder[i].len, bufout));
+    WriteSpan(strings.inOrder[i]);
+  }
+  WriteSpan(BufferToSpan(&commands));
+  return NULL;
+}
+
+// Reads a VM file into buf as text. Binary files are mapped and decoded.
+SpanResult loadVm(char* path, Size max, Buffer* buf) {
+  Size len = strlen(path);
+  if(len < 4 || strcmp(path + len - 4, ".vmb")) return OsSlurp(path, max, buf);
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return SPANERR("Cannot open the file.");
+  struct stat st;
+  if(fstat(fd, &st) || st.st_size == 0) {
+    close(fd);
+    return SPANERR("Cannot read the file.");
+  }
+  void* bin = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(bin == MAP_FAILED) return SPANERR("Cannot map the file.");
+
+  Size start = buf->index;
+  char* err = vmbToText(SPAN(bin, st.st_size), buf);
+  munmap(bin, st.st_size);
+  if(err) return SPANERR(err);
+  return SPANRESULT(SPAN(buf->data.ptr + start, buf->index - start));
+}
+
+/* FUNCTIONS */
+
+#define FEXP 12
+#define FLOADFACTOR 60
+#define FMAXLEN (1 << FEXP) * FLOADFACTOR / 100
+
+// What is known of each function before translation starts
+typedef struct Function {
+  Span name;
+  Span code;   // From its 'function' command up to the next one
+  char* file;  // For its statics
+  bool live;
+  Size romSize; // Instructions of its translation, not emitted if the function is dead
+
+  // Filled in by analyzeFunction, the masks are of segment indexes below TEMPSLOTS
+  bool balanced;  // Stack height known everywhere, with only the result on it at each return
+  bool calls;
+  Size commands;
+  int32_t locals;
+  int32_t args;   // One more than the highest argument used
+  uint8_t argsUsed;
+  uint8_t tempsUsed;
+  uint8_t pointersSet;
+  bool inlinable;
+
+  // Call graph of the calls that are not inlined, see assignStaticFrames
+  int32_t firstCallee;
+  int32_t calleeCount;
+  int32_t siteArgs; // Most arguments passed by a call to it
+  bool called;
+  int32_t sccIndex;
+  int32_t lowLink;
+  int32_t scc;
+  bool onStack;
+  bool recursive;
+
+  // Arguments and locals at fixed addresses instead of on the stack
+  bool staticFrame;
+  int32_t frameBase;
+
+  int32_t profileAddr; // Of its counters when profiling, 0 if it has none
+
+  // From the profile given with -f, if it is in there
+  bool profiled;
+  int64_t timesCalled;
+} Function;
+
+typedef struct {
+  Function entries[1<<FEXP];
+  Function* inOrder[FMAXLEN + 1]; // As found in the input files, for reporting
+  int32_t len;
+} FunctionTable;
+
+static FunctionTable Functions;
+
+Function* FTAdd(FunctionTable* ft, Span name) {
+  assert(ft);
+  assert(SpanValid(name));
+
+  if(FMAXLEN < ft->len) return NULL; // OOM
+
+  uint64_t h = HashString(name.ptr, name.len);
+  for(int32_t i = h;;) {
+    i = HashLookup(h, FEXP, i);
+    Function* f = &ft->entries[i];
+    // Last definition wins, as for the symbol table in the compiler
+    if(SpanEqual(name, f->name) || f->name.ptr == 0) {
+      if(f->name.ptr == 0) ft->inOrder[ft->len++] = f;
+      *f = (Function) { .name = name };
+      return f;
+    }
+  }
+}
+
+Function* FTGet(FunctionTable* ft, Span name) {
+  assert(ft);
+  assert(SpanValid(name));
+
+  uint64_t h = HashString(name.ptr, name.len);
+  for(int32_t i = h;;) {
+    i = HashLookup(h, FEXP, i);
+    Function* f = &ft->entries[i];
+
+    if(f->name.ptr == 0) return NULL;
+
+    if(SpanEqual(name, f->name)) {
+      return f;
+    }
+  }
+}
+
+static inline int bitCount(unsigned m) {
+  int n = 0;
+  for(; m; m >>= 1) n += m & 1;
+  return n;
+}
+
+// Static frames hold the return address, the arguments, the locals and then THIS and THAT if the function sets them
+static inline int32_t frameArgs(Function* f) { return f->args > f->siteArgs ? f->args : f->siteArgs; }
+static inline int32_t frameSize(Function* f) { return 1 + frameArgs(f) + f->locals + bitCount(f->pointersSet); }
+#define FRAMERET 0
+#define FrameArg(_f, _i) (1 + (_i))
+#define FrameLocal(_f, _i) (1 + frameArgs(_f) + (_i))
+#define FramePointer(_f, _p) (1 + frameArgs(_f) + (_f)->locals + ((_p) && ((_f)->pointersSet & 1)))
+
+/* CODE */
+
+// Output is kept in fixed size chunks that are written to disk as soon as all previous files are done
+#define CHUNKSIZE (1<<16)
+
+typedef struct Chunk {
+  struct Chunk* next;
+  Size len;
+  Byte data[CHUNKSIZE];
+} Chunk;
+
+// Translation state of one input file. Files are translated in parallel, so nothing here can be global.
+typedef struct InlineSite InlineSite;
+typedef struct IrBlock IrBlock;
+
+// Instructions written for each kind of command, see ROM REPORT. Only sizes, to be summed and cached as an array.
+typedef struct {
+  Size total;
+  Size commands[returne + 1];
+  Size inlined;   // Calls replaced by the body of the function
+  Size pushes[SEGMENTCOUNT];
+  Size pops[SEGMENTCOUNT];
+  Size other;     // After the last command
+} RomCounts;
+#define ROMCOUNTS (sizeof(RomCounts) / sizeof(Size))
+
+typedef struct {
+  char* vmFileName;
+  char fileNameBuf[1024]; // https://en.wikipedia.org/wiki/Comparison_of_file_systems#Limits
+  char* staticsFile;      // Statics belong to the file of the function, not the one it is inlined in
+  Span funcName;
+  Function* func;         // Being translated, NULL outside of functions
+  unsigned labelCount;    // For comparisons
+  unsigned retCount;      // For return addresses
+  unsigned inlineCount;   // For the labels of inlined bodies
+  uint8_t inlineTemps;    // Temp slots of the inlined body being translated, the IR keeps no values in them
+  unsigned profileCount;  // For the labels of counter carries
+  Size pending;           // Instructions run since the cycles were last charged
+  Size instrumented;      // Instructions written by the profiler, not charged
+  bool tail;              // The call being translated is followed by a return
+  int32_t sp;             // How far the top of the stack is past SP in RAM
+  unsigned tailCalls;     // For the report
+  RomCounts rom;          // For the report
+  Span source;
+
+  InlineSite* inlined;    // For the report
+  int32_t inlinedCount;
+  int32_t inlinedCap;
+
+  Chunk* current;         // Being written by the worker, out points into it
+  Buffer out;
+  Chunk* sealed;          // Full chunks waiting to be written, protected by the writer lock
+  Chunk* lastSealed;
+  bool done;
+
+  Byte* scratch;          // Where code is translated only to be measured
+  IrBlock* ir;            // Kept between blocks, it is big
+  char* error;
+
+  // Directory mode, see CACHE
+  uint64_t cacheKey;
+  Byte* cacheFile;        // Read from the cache, its translation is used instead of compiling
+  Span cached;
+  bool saving;            // A copy of the output is kept to go in the cache
+  Byte* saved;
+  Size savedLen;
+  Size savedCap;
+} Context;
+
+#define Handle(_n) char* _n##f(Token t, Context* ctx, Buffer* bufout)
+
+// VM labels are local to the function they are in
+#define WriteScoped(_l) WriteSpan(ctx->funcName);WriteStr("$");WriteSpan((_l))
 
 SpanResult fixedMap(Span segment) {
   #define SEGS \
@@ -116,40 +479,183 @@ SpanResult fixedMap(Span segment) {
   #undef X
   return SPANERR("Not one of fixed mappings.");
 }
-// Hack instead of passing these parameters to many functions
-// TODO: make it threadlocal if multi-thread compilation.
-static char* VmFileName = NULL; 
-static Span FuncName = {0};
+// Hack reserves RAM[5-12] for temp. Pointer maps to THIS and THAT.
+#define TEMPBASE 5
 
-char* SetAddr(Span segment, Span idx, Buffer* bufout) {
-  SpanResult sr = fixedMap(segment);
+// Up to this index it is cheaper to walk A up from the segment base than to go through R13 on pop
+#define MAXPOPWALK 6
 
-  if(!sr.error) { // Found through simple mapping
-    WriteA(sr.data);
-    WriteStrNL("D=M");
-    WriteA(idx);
-    WriteStrNL("A=D+A");
-  } else if(SpanEqual(segment, S("constant"))) {
-    WriteA(idx);
+// Within a basic block SP in RAM is left alone and the stack is addressed relative to it, ctx->sp keeps track of
+// where the top is. SP catches up before anything that jumps, is jumped to or uses SP itself. Past this many words
+// reaching the top costs more than catching up.
+#define MAXSPDELTA 3
+
+// Leaves in A the address of the word off past SP, without touching D
+char* stackAddr(int32_t off, Buffer* bufout) {
+  WriteStrNL("@SP");
+  WriteStrNL(off > 0 ? "A=M+1" : off < 0 ? "A=M-1" : "A=M");
+  for(int32_t i = 1; i < off; i++) { WriteStrNL("A=A+1"); }
+  for(int32_t i = -1; i > off; i--) { WriteStrNL("A=A-1"); }
+  return NULL;
+}
+
+// Brings SP in RAM up to date, without touching D
+char* syncSP(Context* ctx, Buffer* bufout) {
+  if(ctx->sp == 0) return NULL;
+  WriteStrNL("@SP");
+  for(int32_t i = 0; i < ctx->sp; i++) { WriteStrNL("M=M+1"); }
+  for(int32_t i = 0; i > ctx->sp; i--) { WriteStrNL("M=M-1"); }
+  ctx->sp = 0;
+  return NULL;
+}
+
+// Both leave in A the address of the word popped or about to be pushed
+char* stackPop(Context* ctx, Buffer* bufout) {
+  if(ctx->sp == -MAXSPDELTA) CheckF(syncSP(ctx, bufout));
+  ctx->sp -= 1;
+  return stackAddr(ctx->sp, bufout);
+}
+
+char* stackPush(Context* ctx, Buffer* bufout) {
+  if(ctx->sp == MAXSPDELTA) CheckF(syncSP(ctx, bufout));
+  ctx->sp += 1;
+  return stackAddr(ctx->sp - 1, bufout);
+}
+
+#define popd \
+  CheckF(stackPop(ctx, bufout)); \
+  WriteStrNL("D=M");
+
+#define popa \
+  CheckF(stackPop(ctx, bufout));
+
+#define pushd \
+  CheckF(stackPush(ctx, bufout)); \
+  WriteStrNL("M=D");
+
+static inline bool inStaticFrame(Context* ctx) {
+  return ctx->func && ctx->func->staticFrame;
+}
+
+// Slots of static frames are assembler variables, allocated next to the statics
+#define WriteFrame(_f, _slot) WriteStr("@$frame."); WriteNum((_f)->frameBase + (_slot)); WriteStr("\n")
+
+// Profiling counts into RAM past the keyboard, which the emulators have and the OS never touches. Each function
+// has two counters, calls then cycles, each one 15 bits high word then 15 bits low word.
+#define PROFILEBASE (24576 + 1)
+#define PROFILEEND (1 << 15)
+#define PROFILEWORDS 4
+typedef enum { NoProfile, ProfileCalls, ProfileCycles } ProfileMode;
+static ProfileMode Profile = NoProfile;
+
+static inline bool profiled(Context* ctx) {
+  return Profile != NoProfile && ctx->func && ctx->func->profileAddr;
+}
+
+// By contract Sys.halt never returns, it spins. Charging its loop would change the RAM at every turn, runs could then
+// not tell that it halted, so only the call to it is counted.
+static inline bool chargesCycles(Context* ctx) {
+  return Profile == ProfileCycles && profiled(ctx) && !SpanEqual(ctx->func->name, S("Sys.halt"));
+}
+
+Size countInstructions(Span s);
+#define WriteANum(_n) WriteStr("@"); WriteNum(_n); WriteStr("\n")
+
+// Adds n to the counter at addr, carrying into the high word when the low one gets to 15 bits. Counts are exact up to
+// 2^30 - 1, past that the high word wraps: 10 times the cycles bench runs a program for by default.
+char* profileAdd(int32_t addr, Size n, Context* ctx, Buffer* bufout) {
+  Size start = bufout->index;
+  while(n > 0) {
+    Size add = n > 0x7FFF ? 0x7FFF : n;
+    n -= add;
+    char skip[1100];
+    snprintf(skip, sizeof(skip), "%.*s$prof%u", (int)ctx->funcName.len, (char*)ctx->funcName.ptr, ctx->profileCount++);
+
+    if(add == 1) {
+      WriteANum(addr + 1);
+      WriteStrNL("MD=M+1");
+    } else {
+      WriteANum(add);
+      WriteStrNL("D=A");
+      WriteANum(addr + 1);
+      WriteStrNL("MD=D+M");
+    }
+    WriteA(SpanFromString(skip));
+    WriteStrNL("D;JGE");
+    WriteANum(0x7FFF);
     WriteStrNL("D=A");
-    WriteA(S("5"));
-    WriteStrNL("M=D");
-  } else if(SpanEqual(segment, S("static"))) {
+    WriteANum(addr + 1);
+    WriteStrNL("M=D&M");
+    WriteANum(addr);
+    WriteStrNL("M=M+1");
+    WriteLabel(SpanFromString(skip));
+  }
+  ctx->instrumented += countInstructions(SPAN(bufout->data.ptr + start, bufout->index - start));
+  return NULL;
+}
+
+// Charges what ran since the last charge to the function being translated
+char* chargeCycles(Context* ctx, Buffer* bufout) {
+  Size n = ctx->pending;
+  ctx->pending = 0;
+  return n ? profileAdd(ctx->func->profileAddr + 2, n, ctx, bufout) : NULL;
+}
+
+// Segments with an address known at translation time
+bool isDirect(Span segment, Context* ctx) {
+  if(inStaticFrame(ctx) && (SpanEqual(segment, S("argument")) || SpanEqual(segment, S("local")))) return true;
+  return SpanEqual(segment, S("static")) || SpanEqual(segment, S("temp")) || SpanEqual(segment, S("pointer"));
+}
+
+// Constants that the ALU can produce without loading them in A first
+char* constComp(Span idx) {
+  if(SpanEqual(idx, S("0")))  return "0";
+  if(SpanEqual(idx, S("1")))  return "1";
+  if(SpanEqual(idx, S("-1"))) return "-1";
+  return NULL;
+}
+
+char* SetDirectAddr(Span segment, Span idx, Context* ctx, Buffer* bufout) {
+  if(SpanEqual(segment, S("static"))) {
     WriteStr("@");
-    WriteStr(VmFileName);
+    WriteStr(ctx->staticsFile);
     WriteStr(".");
     WriteSpan(idx);
     WriteStr("\n");
   } else if(SpanEqual(segment, S("temp"))) {
-    WriteA(S("5")); // Bug?? TEMP not defined?
-    WriteStrNL("D=A");
-    WriteA(idx);
-    WriteStrNL("A=D+A");
+    WriteStr("@");
+    WriteNum(TEMPBASE + SpanToUlong(idx));
+    WriteStr("\n");
   } else if(SpanEqual(segment, S("pointer"))) {
-    WriteA(S("THIS"));
-    WriteStrNL("D=A");
-    WriteA(idx);
-    WriteStrNL("A=D+A");
+    WriteA(SpanToUlong(idx) ? S("THAT") : S("THIS"));
+  } else if(SpanEqual(segment, S("argument")) && inStaticFrame(ctx)) {
+    WriteFrame(ctx->func, FrameArg(ctx->func, SpanToUlong(idx)));
+  } else if(SpanEqual(segment, S("local")) && inStaticFrame(ctx)) {
+    WriteFrame(ctx->func, FrameLocal(ctx->func, SpanToUlong(idx)));
+  } else {
+    return "Not a direct segment type.";
+  }
+  return NULL;
+}
+
+// Leaves in A the address of segment[idx]. It might trash D.
+char* SetAddr(Span segment, Span idx, Context* ctx, Buffer* bufout) {
+  SpanResult sr = fixedMap(segment);
+
+  if(isDirect(segment, ctx)) {
+    CheckF(SetDirectAddr(segment, idx, ctx, bufout));
+  } else if(!sr.error) { // Found through simple mapping
+    Size i = SpanToUlong(idx);
+    WriteA(sr.data);
+    if(i == 0) {
+      WriteStrNL("A=M");
+    } else if(i == 1) {
+      WriteStrNL("A=M+1");
+    } else {
+      WriteStrNL("D=M");
+      WriteA(idx);
+      WriteStrNL("A=D+A");
+    }
   } else {
     return "Not a known segment type.";
   }
@@ -158,44 +664,55 @@ char* SetAddr(Span segment, Span idx, Buffer* bufout) {
 
 Handle(push) {
 
-  char* err = SetAddr(t.arg1, t.arg2, bufout);
-  if(err) return err;
-  WriteStrNL("D=M");
-
-  WriteStrNL("@SP");
-  WriteStrNL("A=M");
-  WriteStrNL("M=D");
+  if(SpanEqual(t.arg1, S("constant"))) {
+    char* comp = constComp(t.arg2);
+    if(comp) { // Write it straight on the stack
+      CheckF(stackPush(ctx, bufout));
+      WriteStr("M=");
+      WriteStrNL(comp);
+      return NULL;
+    }
+    WriteA(t.arg2);
+    WriteStrNL("D=A");
+  } else {
+    CheckF(SetAddr(t.arg1, t.arg2, ctx, bufout));
+    WriteStrNL("D=M");
+  }
 
-  WriteStrNL("@SP");
-  WriteStrNL("M=M+1");
+  pushd
   
   return NULL;
 
 }
 
-#define popd \
-  WriteStrNL("@SP"); \
-  WriteStrNL("M=M-1"); \
-  WriteStrNL("A=M"); \
-  WriteStrNL("D=M");
+Handle(pop) {
 
-#define popa \
-  WriteStrNL("@SP"); \
-  WriteStrNL("M=M-1"); \
-  WriteStrNL("A=M"); \
+  if(SpanEqual(t.arg1, S("constant"))) return "Cannot pop into the constant segment.";
 
-#define pushd \
-  WriteStrNL("@SP"); \
-  WriteStrNL("A=M"); \
-  WriteStrNL("M=D"); \
-  WriteStrNL("@SP"); \
-  WriteStrNL("M=M+1");
+  // Address known statically, no need to save it
+  if(isDirect(t.arg1, ctx)) {
+    popd
+    CheckF(SetDirectAddr(t.arg1, t.arg2, ctx, bufout));
+    WriteStrNL("M=D");
+    return NULL;
+  }
 
-Handle(pop) {
+  // Small index, pop first and then walk from the base address without touching D
+  SpanResult sr = fixedMap(t.arg1);
+  Size idx = SpanToUlong(t.arg2);
+  if(!sr.error && idx <= MAXPOPWALK) {
+    popd
+    WriteA(sr.data);
+    WriteStrNL("A=M");
+    for(Size i = 0; i < idx; i++) {
+      WriteStrNL("A=A+1");
+    }
+    WriteStrNL("M=D");
+    return NULL;
+  }
 
   // Store calculated address in D
-  char* err = SetAddr(t.arg1, t.arg2, bufout);
-  if(err) return err;
+  CheckF(SetAddr(t.arg1, t.arg2, ctx, bufout));
   WriteStrNL("D=A");
 
   // Store D in R13
@@ -215,54 +732,49 @@ Handle(pop) {
   return NULL;
 }
 
-static inline char* arith(char* arith, Buffer* bufout) {
+// The result goes where the first operand was
+static inline char* arith(char* arith, Context* ctx, Buffer* bufout) {
   popd
   popa
 
   WriteStrNL(arith);
-
-  pushd
+  ctx->sp += 1;
 
   return NULL;
 }
 
-Handle(add) { (void)t; return arith("D=M+D", bufout);}
-Handle(sub) { (void)t; return arith("D=M-D", bufout);}
-Handle(and) { (void)t; return arith("D=M&D", bufout);}
-Handle(or)  { (void)t; return arith("D=M|D", bufout);}
+Handle(add) { (void)t; return arith("M=M+D", ctx, bufout);}
+Handle(sub) { (void)t; return arith("M=M-D", ctx, bufout);}
+Handle(and) { (void)t; return arith("M=M&D", ctx, bufout);}
+Handle(or)  { (void)t; return arith("M=M|D", ctx, bufout);}
 
-static inline char* unary(char* arith, Buffer* bufout) {
-  popd
+static inline char* unary(char* arith, Context* ctx, Buffer* bufout) {
+  CheckF(stackAddr(ctx->sp - 1, bufout));
 
   WriteStrNL(arith);
 
-  pushd
-
   return NULL;
 }
-Handle(neg) { (void)t; return unary("D=-D", bufout);} 
-Handle(not) { (void)t; return unary("D=!D", bufout);} 
+Handle(neg) { (void)t; return unary("M=-M", ctx, bufout);} 
+Handle(not) { (void)t; return unary("M=!M", ctx, bufout);} 
 
-// *CAREFUL* not thread safe
-Span nextLabel(int i) {
-  static int x = 0;
-  static char ar[1000];
-
-  char* label = &ar[i * 50];
-  sprintf(label, "LABEL%d", x);
-  x += 1;
+// Numbered per file, so the output doesn't depend on the order files are translated in
+Span nextLabel(Context* ctx, char* label, Size size) {
+  snprintf(label, size, "%s$LABEL%u", ctx->vmFileName, ctx->labelCount);
+  ctx->labelCount += 1;
   return SpanFromString(label);
 }
 
-static inline char* comparison(char* dJump, Buffer* bufout) {
+static inline char* comparison(char* dJump, Context* ctx, Buffer* bufout) {
 
   popd
   popa
   WriteStrNL("A=M");
 
-  Span l1 = nextLabel(0);
-  Span l2 = nextLabel(1);
-  Span l3 = nextLabel(2);
+  char ar[3][1100];
+  Span l1 = nextLabel(ctx, ar[0], sizeof(ar[0]));
+  Span l2 = nextLabel(ctx, ar[1], sizeof(ar[1]));
+  Span l3 = nextLabel(ctx, ar[2], sizeof(ar[2]));
 
   WriteStrNL("D=D-A");
   WriteA(l1);
@@ -286,52 +798,126 @@ static inline char* comparison(char* dJump, Buffer* bufout) {
 
   return NULL;
 }
-Handle(eq) { (void)t; return comparison("D;JEQ", bufout); }
-Handle(lt) { (void)t; return comparison("D;JGT", bufout); }
-Handle(gt) { (void)t; return comparison("D;JLT", bufout); }
+Handle(eq) { (void)t; return comparison("D;JEQ", ctx, bufout); }
+Handle(lt) { (void)t; return comparison("D;JGT", ctx, bufout); }
+Handle(gt) { (void)t; return comparison("D;JLT", ctx, bufout); }
 
 Handle(label) {
-  WriteLabel(t.arg1);
+  WriteStr("(");
+  WriteScoped(t.arg1);
+  WriteStr(")\n");
   return NULL;
 }
 
 Handle(goto) {
-  WriteA(t.arg1);
+  WriteStr("@");
+  WriteScoped(t.arg1);
+  WriteStr("\n");
   WriteStr("0;JMP\n");
   return NULL;
 }
 
 Handle(gotoif) {
   popd
-  WriteA(t.arg1);
+  CheckF(syncSP(ctx, bufout));
+  WriteStr("@");
+  WriteScoped(t.arg1);
+  WriteStr("\n");
   WriteStr("D;JNE\n");
   return NULL;
 }
 
-char* GenFLabel(Buffer* bufout, bool indexed) {
-  static unsigned i = 0;
-
-  WriteSpan(FuncName);
+char* GenFLabel(Context* ctx, Buffer* bufout, bool indexed) {
+  WriteSpan(ctx->funcName);
 
   if(indexed) {
-    WriteStr(".");
-    WriteSpan(SpanFromUlong(i));
-    i += 1;
+    WriteStr("$ret.");
+    WriteNum(ctx->retCount);
+    ctx->retCount += 1;
   }
 
   return NULL;
 }
 
-#define CheckF(...) { char* _err = __VA_ARGS__; if(_err) return _err; }
 #define PUSH(_reg) { WriteA(S(#_reg)); WriteStrNL("D=M"); pushd;}
 
+// Locals start at 0 and the pointers the function sets are saved, the rest was stored by the call
+char* staticEntry(Function* f, Buffer* bufout) {
+  for(int32_t i = 0; i < f->locals; i++) {
+    WriteFrame(f, FrameLocal(f, i));
+    WriteStrNL("M=0");
+  }
+  for(int p = 0; p < 2; p++) {
+    if(!(f->pointersSet >> p & 1)) continue;
+    WriteA(p ? S("THAT") : S("THIS"));
+    WriteStrNL("D=M");
+    WriteFrame(f, FramePointer(f, p));
+    WriteStrNL("M=D");
+  }
+  return NULL;
+}
+
+// The arguments of a call go from the stack to the frame of the callee
+char* staticArgs(Token t, Function* callee, Buffer* bufout) {
+  for(Size i = SpanToUlong(t.arg2); i-- > 0;) {
+    WriteStrNL("@SP");
+    WriteStrNL("AM=M-1");
+    WriteStrNL("D=M");
+    WriteFrame(callee, FrameArg(callee, i));
+    WriteStrNL("M=D");
+  }
+  return NULL;
+}
+
+// Arguments go from the stack to the frame, LCL and ARG are left alone as the callee doesn't use them
+char* staticCall(Token t, Function* callee, Context* ctx, Buffer* bufout) {
+  Byte buf[1024];
+  Buffer b = BufferInit(buf, sizeof(buf));
+  CheckF(GenFLabel(ctx, &b, true));
+  Span retLabel = BufferToSpan(&b);
+
+  CheckF(staticArgs(t, callee, bufout));
+  WriteA(retLabel);
+  WriteStrNL("D=A");
+  WriteFrame(callee, FRAMERET);
+  WriteStrNL("M=D");
+  WriteA(t.arg1);
+  WriteStrNL("0;JMP");
+  WriteLabel(retLabel);
+  return NULL;
+}
+
+// THIS and THAT as they were when f was called
+char* staticPointers(Function* f, Buffer* bufout) {
+  for(int p = 0; p < 2; p++) {
+    if(!(f->pointersSet >> p & 1)) continue;
+    WriteFrame(f, FramePointer(f, p));
+    WriteStrNL("D=M");
+    WriteA(p ? S("THAT") : S("THIS"));
+    WriteStrNL("M=D");
+  }
+  return NULL;
+}
+
+// The result is already where the first argument was, as after a return from a stack frame
+char* staticReturn(Function* f, Buffer* bufout) {
+  CheckF(staticPointers(f, bufout));
+  WriteFrame(f, FRAMERET);
+  WriteStrNL("A=M");
+  WriteStrNL("0;JMP");
+  return NULL;
+}
+
 Handle(function) {
-  FuncName = t.arg1;
+  ctx->funcName = t.arg1;
 
   WriteStr("(");
-  CheckF(GenFLabel(bufout, false));
+  CheckF(GenFLabel(ctx, bufout, false));
   WriteStrNL(")");
 
+  if(profiled(ctx)) CheckF(profileAdd(ctx->func->profileAddr, 1, ctx, bufout));
+  if(inStaticFrame(ctx)) return staticEntry(ctx->func, bufout);
+
   Size args = SpanToUlong(t.arg2);
   assert(args >= 0);
   
@@ -343,20 +929,13 @@ Handle(function) {
 
   return NULL;
 }
-Handle(call) {
-  // TODO: push ret address ...
-  Byte buf[1024];
-  Buffer b = BufferInit(buf, sizeof(buf));
-  CheckF(GenFLabel(&b,true));
-  Span retLabel = BufferToSpan(&b);
-
-  // push retAddress
-  WriteA(retLabel);
-  WriteStrNL("D=A");
+// Pushes the frame of a call to f, with the return address in D, and goes to f
+char* enterFrame(Token t, Context* ctx, Buffer* bufout) {
   pushd
 
   // push caller state
   PUSH(LCL);PUSH(ARG);PUSH(THIS);PUSH(THAT);
+  CheckF(syncSP(ctx, bufout));
 
   // ARG = SP - 5 - nArgs
   WriteA(S("SP"));
@@ -377,44 +956,9 @@ Handle(call) {
   // goto f
   WriteA(t.arg1);
   WriteStrNL("0;JMP");
-
-  // Write retAddress label
-  WriteLabel(retLabel);
   return NULL;
 }
 
-Handle(returne) {
-  (void)t;
-
-  // frame = LCL
-  WriteA(S("LCL"));
-  WriteStrNL("D=M");
-  WriteA(S("R13"));
-  WriteStrNL("M=D");
-
-  // retAddr = *(frame-5)
-  WriteA(S("R13"));
-  WriteStrNL("D=M");
-  WriteA(S("5"));
-  WriteStrNL("D=D-A");
-  WriteStrNL("A=D");
-  WriteStrNL("D=M");
-  WriteA(S("R14"));
-  WriteStrNL("M=D");
-
-  // *ARG = pop()
-  popd
-  WriteA(S("ARG"));
-  WriteStrNL("A=M");
-  WriteStrNL("M=D");
-
-  // SP = ARG+1
-  WriteA(S("ARG"));
-  WriteStrNL("D=M");
-  WriteStrNL("D=D+1");
-  WriteA(S("SP"));
-  WriteStrNL("M=D");
-
 #define TOA(_addr, _minus) \
   WriteA(S("R13")); \
   WriteStrNL("D=M"); \
@@ -424,49 +968,1991 @@ Handle(returne) {
   WriteA(S(#_addr)); \
   WriteStrNL("M=D")
 
-
+// The caller's LCL, ARG, THIS and THAT back from the frame in R13
+char* leaveFrame(Buffer* bufout) {
   TOA(THAT, 1);
   TOA(THIS, 2);
   TOA(ARG, 3);
   TOA(LCL, 4);
-
-  WriteA(S("R14"));
-  WriteStrNL("A=M"); \
-  WriteStrNL("0;JMP");
-
   return NULL;
 }
 
-char* bootstrap(Buffer* bufout) {
-  FuncName = S("Sys.init");
+// 'call f n' right before a return, f returns straight to our caller. With stack frames on both sides the
+// arguments go over those of the current function and f gets its stack, keeping the saved frame: compile made sure
+// they fit below it. A function with a static frame gets our return address in its frame, after our stack frame is
+// taken down or our pointers are put back, and a function with a stack frame is called as if from our caller.
+char* tailCall(Token t, Function* callee, Context* ctx, Buffer* bufout) {
+  ctx->tailCalls += 1;
+  if(callee->staticFrame) {
+    CheckF(staticArgs(t, callee, bufout));
+    if(inStaticFrame(ctx)) {
+      WriteFrame(ctx->func, FRAMERET);
+      WriteStrNL("D=M");
+      WriteFrame(callee, FRAMERET);
+      WriteStrNL("M=D");
+      CheckF(staticPointers(ctx->func, bufout));
+    } else {
+      // frame = LCL, retAddr = *(frame-5)
+      WriteA(S("LCL"));
+      WriteStrNL("D=M");
+      WriteA(S("R13"));
+      WriteStrNL("M=D");
+      WriteA(S("5"));
+      WriteStrNL("A=D-A");
+      WriteStrNL("D=M");
+      WriteFrame(callee, FRAMERET);
+      WriteStrNL("M=D");
+
+      // SP = ARG, f leaves its result there
+      WriteA(S("ARG"));
+      WriteStrNL("D=M");
+      WriteA(S("SP"));
+      WriteStrNL("M=D");
+      ctx->sp = 0;
+      CheckF(leaveFrame(bufout));
+    }
+    WriteA(t.arg1);
+    WriteStrNL("0;JMP");
+    return NULL;
+  }
 
-  WriteA(S("256"));
+  if(inStaticFrame(ctx)) {
+    CheckF(staticPointers(ctx->func, bufout));
+    WriteFrame(ctx->func, FRAMERET);
+    WriteStrNL("D=M");
+    return enterFrame(t, ctx, bufout);
+  }
+
+  for(Size i = SpanToUlong(t.arg2); i-- > 0;) {
+    char idx[32];
+    snprintf(idx, sizeof(idx), "%lu", (unsigned long)i);
+    CheckF(popf((Token) { pop, S("argument"), SpanFromString(idx) }, ctx, bufout));
+  }
+
+  // SP = LCL
+  WriteA(S("LCL"));
+  WriteStrNL("D=M");
+  WriteA(S("SP"));
+  WriteStrNL("M=D");
+  ctx->sp = 0;
+
+  WriteA(t.arg1);
+  WriteStrNL("0;JMP");
+  return NULL;
+}
+
+Handle(call) {
+  Function* callee = FTGet(&Functions, t.arg1);
+  if(ctx->tail) return tailCall(t, callee, ctx, bufout);
+  if(callee && callee->staticFrame) return staticCall(t, callee, ctx, bufout);
+
+  Byte buf[1024];
+  Buffer b = BufferInit(buf, sizeof(buf));
+  CheckF(GenFLabel(ctx, &b, true));
+  Span retLabel = BufferToSpan(&b);
+
+  // push retAddress
+  WriteA(retLabel);
+  WriteStrNL("D=A");
+  CheckF(enterFrame(t, ctx, bufout));
+
+  // Write retAddress label
+  WriteLabel(retLabel);
+  return NULL;
+}
+
+Handle(returne) {
+  (void)t;
+  if(inStaticFrame(ctx)) return staticReturn(ctx->func, bufout);
+
+  // frame = LCL
+  WriteA(S("LCL"));
+  WriteStrNL("D=M");
+  WriteA(S("R13"));
+  WriteStrNL("M=D");
+
+  // retAddr = *(frame-5)
+  WriteA(S("R13"));
+  WriteStrNL("D=M");
+  WriteA(S("5"));
+  WriteStrNL("D=D-A");
+  WriteStrNL("A=D");
+  WriteStrNL("D=M");
+  WriteA(S("R14"));
+  WriteStrNL("M=D");
+
+  // *ARG = pop()
+  popd
+  WriteA(S("ARG"));
+  WriteStrNL("A=M");
+  WriteStrNL("M=D");
+
+  // SP = ARG+1
+  WriteA(S("ARG"));
+  WriteStrNL("D=M");
+  WriteStrNL("D=D+1");
+  WriteA(S("SP"));
+  WriteStrNL("M=D");
+  ctx->sp = 0;
+
+  CheckF(leaveFrame(bufout));
+
+  WriteA(S("R14"));
+  WriteStrNL("A=M"); \
+  WriteStrNL("0;JMP");
+
+  return NULL;
+}
+
+char* bootstrap(Buffer* bufout) {
+  Context boot = { .vmFileName = "Bootstrap", .staticsFile = "Bootstrap", .funcName = S("Bootstrap") };
+
+  WriteA(S("256"));
   WriteStrNL("D=A");
   WriteA(S("SP"));
   WriteStrNL("M=D");
 
-  return callf((Token) {call, S("Sys.init"), S("0")}, bufout);
+  return callf((Token) {call, S("Sys.init"), S("0")}, &boot, bufout);
+}
+#undef Write
+#undef Handle
+
+char* tokenToOps(Token t, Context* ctx, Buffer* bufout) {
+  switch(t.type) {
+    case push: case pop: case add: case sub: case neg: case eq: case gt: case lt: case and: case or: case not:
+    case gotoeif: case Empty:
+      break;
+    default:
+      CheckF(syncSP(ctx, bufout));
+  }
+  switch(t.type) {
+#define X(_n) case _n: return _n##f(t, ctx, bufout);
+    INSTR
+#undef X
+    case gotoe: return gotof(t, ctx, bufout);
+    case gotoeif: return gotoiff(t, ctx, bufout);
+    case returne: return returnef(t, ctx, bufout);
+    case Empty: return NULL;
+    case Error:
+      return "An error occurred.";
+  }
+  return "Shouldn't get here as every branch returns.";
+}
+
+/* DEAD FUNCTION ELIMINATION */
+
+#define MAXFILESIZE (1<<20)
+
+// Records the code of each function in the file. Code before the first function is always emitted.
+char* scanFunctions(Span s, char* file) {
+  Function* f = NULL;
+
+  while(s.len > 0) {
+    SpanPair sp = SpanCut(s, '\n');
+    Span line = sp.head;
+    s = sp.tail;
+
+    Token token = parseLine(line);
+    if(token.type == function) {
+      f = FTAdd(&Functions, token.arg1);
+      if(!f) return "Too many functions in the program.";
+      f->code = (Span) {line.ptr, 0};
+      f->file = file;
+    }
+    if(f) f->code.len = line.ptr + line.len - f->code.ptr;
+  }
+  return NULL;
+}
+
+/* PROFILE GUIDED */
+
+// A profile, as written by vmi -f<file>, is one line per function and per if-goto that the program has:
+//   call <function> <times called>
+//   branch <function>$<label> <times jumped> <times not jumped>
+// Lines starting with // are comments. The counts of if-gotos to the same label add up.
+#define PGOHOT 1000     // Calls or loop iterations that make code hot
+#define PGOCOND 16      // Most commands in the condition of a loop that is rotated
+#define PGOCOPYMAX 1024 // Commands copied by all the rotated loops together
+#define MAXBRANCHES (1 << 16)
+#define MAXLAYOUTLINES (1 << 16) // Per function, lines past it are not laid out again
+
+typedef struct {
+  Span name; // function$label
+  int64_t taken;
+  int64_t fell;
+} BranchProfile;
+
+static Byte ProfileMem[MAXFILESIZE];
+static Span ProfileText;
+static BranchProfile Branches[MAXBRANCHES];
+static int32_t BranchCount = 0;
+static int32_t PgoCopied = 0;
+
+int compareSpans(Span a, Span b) {
+  int c = memcmp(a.ptr, b.ptr, a.len < b.len ? a.len : b.len);
+  return c ? c : (a.len > b.len) - (a.len < b.len);
+}
+
+int compareBranches(const void* a, const void* b) {
+  return compareSpans(((BranchProfile*)a)->name, ((BranchProfile*)b)->name);
+}
+
+// Reads the profile and sorts its branches by name. The calls wait for profileCalls, when the functions are known.
+char* loadProfile(char* path) {
+  Buffer buf = BufferInit(ProfileMem, sizeof(ProfileMem));
+  SpanResult sr = OsSlurp(path, sizeof(ProfileMem), &buf);
+  if(sr.error) return "Cannot read the profile.";
+  ProfileText = sr.data;
+
+  for(Span s = ProfileText; s.len > 0;) {
+    SpanPair sp = SpanCut(s, '\n');
+    Span line = SpanTrim(sp.head);
+    s = sp.tail;
+    if(line.len == 0 || line.ptr[0] == '/') continue;
+
+    SpanPair kind = SpanCut(line, ' ');
+    if(SpanEqual(kind.head, S("call"))) continue;
+    SpanPair name = SpanCut(kind.tail, ' ');
+    SpanPair taken = SpanCut(name.tail, ' ');
+    if(!SpanEqual(kind.head, S("branch")) || !taken.head.len || !taken.tail.len) return "Bad line in the profile.";
+    if(BranchCount == MAXBRANCHES) return "Too many branches in the profile.";
+    Branches[BranchCount++] = (BranchProfile) { name.head, SpanToUlong(taken.head), SpanToUlong(taken.tail) };
+  }
+
+  qsort(Branches, BranchCount, sizeof(BranchProfile), compareBranches);
+  int32_t n = 0;
+  for(int32_t i = 0; i < BranchCount; i++) {
+    if(n > 0 && SpanEqual(Branches[n - 1].name, Branches[i].name)) {
+      Branches[n - 1].taken += Branches[i].taken;
+      Branches[n - 1].fell += Branches[i].fell;
+    } else {
+      Branches[n++] = Branches[i];
+    }
+  }
+  BranchCount = n;
+  return NULL;
+}
+
+// Functions not in the profile are left to the usual heuristics
+void profileCalls(void) {
+  for(Span s = ProfileText; s.len > 0;) {
+    SpanPair sp = SpanCut(s, '\n');
+    s = sp.tail;
+
+    SpanPair kind = SpanCut(SpanTrim(sp.head), ' ');
+    if(!SpanEqual(kind.head, S("call"))) continue;
+    SpanPair name = SpanCut(kind.tail, ' ');
+    Function* f = FTGet(&Functions, name.head);
+    if(!f) continue;
+    f->profiled = true;
+    f->timesCalled += SpanToUlong(name.tail);
+  }
+}
+
+BranchProfile* findBranch(Span func, Span label) {
+  Byte key[512];
+  if(func.len + 1 + label.len > (Size)sizeof(key)) return NULL;
+  memcpy(key, func.ptr, func.len);
+  key[func.len] = '$';
+  memcpy(key + func.len + 1, label.ptr, label.len);
+
+  BranchProfile probe = { SPAN(key, func.len + 1 + label.len), 0, 0 };
+  return bsearch(&probe, Branches, BranchCount, sizeof(BranchProfile), compareBranches);
+}
+
+typedef struct {
+  Span line;
+  Token token;
+} LayoutLine;
+
+typedef enum { KeepBranch, SwapArms, RotateLoop } LayoutKind;
+
+// Decided for an if-goto. Swapping it: the 'label A' it jumps to, the 'goto B' ending the arm that falls through and
+// 'label B'. Rotating it: 'label W' at the top of the loop, the 'goto W' at the bottom and the 'label E' it exits to.
+typedef struct {
+  LayoutKind kind;
+  int32_t label;
+  int32_t jump;
+  int32_t end;
+} Layout;
+
+// What was laid out again, for the report once all files are. A branch is laid out once, so there are no more
+// than in the profile.
+typedef struct {
+  LayoutKind kind;
+  Span func;
+  Span label;
+  int64_t taken;
+  int64_t fell;
+  int32_t copied; // Commands of the condition of a rotated loop
+} LayoutDecision;
+
+static LayoutDecision Decisions[MAXBRANCHES];
+static int32_t DecisionCount = 0;
+
+void recordLayout(LayoutDecision d) {
+  if(DecisionCount < MAXBRANCHES) Decisions[DecisionCount++] = d;
+}
+
+void reportLayout(void) {
+  for(int32_t i = 0; i < DecisionCount; i++) {
+    LayoutDecision* d = &Decisions[i];
+    if(d->kind == RotateLoop) {
+      printf("Profile: rotated the loop %.*s$%.*s, %lld iterations for %lld exits, copied %d commands\n",
+             (int)d->func.len, (char*)d->func.ptr, (int)d->label.len, (char*)d->label.ptr, (long long)d->fell,
+             (long long)d->taken, d->copied);
+    } else {
+      printf("Profile: %.*s$%.*s jumped %lld of %lld times, the other arm falls through now\n", (int)d->func.len,
+             (char*)d->func.ptr, (int)d->label.len, (char*)d->label.ptr, (long long)d->taken,
+             (long long)(d->taken + d->fell));
+    }
+  }
+}
+
+int32_t findLabel(LayoutLine* lines, int32_t n, int32_t from, Span name) {
+  for(int32_t i = from; i < n; i++) {
+    if(lines[i].token.type == label && SpanEqual(lines[i].token.arg1, name)) return i;
+  }
+  return -1;
+}
+
+// Of the lines in [from, to), -1 if they are all empty
+int32_t lastCommand(LayoutLine* lines, int32_t from, int32_t to) {
+  for(int32_t i = to - 1; i >= from; i--) {
+    if(lines[i].token.type != Empty) return i;
+  }
+  return -1;
+}
+
+// The not before the if-goto at p can go if what it negates is a comparison, so exactly true or false
+bool dropsNot(LayoutLine* lines, int32_t p) {
+  if(p < 2 || lines[p - 1].token.type != not) return false;
+  TokenType t = lines[p - 2].token.type;
+  return t == eq || t == gt || t == lt;
+}
+
+// The counts are by label, so only the first if-goto to one is laid out again
+bool laidOut(LayoutLine* lines, Layout* layouts, int32_t p, Span name) {
+  for(int32_t q = 0; q < p; q++) {
+    if(layouts[q].kind != KeepBranch && SpanEqual(lines[q].token.arg1, name)) return true;
+  }
+  return false;
+}
+
+// Decides how each if-goto of the function is laid out, the arm that runs most should fall through
+void planLayout(LayoutLine* lines, Layout* layouts, int32_t n, Span func) {
+  for(int32_t p = 0; p < n; p++) {
+    layouts[p].kind = KeepBranch;
+    Token t = lines[p].token;
+    if(t.type != gotoeif) continue;
+    BranchProfile* b = findBranch(func, t.arg1);
+    int32_t target = findLabel(lines, n, p + 1, t.arg1);
+    int32_t jump = target < 0 ? -1 : lastCommand(lines, p + 1, target);
+    if(!b || jump < 0 || lines[jump].token.type != gotoe || laidOut(lines, layouts, p, t.arg1)) continue;
+
+    // 'label W, condition, if-goto E, body, goto W, label E' tests the condition at the bottom instead, which
+    // copies it but saves the goto of each iteration
+    int32_t top = p - 1, cond = 0;
+    for(; top >= 0 && lines[top].token.type != label; top--) {
+      TokenType tt = lines[top].token.type;
+      if(tt == gotoe || tt == gotoeif || tt == returne || tt == function) break;
+      cond += tt != Empty;
+    }
+    if(top >= 0 && lines[top].token.type == label && SpanEqual(lines[top].token.arg1, lines[jump].token.arg1)) {
+      if(cond == 0 || cond > PGOCOND || PgoCopied + cond > PGOCOPYMAX) continue;
+      if(b->fell < PGOHOT || b->fell < 2 * b->taken) continue;
+      layouts[p] = (Layout) { RotateLoop, top, jump, target };
+      PgoCopied += cond;
+      recordLayout((LayoutDecision) { RotateLoop, func, t.arg1, b->taken, b->fell, cond });
+      continue;
+    }
+
+    // 'if-goto A, X, goto B, label A, Y, label B' becomes 'if-goto A.arm negated, label A, Y, goto B, label A.arm,
+    // X, label B' when X runs more, so that it doesn't take the goto
+    int32_t end = findLabel(lines, n, target + 1, lines[jump].token.arg1);
+    if(end < 0 || b->fell <= b->taken) continue;
+    layouts[p] = (Layout) { SwapArms, target, jump, end };
+    recordLayout((LayoutDecision) { SwapArms, func, t.arg1, b->taken, b->fell, 0 });
+  }
+}
+
+// Jumps to label.suffix where the if-goto at p would not jump
+char* writeInverted(LayoutLine* lines, int32_t p, Span label, char* suffix, Buffer* bufout) {
+  if(!dropsNot(lines, p)) {
+    WriteStrNL("push constant 0");
+    WriteStrNL("eq");
+  }
+  WriteStr("if-goto ");
+  WriteSpan(label);
+  WriteStrNL(suffix);
+  return NULL;
+}
+
+// Writes the lines in [lo, hi), laying out the if-gotos whose arms are all inside
+char* layoutRange(LayoutLine* lines, Layout* layouts, int32_t lo, int32_t hi, Buffer* bufout) {
+  #define APPLIES(_p) ((_p) < hi && layouts[(_p)].kind != KeepBranch && layouts[(_p)].end < hi && \
+                       (layouts[(_p)].kind == SwapArms || layouts[(_p)].label >= lo))
+
+  for(int32_t p = lo; p < hi; p++) {
+    Layout* l = &layouts[p];
+    Token t = lines[p].token;
+
+    if(t.type == not && APPLIES(p + 1) && layouts[p + 1].kind == SwapArms && dropsNot(lines, p + 1)) continue;
+    if(t.type != gotoeif || !APPLIES(p)) {
+      WriteSpan(lines[p].line);
+      WriteStr("\n");
+      continue;
+    }
+
+    if(l->kind == SwapArms) {
+      CheckF(writeInverted(lines, p, t.arg1, ".arm", bufout));
+      CheckF(layoutRange(lines, layouts, l->label, l->end, bufout));
+      int32_t last = lastCommand(lines, l->label, l->end);
+      TokenType lt = lines[last].token.type;
+      if(lt != gotoe && lt != returne) {
+        WriteSpan(lines[l->jump].line);
+        WriteStr("\n");
+      }
+      WriteStr("label ");
+      WriteSpan(t.arg1);
+      WriteStrNL(".arm");
+      CheckF(layoutRange(lines, layouts, p + 1, l->jump, bufout));
+    } else {
+      Span top = lines[l->label].token.arg1;
+      WriteSpan(lines[p].line);
+      WriteStr("\n");
+      WriteStr("label ");
+      WriteSpan(top);
+      WriteStrNL(".body");
+      CheckF(layoutRange(lines, layouts, p + 1, l->jump, bufout));
+      for(int32_t i = l->label + 1; i < p - dropsNot(lines, p); i++) {
+        WriteSpan(lines[i].line);
+        WriteStr("\n");
+      }
+      CheckF(writeInverted(lines, p, top, ".body", bufout));
+    }
+    p = l->end - 1;
+  }
+  #undef APPLIES
+  return NULL;
+}
+
+// Copies the file to bufout with its if-gotos laid out as the profile says
+char* layoutFile(Span source, Span file, Buffer* bufout) {
+  static LayoutLine lines[MAXLAYOUTLINES];
+  static Layout layouts[MAXLAYOUTLINES];
+  Span func = file; // For code outside of any function
+  int32_t n = 0;
+
+  while(source.len > 0) {
+    SpanPair sp = SpanCut(source, '\n');
+    source = sp.tail;
+
+    Token t = parseLine(sp.head);
+    if(t.type == function || n == MAXLAYOUTLINES) {
+      planLayout(lines, layouts, n, func);
+      CheckF(layoutRange(lines, layouts, 0, n, bufout));
+      n = 0;
+    }
+    if(t.type == function) func = t.arg1;
+    lines[n++] = (LayoutLine) { sp.head, t };
+  }
+  planLayout(lines, layouts, n, func);
+  return layoutRange(lines, layouts, 0, n, bufout);
+}
+
+/* INLINING */
+
+// Functions of up to this many commands are inlined, 0 disables inlining
+#define INLINEMAX 12
+static Size InlineMax = INLINEMAX;
+
+// Arguments and locals of inlined functions go in temp, whose 8 slots bound what can be inlined
+#define TEMPSLOTS 8
+#define MAXLABELS 1024 // Per function
+
+typedef struct {
+  Span name;
+  int32_t height;
+} LabelHeight;
+
+// Stack height after a goto or a return, until a label that was jumped to
+#define UNREACHED -1
+// Height of a label first seen while unreachable, so that jumping to it later fails
+#define DEADLABEL -2
+
+// Every jump to a label must find the same stack height
+bool mergeHeight(LabelHeight* labels, int32_t* count, Span name, int32_t* height) {
+  for(int32_t i = 0; i < *count; i++) {
+    if(!SpanEqual(labels[i].name, name)) continue;
+    if(*height == UNREACHED) *height = labels[i].height;
+    return *height == labels[i].height;
+  }
+  if(*count == MAXLABELS) return false;
+  labels[(*count)++] = (LabelHeight) { name, *height == UNREACHED ? DEADLABEL : *height };
+  return true;
+}
+
+// Works out what f uses and checks that its stack height is known at every command, which is what lets
+// inlining and static frames find the result of a return without ARG
+void analyzeFunction(Function* f) {
+  static LabelHeight labels[MAXLABELS];
+  int32_t labelCount = 0;
+  int32_t height = 0;
+
+  f->balanced = false;
+  SpanPair sp = SpanCut(f->code, '\n');
+  f->locals = SpanToUlong(parseLine(sp.head).arg2);
+  Span s = sp.tail;
+
+  while(s.len > 0) {
+    sp = SpanCut(s, '\n');
+    s = sp.tail;
+
+    Token t = parseLine(sp.head);
+    if(t.type == Empty) continue;
+    if(t.type == function || t.type == Error) return;
+    f->commands += 1;
+
+    // Segments are checked even in unreachable code, it gets emitted all the same
+    Size i = SpanToUlong(t.arg2);
+    if(t.type == push || t.type == pop) {
+      if(SpanEqual(t.arg1, S("argument"))) {
+        if(i < TEMPSLOTS) f->argsUsed |= 1 << i;
+        if((int32_t)i >= f->args) f->args = i + 1;
+      } else if(SpanEqual(t.arg1, S("local"))) {
+        if(i >= (Size)f->locals) return;
+      } else if(SpanEqual(t.arg1, S("temp"))) {
+        if(i >= TEMPSLOTS) return;
+        f->tempsUsed |= 1 << i;
+      } else if(SpanEqual(t.arg1, S("pointer")) && t.type == pop) {
+        f->pointersSet |= i ? 2 : 1;
+      }
+    }
+    if(t.type == call) f->calls = true;
+
+    if(t.type == label) {
+      if(!mergeHeight(labels, &labelCount, t.arg1, &height)) return;
+      continue;
+    }
+    if(height < 0) continue; // Unreachable, as a goto after a return
+
+    switch(t.type) {
+      case push:
+        height += 1;
+        break;
+      case pop: case add: case sub: case eq: case gt: case lt: case and: case or:
+        height -= 1;
+        break;
+      case call:
+        height -= i;
+        if(height < 0) return;
+        height += 1;
+        break;
+      case gotoe:
+        if(!mergeHeight(labels, &labelCount, t.arg1, &height)) return;
+        height = UNREACHED;
+        break;
+      case gotoeif:
+        height -= 1;
+        if(height < 0 || !mergeHeight(labels, &labelCount, t.arg1, &height)) return;
+        break;
+      case returne:
+        if(height != 1) return;
+        height = UNREACHED;
+        break;
+      default:
+        break;
+    }
+    if(height < 0 && t.type != gotoe && t.type != returne) return; // Would use the stack of the caller
+  }
+  f->balanced = height < 0; // Can't fall off the end
+}
+
+// f can be inlined if it is small and makes no calls, so can't recurse
+bool inlineCandidate(Function* f) {
+  return InlineMax > 0 && f->balanced && !f->calls && f->commands <= InlineMax && f->args <= TEMPSLOTS;
+}
+
+// Its arguments, locals and saved pointers have to fit in the temp slots the body leaves free
+static inline bool inlineFits(Function* f) {
+  int need = bitCount(f->argsUsed) + f->locals + bitCount(f->pointersSet);
+  return need <= TEMPSLOTS - bitCount(f->tempsUsed);
+}
+
+struct InlineSite {
+  Span caller;
+  Span callee;
+  long saved; // Instructions of the call and of the function as translated, minus those of the inlined site
+};
+
+char* emitInline(Span line, Token t, Function* f, Context* ctx, Buffer* bufout);
+
+// Inlined at a site of its own, f has to come out shorter than a call to it and f as it is translated
+bool inlineWins(Function* f) {
+  Byte* b = malloc(CHUNKSIZE);
+  if(!b) return false;
+  Buffer buf = BufferInit(b, CHUNKSIZE);
+  char args[32];
+  snprintf(args, sizeof(args), "%d", (int)f->args);
+  Token t = { call, f->name, SpanFromString(args) };
+  Context ctx = { .vmFileName = "Inline", .staticsFile = "Inline", .funcName = S("Inline") };
+
+  bool wins = !emitInline(S("call"), t, f, &ctx, &buf) && ctx.inlined[0].saved > 0;
+  free(ctx.inlined);
+  free(ctx.ir);
+  free(ctx.scratch);
+  free(b);
+  return wins;
+}
+
+// Inlinable functions fit in temp and win. With a profile, functions that never ran are not worth the copies.
+void analyzeInline(Function* f) {
+  f->inlinable = inlineCandidate(f) && inlineFits(f) && !(f->profiled && !f->timesCalled) && inlineWins(f);
+}
+
+// A call is inlined if f is inlinable and it passes all the arguments f uses. Callers that never ran in the
+// profile keep their calls.
+bool inlineSite(Function* caller, Function* f, Size nArgs) {
+  if(!f || !f->inlinable) return false;
+  if(caller && caller->profiled && !caller->timesCalled) return false;
+  if((int32_t)nArgs < f->args) return false; // Uses arguments it is not given
+  return true;
+}
+
+void reportProfileInlining(void) {
+  int32_t cold = 0, profiled = 0;
+  for(int32_t i = 0; i < Functions.len; i++) {
+    Function* f = Functions.inOrder[i];
+    if(!f->profiled) continue;
+    profiled += 1;
+    cold += !f->timesCalled;
+
+    if(!f->timesCalled && inlineCandidate(f)) printf("Profile: not inlining %.*s, never called\n", (int)f->name.len,
+                                                   (char*)f->name.ptr);
+  }
+  if(cold) printf("Profile: %d of %d functions never ran, their calls are not inlined.\n", cold, profiled);
+}
+
+// Marks live all the functions transitively called from root. Returns false if root is not defined.
+// Inlined calls don't count, a function only ever inlined is not emitted.
+bool markLive(Span root) {
+  static Function* worklist[FMAXLEN + 1];
+  int32_t top = 0;
+
+  Function* f = FTGet(&Functions, root);
+  if(!f) return false;
+  f->live = true;
+  worklist[top++] = f;
+
+  while(top > 0) {
+    Function* caller = worklist[--top];
+    Span s = caller->code;
+
+    while(s.len > 0) {
+      SpanPair sp = SpanCut(s, '\n');
+      s = sp.tail;
+
+      Token token = parseLine(sp.head);
+      if(token.type != call) continue;
+
+      Function* callee = FTGet(&Functions, token.arg1);
+      if(inlineSite(caller, callee, SpanToUlong(token.arg2))) continue;
+      if(callee && !callee->live) { // Calls to undefined functions are left for the assembler to report
+        callee->live = true;
+        worklist[top++] = callee;
+      }
+    }
+  }
+  return true;
+}
+
+void markAllLive(void) {
+  for(int32_t i = 0; i < Functions.len; i++) Functions.inOrder[i]->live = true;
+}
+
+// Counts the lines that the assembler turns into an instruction
+Size countInstructions(Span s) {
+  Size n = 0;
+  while(s.len > 0) {
+    SpanPair sp = SpanCut(s, '\n');
+    Span line = SpanTrim(sp.head);
+    s = sp.tail;
+    n += line.len > 0 && line.ptr[0] != '(' && line.ptr[0] != '/';
+  }
+  return n;
+}
+
+void reportDeadFunctions(void) {
+  int32_t dropped = 0;
+  Size saved = 0;
+
+  for(int32_t i = 0; i < Functions.len; i++) {
+    Function* f = Functions.inOrder[i];
+    if(f->live) continue;
+    printf("Dropped %.*s (%ld instructions)\n", (int)f->name.len, (char*)f->name.ptr, (long)f->romSize);
+    dropped += 1;
+    saved += f->romSize;
+  }
+  if(dropped) printf("Dropped %d of %d functions, saved %ld ROM words.\n", dropped, Functions.len, (long)saved);
+}
+
+/* STATIC FRAMES */
+
+// The assembler puts variables from RAM[16] up to the stack at 256, statics first come first served
+#define VARIABLEWORDS (256 - 16)
+#define MAXCALLEES (1 << 16)
+
+static Function* Callees[MAXCALLEES];
+static int32_t CalleeCount = 0;
+
+// Statics of one file, numbered from 0 by the compiler
+Size countStatics(Span s) {
+  Size n = 0;
+  while(s.len > 0) {
+    SpanPair sp = SpanCut(s, '\n');
+    s = sp.tail;
+    Token t = parseLine(sp.head);
+    if((t.type == push || t.type == pop) && SpanEqual(t.arg1, S("static")) && SpanToUlong(t.arg2) + 1 > n) {
+      n = SpanToUlong(t.arg2) + 1;
+    }
+  }
+  return n;
+}
+
+// Edges from the live functions to the functions they call without inlining them
+bool buildCallGraph(void) {
+  for(int32_t i = 0; i < Functions.len; i++) {
+    Function* f = Functions.inOrder[i];
+    if(!f->live) continue;
+    f->firstCallee = CalleeCount;
+
+    for(Span s = f->code; s.len > 0;) {
+      SpanPair sp = SpanCut(s, '\n');
+      s = sp.tail;
+
+      Token t = parseLine(sp.head);
+      if(t.type != call) continue;
+
+      Function* callee = FTGet(&Functions, t.arg1);
+      Size nArgs = SpanToUlong(t.arg2);
+      if(!callee || inlineSite(f, callee, nArgs)) continue;
+      if(CalleeCount == MAXCALLEES) return false;
+      Callees[CalleeCount++] = callee;
+      if((int32_t)nArgs > callee->siteArgs) callee->siteArgs = nArgs;
+      callee->called = true;
+      if(callee == f) f->recursive = true;
+    }
+    f->calleeCount = CalleeCount - f->firstCallee;
+  }
+  return true;
+}
+
+// Tarjan's algorithm. Components are numbered callees first, so callers come first going down from the last one.
+static Function* SccStack[FMAXLEN + 1];
+static int32_t SccTop = 0;
+static Function* SccMembers[FMAXLEN + 1]; // Grouped by component
+static int32_t SccFirst[FMAXLEN + 2];
+static int32_t SccCount = 0;
+static int32_t SccNextIndex = 0;
+
+void strongConnect(Function* f) {
+  f->sccIndex = f->lowLink = SccNextIndex++;
+  SccStack[SccTop++] = f;
+  f->onStack = true;
+
+  for(int32_t i = 0; i < f->calleeCount; i++) {
+    Function* g = Callees[f->firstCallee + i];
+    if(g->sccIndex < 0) {
+      strongConnect(g);
+      if(g->lowLink < f->lowLink) f->lowLink = g->lowLink;
+    } else if(g->onStack && g->sccIndex < f->lowLink) {
+      f->lowLink = g->sccIndex;
+    }
+  }
+  if(f->lowLink != f->sccIndex) return;
+
+  int32_t next = SccFirst[SccCount];
+  Function* m;
+  do {
+    m = SccStack[--SccTop];
+    m->onStack = false;
+    m->scc = SccCount;
+    SccMembers[next++] = m;
+  } while(m != f);
+  SccFirst[SccCount + 1] = next;
+
+  // More than one function calling each other
+  if(next - SccFirst[SccCount] > 1) {
+    for(int32_t i = SccFirst[SccCount]; i < next; i++) SccMembers[i]->recursive = true;
+  }
+  SccCount += 1;
+}
+
+// Functions that can never be on the stack twice get their arguments and locals at fixed addresses. Frames of
+// functions that are never active at the same time overlap: each one starts after the frames of all its callers.
+// Sys.init and the functions no one calls keep their frames on the stack: they are entered from the bootstrap or
+// from a test that sets up a stack frame. Returns the RAM words used.
+int32_t assignStaticFrames(Size statics) {
+  if(!buildCallGraph() || statics >= VARIABLEWORDS) return 0;
+  int32_t budget = VARIABLEWORDS - statics;
+
+  for(int32_t i = 0; i < Functions.len; i++) Functions.inOrder[i]->sccIndex = -1;
+  for(int32_t i = 0; i < Functions.len; i++) {
+    Function* f = Functions.inOrder[i];
+    if(f->live && f->sccIndex < 0) strongConnect(f);
+  }
+
+  static int32_t start[FMAXLEN + 1];
+  memset(start, 0, sizeof(start));
+  int32_t used = 0;
+
+  for(int32_t c = SccCount; c-- > 0;) {
+    int32_t end = start[c];
+    Function* f = SccMembers[SccFirst[c]];
+    if(!f->recursive && f->balanced && f->called && !SpanEqual(f->name, S("Sys.init")) &&
+       start[c] + frameSize(f) <= budget) {
+      f->staticFrame = true;
+      f->frameBase = start[c];
+      end += frameSize(f);
+      if(end > used) used = end;
+    }
+
+    for(int32_t m = SccFirst[c]; m < SccFirst[c + 1]; m++) {
+      Function* member = SccMembers[m];
+      for(int32_t i = 0; i < member->calleeCount; i++) {
+        Function* g = Callees[member->firstCallee + i];
+        if(g->scc != c && start[g->scc] < end) start[g->scc] = end;
+      }
+    }
+  }
+  return used;
+}
+
+// So that the frames can be assigned again
+void clearCallGraph(void) {
+  CalleeCount = SccTop = SccCount = SccNextIndex = 0;
+  for(int32_t i = 0; i < Functions.len; i++) {
+    Function* f = Functions.inOrder[i];
+    f->firstCallee = f->calleeCount = f->siteArgs = f->frameBase = 0;
+    f->called = f->recursive = f->onStack = f->staticFrame = false;
+  }
+}
+
+// Dead functions are measured as -a would translate them, so frames are first assigned with every function live.
+// The dead ones keep what they got there, their code is never emitted and can't run into the frames of the others.
+int32_t assignFramesMeasuringDead(Size statics) {
+  static bool live[FMAXLEN + 1];
+  static Function kept[FMAXLEN + 1];
+  bool anyDead = false;
+  for(int32_t i = 0; i < Functions.len; i++) {
+    live[i] = Functions.inOrder[i]->live;
+    anyDead |= !live[i];
+  }
+  if(!anyDead) return assignStaticFrames(statics);
+
+  markAllLive();
+  assignStaticFrames(statics);
+  for(int32_t i = 0; i < Functions.len; i++) kept[i] = *Functions.inOrder[i];
+  clearCallGraph();
+  for(int32_t i = 0; i < Functions.len; i++) Functions.inOrder[i]->live = live[i];
+
+  int32_t used = assignStaticFrames(statics);
+  for(int32_t i = 0; i < Functions.len; i++) {
+    Function* f = Functions.inOrder[i];
+    if(f->live) continue;
+    f->staticFrame = kept[i].staticFrame;
+    f->frameBase = kept[i].frameBase;
+    f->siteArgs = kept[i].siteArgs;
+  }
+  return used;
+}
+
+void reportStaticFrames(int32_t words) {
+  int32_t n = 0;
+  for(int32_t i = 0; i < Functions.len; i++) n += Functions.inOrder[i]->live && Functions.inOrder[i]->staticFrame;
+  if(n) printf("Static frames for %d functions in %d RAM words.\n", n, words);
+}
+
+/* PROFILING */
+
+// Gives each live function its counters, as many as fit. Returns how many got them. Dead functions get theirs after
+// them, to be measured as -a would translate them: they are left out of the map and never run.
+int32_t assignProfileCounters(void) {
+  int32_t n = 0, live = 0;
+  for(int pass = 0; pass < 2; pass++) {
+    for(int32_t i = 0; i < Functions.len; i++) {
+      Function* f = Functions.inOrder[i];
+      int32_t addr = PROFILEBASE + n * PROFILEWORDS;
+      if(f->live == pass || addr + PROFILEWORDS > PROFILEEND) continue;
+      f->profileAddr = addr;
+      n += 1;
+    }
+    if(!pass) live = n;
+  }
+  return live;
+}
+
+// One line per function: the address of its counters and its name. A count is high * 32768 + low, below 2^30.
+char* writeProfileMap(char* path) {
+  FILE* map = fopen(path, "w");
+  if(!map) return "Cannot open the profile map for writing.";
+
+  fprintf(map, "// calls high, calls low%s at address + 0..%d\n", Profile == ProfileCycles ? ", cycles high, cycles low" : "",
+          Profile == ProfileCycles ? 3 : 1);
+  for(int32_t i = 0; i < Functions.len; i++) {
+    Function* f = Functions.inOrder[i];
+    if(f->live && f->profileAddr) fprintf(map, "%d %.*s\n", f->profileAddr, (int)f->name.len, (char*)f->name.ptr);
+  }
+  return fclose(map) ? "Error writing the profile map." : NULL;
+}
+
+/* IR */
+
+// Straight runs of stack commands, up to an if-goto, are lifted into three-address code over values, one for each
+// command that pushes. Each value is popped once, so a block is a forest of expressions whose roots are the stores,
+// the branch and what stays on the stack. A value is computed by its user unless a store comes in between, which
+// folds copies and constants into the instructions using them. Otherwise it is computed where it was pushed and
+// waits in R14, R15, a temp slot the function doesn't use or, failing those, a slot above the stack. D only ever
+// holds the value being computed.
+#define IRMAX 256 // Commands in a block, longer runs are split
+
+static bool UseIR = true;
+static bool DumpIR = false;
+
+typedef enum { ConstOperand, MemOperand, StackOperand, ValueOperand, HomeOperand } OperandKind;
+
+typedef struct {
+  OperandKind kind;
+  int32_t n;     // The constant, the index, the depth on the stack, the instruction of the value or the home
+  Span segment;
+  Span index;
+} Operand;
+
+// Where a value waits for its user, from 0 up registers then slots above the stack
+#define HOMEFOLDED -1   // Computed by the user
+#define HOMESTACK -2    // Never popped in the block, written to its slot on the stack
+#define HOMEREGISTER -3 // Until lowering picks one
+#define HOMESPILL 16
+
+typedef struct {
+  TokenType op;   // push copies a, pop stores a in dst, if-goto branches on a, the others compute
+  Operand a, b, dst;
+  Span label;
+  int32_t depth;  // Of the result on the stack, relative to the start of the block
+  int32_t user;   // Instruction that pops the result, -1 if it stays on the stack
+  int32_t home;
+  Size words;     // Written when lowering it, with the values it computes, for the ROM report
+} IrInstr;
+
+struct IrBlock {
+  IrInstr code[IRMAX];
+  int32_t count;
+  int32_t stores[IRMAX + 1]; // Before each instruction
+  int32_t base;              // ctx->sp at the start
+  int32_t moved;             // How far SP in RAM has been moved up since
+  int32_t depth;             // At the end
+  int32_t maxDepth;
+  uint16_t regsFree;
+  bool spillUsed[IRMAX];
+};
+
+#define IRREGISTERS 10
+static const int IrRegisters[IRREGISTERS] = { 14, 15, TEMPBASE + 7, TEMPBASE + 6, TEMPBASE + 5, TEMPBASE + 4,
+                                              TEMPBASE + 3, TEMPBASE + 2, TEMPBASE + 1, TEMPBASE };
+
+static inline bool isCompare(TokenType t) { return t == eq || t == lt || t == gt; }
+static inline bool isBinary(TokenType t) { return t == add || t == sub || t == and || t == or || isCompare(t); }
+static inline bool isUnary(TokenType t) { return t == neg || t == not; }
+
+bool irCommand(TokenType t) {
+  return t == push || t == pop || t == gotoeif || isBinary(t) || isUnary(t);
+}
+
+// Pops the simulated stack, from below the block once it is empty
+static Operand irPop(IrBlock* b, Operand* stack, int32_t* top, int32_t* depth, int32_t user) {
+  *depth -= 1;
+  if(*top == 0) return (Operand) { StackOperand, *depth, SPAN0, SPAN0 };
+  Operand o = stack[--*top];
+  b->code[o.n].user = user;
+  return o;
+}
+
+char* irLift(Span lines, Context* ctx, IrBlock* b) {
+  Operand stack[IRMAX];
+  int32_t top = 0, depth = 0;
+  b->count = 0;
+  b->maxDepth = 0;
+  b->stores[0] = 0;
+
+  while(lines.len > 0) {
+    SpanPair sp = SpanCut(lines, '\n');
+    lines = sp.tail;
+    Token t = parseLine(sp.head);
+    if(t.type == Empty) continue;
+
+    int32_t k = b->count++;
+    IrInstr* in = &b->code[k];
+    *in = (IrInstr) { .op = t.type, .user = -1, .home = HOMEFOLDED };
+    Operand segment = { MemOperand, (int32_t)SpanToUlong(t.arg2), t.arg1, t.arg2 };
+    if(t.type == push || t.type == pop) {
+      if(SpanEqual(t.arg1, S("constant"))) segment.kind = ConstOperand;
+      else if(!isDirect(t.arg1, ctx) && fixedMap(t.arg1).error) return "Not a known segment type.";
+    }
+
+    if(t.type == push) {
+      in->a = segment;
+    } else if(t.type == pop) {
+      if(segment.kind == ConstOperand) return "Cannot pop into the constant segment.";
+      in->a = irPop(b, stack, &top, &depth, k);
+      in->dst = segment;
+    } else if(isBinary(t.type)) {
+      in->b = irPop(b, stack, &top, &depth, k);
+      in->a = irPop(b, stack, &top, &depth, k);
+    } else {
+      in->a = irPop(b, stack, &top, &depth, k);
+      in->label = t.arg1;
+    }
+    if(t.type != pop && t.type != gotoeif) {
+      in->depth = depth;
+      stack[top++] = (Operand) { ValueOperand, k, SPAN0, SPAN0 };
+      depth += 1;
+      if(depth > b->maxDepth) b->maxDepth = depth;
+    }
+    b->stores[k + 1] = b->stores[k] + (t.type == pop);
+  }
+  b->depth = depth;
+
+  // Copy propagation, constants can always go to their user
+  for(int32_t i = 0; i < b->count; i++) {
+    IrInstr* in = &b->code[i];
+    if(in->op == pop || in->op == gotoeif) continue;
+    if(in->user < 0) in->home = HOMESTACK;
+    else if(b->stores[in->user] == b->stores[i + 1] || (in->op == push && in->a.kind == ConstOperand)) in->home = HOMEFOLDED;
+    else in->home = HOMEREGISTER;
+  }
+  return NULL;
+}
+
+static int32_t irTakeHome(IrBlock* b) {
+  for(int r = 0; r < IRREGISTERS; r++) {
+    if(!(b->regsFree >> r & 1)) continue;
+    b->regsFree &= ~(1 << r);
+    return r;
+  }
+  int32_t s = 0;
+  while(b->spillUsed[s]) s++; // Fewer values than commands wait at once
+  b->spillUsed[s] = true;
+  return HOMESPILL + s;
+}
+
+static void irFreeHome(IrBlock* b, int32_t home) {
+  if(home >= HOMESPILL) b->spillUsed[home - HOMESPILL] = false;
+  else if(home >= 0) b->regsFree |= 1 << home;
+}
+
+// Looks through the copies computed by their user
+static Operand irResolve(IrBlock* b, Operand o) {
+  while(o.kind == ValueOperand && b->code[o.n].op == push && b->code[o.n].home == HOMEFOLDED) o = b->code[o.n].a;
+  return o;
+}
+
+static bool irSame(Operand x, Operand y) {
+  if(x.kind != y.kind || x.n != y.n) return false;
+  return x.kind == StackOperand || (x.kind == MemOperand && SpanEqual(x.segment, y.segment));
+}
+
+// True for constants and if the address of o can be put in A without touching D
+static bool irDirect(IrBlock* b, Operand o, Context* ctx) {
+  switch(o.kind) {
+    case MemOperand:   return isDirect(o.segment, ctx) || o.n <= MAXPOPWALK;
+    case ValueOperand: return b->code[o.n].home != HOMEFOLDED;
+    default:           return true;
+  }
+}
+
+// Leaves in A the address of o, which irDirect allows. A waiting value is read once, so its home is free again.
+static char* irAddr(IrBlock* b, Operand o, Context* ctx, Buffer* bufout) {
+  int32_t home = o.n;
+  switch(o.kind) {
+    case MemOperand:
+      if(isDirect(o.segment, ctx)) return SetDirectAddr(o.segment, o.index, ctx, bufout);
+      WriteA(fixedMap(o.segment).data);
+      WriteStrNL(o.n ? "A=M+1" : "A=M");
+      for(int32_t i = 1; i < o.n; i++) { WriteStrNL("A=A+1"); }
+      return NULL;
+    case StackOperand:
+      return stackAddr(b->base - b->moved + o.n, bufout);
+    case ValueOperand:
+      home = b->code[o.n].home;
+      irFreeHome(b, home);
+      // Fall through
+    case HomeOperand:
+      if(home >= HOMESPILL) return stackAddr(b->base - b->moved + b->maxDepth + home - HOMESPILL, bufout);
+      WriteANum(IrRegisters[home]);
+      return NULL;
+    default:
+      return "A constant has no address.";
+  }
+}
+
+static char* irEval(IrBlock* b, Operand o, Context* ctx, Buffer* bufout);
+
+// Comps for D = a op b with D and M or A holding a and b either way round. Comparisons take b - a.
+static char* IrDaMb[] = { "D=D+M", "D=D-M", "D=D&M", "D=D|M", "D=M-D" };
+static char* IrDbMa[] = { "D=D+M", "D=M-D", "D=D&M", "D=D|M", "D=D-M" };
+static char* IrDaAb[] = { "D=D+A", "D=D-A", "D=D&A", "D=D|A", "D=A-D" };
+static char* IrDbAa[] = { "D=D+A", "D=A-D", "D=D&A", "D=D|A", "D=D-A" };
+
+static char* irArith(IrBlock* b, IrInstr* in, Context* ctx, Buffer* bufout) {
+  int op = in->op == add ? 0 : in->op == sub ? 1 : in->op == and ? 2 : in->op == or ? 3 : 4;
+  Operand x = irResolve(b, in->a), y = irResolve(b, in->b);
+
+  if(irDirect(b, y, ctx)) {
+    CheckF(irEval(b, x, ctx, bufout));
+    if(y.kind == ConstOperand && y.n == 1 && op < 2) {
+      WriteStrNL(op ? "D=D-1" : "D=D+1");
+    } else if(y.kind == ConstOperand) {
+      WriteANum(y.n);
+      WriteStrNL(IrDaAb[op]);
+    } else {
+      CheckF(irAddr(b, y, ctx, bufout));
+      WriteStrNL(IrDaMb[op]);
+    }
+    return NULL;
+  }
+  if(irDirect(b, x, ctx)) {
+    CheckF(irEval(b, y, ctx, bufout));
+    if(x.kind == ConstOperand && x.n == 1 && op == 0) {
+      WriteStrNL("D=D+1");
+    } else if(x.kind == ConstOperand) {
+      WriteANum(x.n);
+      WriteStrNL(IrDbAa[op]);
+    } else {
+      CheckF(irAddr(b, x, ctx, bufout));
+      WriteStrNL(IrDbMa[op]);
+    }
+    return NULL;
+  }
+
+  // Both need D, b waits
+  CheckF(irEval(b, y, ctx, bufout));
+  Operand home = { HomeOperand, irTakeHome(b), SPAN0, SPAN0 };
+  CheckF(irAddr(b, home, ctx, bufout));
+  WriteStrNL("M=D");
+  CheckF(irEval(b, x, ctx, bufout));
+  irFreeHome(b, home.n);
+  CheckF(irAddr(b, home, ctx, bufout));
+  WriteStrNL(IrDaMb[op]);
+  return NULL;
+}
+
+// Leaves in D what the jump it returns tests. That is b - a, as the stack code has it, which wraps: against 0 it is
+// -a, and -32768 stays negative. Only eq can test a itself.
+static char* irCompare(IrBlock* b, IrInstr* in, char** jump, Context* ctx, Buffer* bufout) {
+  Operand y = irResolve(b, in->b);
+  *jump = in->op == eq ? "D;JEQ" : in->op == lt ? "D;JGT" : "D;JLT";
+  if(y.kind != ConstOperand || y.n != 0) return irArith(b, in, ctx, bufout);
+
+  Operand x = irResolve(b, in->a);
+  if(x.kind != ConstOperand && irDirect(b, x, ctx)) {
+    CheckF(irAddr(b, x, ctx, bufout));
+    WriteStrNL(in->op == eq ? "D=M" : "D=-M");
+    return NULL;
+  }
+  CheckF(irEval(b, x, ctx, bufout));
+  if(in->op != eq) WriteStrNL("D=-D");
+  return NULL;
+}
+
+static char* invertJump(char* jump) {
+  if(!strcmp(jump, "D;JEQ")) return "D;JNE";
+  if(!strcmp(jump, "D;JLT")) return "D;JGE";
+  return "D;JLE";
+}
+
+// Computes in D the value of an instruction
+static char* irCompute(IrBlock* b, IrInstr* in, Context* ctx, Buffer* bufout) {
+  if(in->op == push) return irEval(b, in->a, ctx, bufout);
+
+  if(isUnary(in->op)) {
+    Operand x = irResolve(b, in->a);
+    if(x.kind != ConstOperand && irDirect(b, x, ctx)) {
+      CheckF(irAddr(b, x, ctx, bufout));
+      WriteStrNL(in->op == neg ? "D=-M" : "D=!M");
+    } else {
+      CheckF(irEval(b, x, ctx, bufout));
+      WriteStrNL(in->op == neg ? "D=-D" : "D=!D");
+    }
+    return NULL;
+  }
+  if(!isCompare(in->op)) return irArith(b, in, ctx, bufout);
+
+  char* jump;
+  CheckF(irCompare(b, in, &jump, ctx, bufout));
+  char ar[2][1100];
+  Span isTrue = nextLabel(ctx, ar[0], sizeof(ar[0]));
+  Span end = nextLabel(ctx, ar[1], sizeof(ar[1]));
+  WriteA(isTrue);
+  WriteStrNL(jump);
+  WriteStrNL("D=0");
+  WriteA(end);
+  WriteStrNL("0;JMP");
+  WriteLabel(isTrue);
+  WriteStrNL("D=-1");
+  WriteLabel(end);
+  return NULL;
+}
+
+static char* irEval(IrBlock* b, Operand o, Context* ctx, Buffer* bufout) {
+  o = irResolve(b, o);
+  if(o.kind == ConstOperand) {
+    if(o.n <= 1) {
+      WriteStrNL(o.n ? "D=1" : "D=0");
+      return NULL;
+    }
+    WriteANum(o.n);
+    WriteStrNL("D=A");
+    return NULL;
+  }
+  if(o.kind == ValueOperand && b->code[o.n].home == HOMEFOLDED) return irCompute(b, &b->code[o.n], ctx, bufout);
+
+  if(irDirect(b, o, ctx)) {
+    CheckF(irAddr(b, o, ctx, bufout));
+  } else {
+    CheckF(SetAddr(o.segment, o.index, ctx, bufout));
+  }
+  WriteStrNL("D=M");
+  return NULL;
+}
+
+// Writes v to dst, in place when dst is what v is computed from
+static char* irStore(IrBlock* b, Operand dst, Operand v, Context* ctx, Buffer* bufout) {
+  v = irResolve(b, v);
+  if(!irDirect(b, dst, ctx)) { // The address waits in R13
+    CheckF(SetAddr(dst.segment, dst.index, ctx, bufout));
+    WriteStrNL("D=A");
+    WriteA(S("R13"));
+    WriteStrNL("M=D");
+    CheckF(irEval(b, v, ctx, bufout));
+    WriteA(S("R13"));
+    WriteStrNL("A=M");
+    WriteStrNL("M=D");
+    return NULL;
+  }
+  if(v.kind == ConstOperand && v.n <= 1) {
+    CheckF(irAddr(b, dst, ctx, bufout));
+    WriteStrNL(v.n ? "M=1" : "M=0");
+    return NULL;
+  }
+
+  IrInstr* in = v.kind == ValueOperand && b->code[v.n].home == HOMEFOLDED ? &b->code[v.n] : NULL;
+  if(in && isUnary(in->op) && irSame(irResolve(b, in->a), dst)) {
+    CheckF(irAddr(b, dst, ctx, bufout));
+    WriteStrNL(in->op == neg ? "M=-M" : "M=!M");
+    return NULL;
+  }
+  if(in && isBinary(in->op) && !isCompare(in->op)) {
+    Operand x = irResolve(b, in->a), y = irResolve(b, in->b);
+    bool inPlace = true;
+    if(!irSame(x, dst)) {
+      inPlace = in->op != sub && irSame(y, dst);
+      y = x;
+    }
+    if(inPlace && y.kind == ConstOperand && y.n == 1 && (in->op == add || in->op == sub)) {
+      CheckF(irAddr(b, dst, ctx, bufout));
+      WriteStrNL(in->op == add ? "M=M+1" : "M=M-1");
+      return NULL;
+    }
+    if(inPlace) {
+      CheckF(irEval(b, y, ctx, bufout));
+      CheckF(irAddr(b, dst, ctx, bufout));
+      WriteStrNL(in->op == add ? "M=D+M" : in->op == sub ? "M=M-D" : in->op == and ? "M=D&M" : "M=D|M");
+      return NULL;
+    }
+  }
+
+  CheckF(irEval(b, v, ctx, bufout));
+  CheckF(irAddr(b, dst, ctx, bufout));
+  WriteStrNL("M=D");
+  return NULL;
+}
+
+// Jumps on the condition, straight on the comparison when that is what it is
+static char* irBranch(IrBlock* b, IrInstr* in, Context* ctx, Buffer* bufout) {
+  Operand c = irResolve(b, in->a);
+  IrInstr* cond = c.kind == ValueOperand && b->code[c.n].home == HOMEFOLDED ? &b->code[c.n] : NULL;
+  bool invert = false;
+  if(cond && cond->op == not) {
+    Operand x = irResolve(b, cond->a);
+    cond = x.kind == ValueOperand && b->code[x.n].home == HOMEFOLDED ? &b->code[x.n] : NULL;
+    invert = true;
+  }
+
+  char* jump = "D;JNE";
+  if(cond && isCompare(cond->op)) {
+    CheckF(irCompare(b, cond, &jump, ctx, bufout));
+    if(invert) jump = invertJump(jump);
+  } else {
+    CheckF(irEval(b, c, ctx, bufout));
+  }
+
+  ctx->sp = b->base - b->moved + b->depth;
+  CheckF(syncSP(ctx, bufout));
+  WriteStr("@");
+  WriteScoped(in->label);
+  WriteStr("\n");
+  WriteStrNL(jump);
+  return NULL;
+}
+
+char* irLower(IrBlock* b, Context* ctx, Buffer* bufout) {
+  b->base = ctx->sp;
+  b->moved = 0;
+  b->regsFree = 3;
+  Function* f = ctx->func;
+  for(int t = 0; t < TEMPSLOTS && f && f->balanced; t++) {
+    if(!((f->tempsUsed | ctx->inlineTemps) >> t & 1)) b->regsFree |= 1 << (IRREGISTERS - 1 - t);
+  }
+  memset(b->spillUsed, 0, sizeof(b->spillUsed));
+
+  for(int32_t i = 0; i < b->count; i++) {
+    IrInstr* in = &b->code[i];
+    Size start = bufout->index;
+    in->words = 0;
+    if(in->op == pop) {
+      CheckF(irStore(b, in->dst, in->a, ctx, bufout));
+    } else if(in->op == gotoeif) {
+      CheckF(irBranch(b, in, ctx, bufout));
+      in->words = countInstructions(SPAN(bufout->data.ptr + start, bufout->index - start));
+      return NULL;
+    } else if(in->home != HOMEFOLDED) {
+      // Values left on the stack come in order, SP in RAM follows them rather than A walking further each time
+      int32_t off = b->base - b->moved + in->depth;
+      if(in->home == HOMESTACK && off > MAXSPDELTA) {
+        WriteANum(off);
+        WriteStrNL("D=A");
+        WriteA(S("SP"));
+        WriteStrNL("M=D+M");
+        b->moved += off;
+      }
+      Operand dst = { StackOperand, in->depth, SPAN0, SPAN0 };
+      if(in->home != HOMESTACK) dst = (Operand) { HomeOperand, irTakeHome(b), SPAN0, SPAN0 };
+      in->home = HOMEFOLDED;
+      CheckF(irStore(b, dst, (Operand) { ValueOperand, i, SPAN0, SPAN0 }, ctx, bufout));
+      in->home = dst.kind == HomeOperand ? dst.n : HOMESTACK;
+    }
+    in->words = countInstructions(SPAN(bufout->data.ptr + start, bufout->index - start));
+  }
+
+  ctx->sp = b->base - b->moved + b->depth;
+  if(ctx->sp > MAXSPDELTA || ctx->sp < -MAXSPDELTA) CheckF(syncSP(ctx, bufout));
+  return NULL;
+}
+
+#define WriteInt(_n) { char _nb[32]; sprintf(_nb, "%d", (int)(_n)); WriteStr(_nb); }
+
+static char* irOperand(Operand o, Buffer* bufout) {
+  switch(o.kind) {
+    case ConstOperand: WriteInt(o.n); break;
+    case MemOperand:   WriteSpan(o.segment); WriteStr(" "); WriteInt(o.n); break;
+    case StackOperand: WriteStr("stack "); WriteInt(o.n); break;
+    case ValueOperand: WriteStr("v"); WriteInt(o.n); break;
+    case HomeOperand:  break;
+  }
+  return NULL;
+}
+
+// One comment line for each instruction, with where the value waited after lowering
+char* irDump(IrBlock* b, Buffer* bufout) {
+  for(int32_t i = 0; i < b->count; i++) {
+    IrInstr* in = &b->code[i];
+    WriteStr("// ");
+    if(in->op == pop) {
+      CheckF(irOperand(in->dst, bufout));
+      WriteStr(" = ");
+    } else if(in->op == gotoeif) {
+      WriteStr("if-goto ");
+      WriteSpan(in->label);
+      WriteStr(" ");
+    } else {
+      WriteStr("v");
+      WriteInt(i);
+      WriteStr(" = ");
+      if(in->op != push) {
+        WriteStr(CommandNames[in->op]);
+        WriteStr(" ");
+      }
+    }
+    CheckF(irOperand(in->a, bufout));
+    if(isBinary(in->op)) {
+      WriteStr(" ");
+      CheckF(irOperand(in->b, bufout));
+    }
+    if(in->home == HOMESTACK) {
+      WriteStr(", pushed to stack ");
+      WriteInt(in->depth);
+    } else if(in->home >= HOMESPILL) {
+      WriteStr(", waits above the stack");
+    } else if(in->home >= 0) {
+      WriteStr(", waits in R");
+      WriteInt(IrRegisters[in->home]);
+    }
+    WriteStr("\n");
+  }
+  return NULL;
+}
+
+/* WRITER */
+
+// Written in argument order. Files are flushed when all the ones before them are.
+typedef struct {
+  Context* contexts;
+  int count;
+  int head;     // First file not completely written yet
+  int fd;
+  char* error;
+  pthread_mutex_t lock;
+} Writer;
+
+static Writer Out;
+
+typedef enum { NoComments, ShortComments, FullComments } CommentMode;
+static CommentMode Comments = FullComments;
+
+char* writeAll(int fd, struct iovec* iov, int n) {
+  while(n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if(w < 0) return "Error writing the output file.";
+
+    // Skip what got written, it might stop in the middle of a chunk
+    while(n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++; n--;
+    }
+    if(n > 0) {
+      iov->iov_base = (Byte*)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return NULL;
+}
+
+// Writes and frees the sealed chunks of ctx. Called with the lock held.
+char* flushChunks(Context* ctx) {
+  #define MAXIOV 64
+  struct iovec iov[MAXIOV];
+
+  while(ctx->sealed) {
+    Chunk* toFree[MAXIOV];
+    int n = 0;
+    for(Chunk* c = ctx->sealed; c && n < MAXIOV; c = c->next, n++) {
+      iov[n] = (struct iovec) { c->data, c->len };
+      toFree[n] = c;
+    }
+    ctx->sealed = toFree[n - 1]->next;
+    if(!ctx->sealed) ctx->lastSealed = NULL;
+
+    char* err = writeAll(Out.fd, iov, n);
+    for(int i = 0; i < n; i++) free(toFree[i]);
+    if(err) return err;
+  }
+  return NULL;
+}
+
+// Writes everything that can be written without breaking the argument order
+void flushReady(void) {
+  while(Out.head < Out.count && !Out.error) {
+    Context* ctx = &Out.contexts[Out.head];
+    if(ctx->error) break;
+
+    Out.error = flushChunks(ctx);
+    if(!ctx->done) break;
+    Out.head++;
+  }
 }
-#undef Write
-#undef Handle
 
-char* tokenToOps(Token t, Buffer* bufout) {
-  switch(t.type) {
-#define X(_n) case _n: return _n##f(t, bufout);
-    INSTR
-#undef X
-    case gotoe: return gotof(t, bufout);
-    case gotoeif: return gotoiff(t, bufout);
-    case returne: return returnef(t, bufout);
-    case Empty: return NULL;
-    case Error:
-      return "An error occurred.";
+char* newChunk(Context* ctx) {
+  Chunk* c = malloc(sizeof(Chunk));
+  if(!c) return "Out of memory.";
+  c->next = NULL;
+  c->len = 0;
+  ctx->current = c;
+  ctx->out = BufferInit(c->data, CHUNKSIZE);
+  return NULL;
+}
+
+// Keeps a copy of the chunk for the cache, or stops keeping one if there is no memory for it
+void saveChunk(Context* ctx, Chunk* c) {
+  if(ctx->savedLen + c->len > ctx->savedCap) {
+    Size cap = ctx->savedCap ? ctx->savedCap * 2 : 4 * CHUNKSIZE;
+    while(cap < ctx->savedLen + c->len) cap *= 2;
+    Byte* saved = realloc(ctx->saved, cap);
+    if(!saved) {
+      ctx->saving = false;
+      return;
+    }
+    ctx->saved = saved;
+    ctx->savedCap = cap;
   }
-  return "Shouldn't get here as every branch returns.";
+  memcpy(ctx->saved + ctx->savedLen, c->data, c->len);
+  ctx->savedLen += c->len;
+}
+
+void sealChunk(Context* ctx) {
+  if(!ctx->current) return;
+  ctx->current->len = ctx->out.index;
+  if(ctx->saving) saveChunk(ctx, ctx->current);
+
+  pthread_mutex_lock(&Out.lock);
+  if(ctx->lastSealed) ctx->lastSealed->next = ctx->current;
+  else ctx->sealed = ctx->current;
+  ctx->lastSealed = ctx->current;
+  flushReady();
+  pthread_mutex_unlock(&Out.lock);
+
+  ctx->current = NULL;
+}
+
+void finishContext(Context* ctx) {
+  sealChunk(ctx);
+  free(ctx->scratch);
+  ctx->scratch = NULL;
+  free(ctx->ir);
+  ctx->ir = NULL;
+
+  pthread_mutex_lock(&Out.lock);
+  ctx->done = true;
+  flushReady();
+  pthread_mutex_unlock(&Out.lock);
+}
+
+/* ROM REPORT */
+
+// What the program costs in ROM, counted as it is written rather than from the output. A run through the IR is
+// charged by its roots, each with the values it computes: a store to its segment, the branch to if-goto and a value
+// left on the stack to its command. Code written for a cached file is known from the counts saved with it.
+#define ROMWORDS 32768
+static int RomTop = -1; // Largest functions listed with -m, -1 for no report
+
+static void chargeCommand(RomCounts* rc, TokenType type, Span segment, Size n) {
+  if(type > returne) {
+    rc->other += n;
+    return;
+  }
+  rc->commands[type] += n;
+  int seg = type == push || type == pop ? segmentId(segment) : -1;
+  if(seg >= 0 && type == push) rc->pushes[seg] += n;
+  if(seg >= 0 && type == pop) rc->pops[seg] += n;
+}
+
+// Charges the n instructions just written for a command, or for the run lowered from b, to the function and kinds
+void countRom(Context* ctx, Token token, bool inlined, IrBlock* b, Size n) {
+  RomCounts* rc = &ctx->rom;
+  rc->total += n;
+  if(ctx->func) ctx->func->romSize += n;
+
+  if(inlined) {
+    rc->inlined += n;
+  } else if(!b) {
+    chargeCommand(rc, token.type, token.arg1, n);
+  } else {
+    // The last one also gets what was written after lowering, like charging cycles
+    for(int32_t i = 0; i < b->count; i++) {
+      IrInstr* in = &b->code[i];
+      Size words = i == b->count - 1 ? n : in->words;
+      chargeCommand(rc, in->op, in->op == pop ? in->dst.segment : in->a.segment, words);
+      n -= words;
+    }
+  }
+}
+
+static void printRom(char* what, Size n, Size total) {
+  if(n) printf("  %-20s %6lu %5.1f%%\n", what, (unsigned long)n, 100.0 * n / total);
+}
+
+static int compareRomSize(const void* a, const void* b) {
+  Size x = (*(Function**)a)->romSize, y = (*(Function**)b)->romSize;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void reportRom(Context* contexts, int count, Size bootWords) {
+  RomCounts all = {0};
+  for(int i = 0; i < count; i++) {
+    for(size_t k = 0; k < ROMCOUNTS; k++) ((Size*)&all)[k] += ((Size*)&contexts[i].rom)[k];
+  }
+  Size total = bootWords + all.total;
+  if(!total) return;
+
+  printf("ROM by command:\n");
+  for(int k = 0; k <= returne; k++) printRom(CommandNames[k], all.commands[k], total);
+  printRom("call, inlined", all.inlined, total);
+  printRom("end of file", all.other, total);
+  printRom("bootstrap", bootWords, total);
+
+  printf("ROM by segment:\n");
+  for(Size seg = 0; seg < SEGMENTCOUNT; seg++) {
+    char what[32];
+    snprintf(what, sizeof(what), "push %s", SegmentNames[seg]);
+    printRom(what, all.pushes[seg], total);
+    snprintf(what, sizeof(what), "pop %s", SegmentNames[seg]);
+    printRom(what, all.pops[seg], total);
+  }
+
+  printf("ROM by file:\n");
+  for(int i = 0; i < count; i++) printRom(contexts[i].vmFileName, contexts[i].rom.total, total);
+
+  static Function* largest[FMAXLEN + 1];
+  int32_t n = 0;
+  for(int32_t i = 0; i < Functions.len; i++) {
+    if(Functions.inOrder[i]->live) largest[n++] = Functions.inOrder[i];
+  }
+  qsort(largest, n, sizeof(*largest), compareRomSize);
+  if(n > RomTop) n = RomTop;
+  if(n) printf("ROM of the %d largest functions:\n", n);
+  for(int32_t i = 0; i < n; i++) {
+    char what[64];
+    snprintf(what, sizeof(what), "%.*s", (int)largest[i]->name.len, (char*)largest[i]->name.ptr);
+    printRom(what, largest[i]->romSize, total);
+  }
+
+  if(total <= ROMWORDS) {
+    printf("ROM used %lu of %d words, %lu left.\n", (unsigned long)total, ROMWORDS, (unsigned long)(ROMWORDS - total));
+  } else {
+    printf("ROM used %lu words, %lu more than the %d there are.\n", (unsigned long)total,
+           (unsigned long)(total - ROMWORDS), ROMWORDS);
+  }
+}
+
+/* TRANSLATION */
+
+char* writeComment(Span line, Token token, Buffer* bufout) {
+  if(Comments == FullComments) {
+    WriteStr("\n// ");
+    WriteSpan(line);
+    WriteStr("\n");
+  } else if(Comments == ShortComments && token.type != Empty) {
+    WriteStr("// ");
+    WriteSpan(SpanTrim(removeLineComment(line)));
+    WriteStr("\n");
+  }
+  return NULL;
+}
+
+// The assembler for one command, preceded by the command as a comment
+char* emitCommand(Span line, Token token, Context* ctx, Buffer* bufout) {
+  CheckF(writeComment(line, token, bufout));
+  return tokenToOps(token, ctx, bufout);
+}
+
+// With cycle profiling a block is charged where it ends, before a label or before the jump that ends it. Jumps are
+// written to scratch first so that they are charged too. Instructions are counted as written, both sides of the
+// branches in comparisons included, so cycles are a close estimate rather than exact.
+char* emitProfiled(Span line, Token token, Context* ctx, Buffer* bufout) {
+  if(!chargesCycles(ctx)) return emitCommand(line, token, ctx, bufout);
+
+  Size instrumented = ctx->instrumented;
+  Size start = bufout->index;
+  switch(token.type) {
+    case function:
+      ctx->pending = 0; // What came before can't fall into a function
+      break;
+    case label:
+      CheckF(chargeCycles(ctx, bufout));
+      start = bufout->index;
+      break;
+    case gotoe: case gotoeif: case call: case returne: {
+      if(!ctx->scratch) ctx->scratch = malloc(CHUNKSIZE);
+      if(!ctx->scratch) return "Out of memory.";
+      Buffer jump = BufferInit(ctx->scratch, CHUNKSIZE);
+      CheckF(emitCommand(line, token, ctx, &jump));
+      ctx->pending += countInstructions(BufferToSpan(&jump));
+      CheckF(chargeCycles(ctx, bufout));
+      WriteSpan(BufferToSpan(&jump));
+      return NULL;
+    }
+    default:
+      break;
+  }
+  CheckF(emitCommand(line, token, ctx, bufout));
+  ctx->pending += countInstructions(SPAN(bufout->data.ptr + start, bufout->index - start)) -
+                  (ctx->instrumented - instrumented);
+  return NULL;
+}
+
+// A run of commands through the IR, preceded by the commands as comments. With cycle profiling or a dump it is
+// lowered to scratch first, to be charged like a jump when it ends in one or to show where values waited.
+char* emitRun(Span lines, Context* ctx, Buffer* bufout) {
+  if(!ctx->ir) ctx->ir = malloc(sizeof(IrBlock));
+  if(!ctx->ir) return "Out of memory.";
+  IrBlock* b = ctx->ir;
+  CheckF(irLift(lines, ctx, b));
+
+  for(Span s = lines; s.len > 0;) {
+    SpanPair sp = SpanCut(s, '\n');
+    CheckF(writeComment(sp.head, parseLine(sp.head), bufout));
+    s = sp.tail;
+  }
+
+  bool charged = chargesCycles(ctx);
+  if(!charged && !DumpIR) return irLower(b, ctx, bufout);
+
+  if(!ctx->scratch) ctx->scratch = malloc(CHUNKSIZE);
+  if(!ctx->scratch) return "Out of memory.";
+  Buffer code = BufferInit(ctx->scratch, CHUNKSIZE);
+  CheckF(irLower(b, ctx, &code));
+  if(DumpIR) CheckF(irDump(b, bufout));
+  if(charged) {
+    ctx->pending += countInstructions(BufferToSpan(&code));
+    if(b->code[b->count - 1].op == gotoeif) CheckF(chargeCycles(ctx, bufout));
+  }
+  WriteSpan(BufferToSpan(&code));
+  return NULL;
+}
+
+// Extends line over the straight-line commands that follow it in s, up to a block of the IR
+void extendRun(Span* line, Token* token, Span* s) {
+  for(Size commands = 1; token->type != gotoeif && commands < IRMAX && s->len > 0;) {
+    SpanPair np = SpanCut(*s, '\n');
+    Token next = parseLine(np.head);
+    if(np.head.len == 0 || (next.type != Empty && !irCommand(next.type))) break;
+    line->len = np.head.ptr + np.head.len - line->ptr;
+    commands += next.type != Empty;
+    *token = next;
+    *s = np.tail;
+  }
+}
+
+// Translates s as compile does a function without calls, runs of straight-line commands through the IR
+char* emitLines(Span s, Context* ctx, Buffer* bufout) {
+  while(s.len > 0) {
+    SpanPair sp = SpanCut(s, '\n');
+    Span line = sp.head;
+    s = sp.tail;
+
+    Token token = parseLine(line);
+    bool run = UseIR && irCommand(token.type);
+    if(run) extendRun(&line, &token, &s);
+    CheckF(run ? emitRun(line, ctx, bufout) : emitCommand(line, token, ctx, bufout));
+  }
+  return NULL;
+}
+
+static char* TempNames[TEMPSLOTS] = { "0", "1", "2", "3", "4", "5", "6", "7" };
+
+#define WriteTemp(_slot) WriteStr("@"); WriteNum(TEMPBASE + (_slot)); WriteStr("\n")
+#define Counted(_start) countInstructions(SPAN(bufout->data.ptr + (_start), bufout->index - (_start)))
+
+// inlineSite made sure there are enough
+static inline int takeSlot(uint8_t used, int* next) {
+  while(used >> *next & 1) *next -= 1;
+  return (*next)--;
+}
+
+static bool TailCalls = true;
+
+// True if the next command in s is a return. Labels in between run nothing, but the return can be jumped to.
+bool beforeReturn(Span s, bool* labelled) {
+  *labelled = false;
+  while(s.len > 0) {
+    SpanPair sp = SpanCut(s, '\n');
+    TokenType type = parseLine(sp.head).type;
+    if(type == label) *labelled = true;
+    else if(type != Empty) return type == returne;
+    s = sp.tail;
+  }
+  return false;
+}
+
+// True if there are only labels left in s, so nothing would run after falling through
+bool onlyLabels(Span s) {
+  while(s.len > 0) {
+    SpanPair sp = SpanCut(s, '\n');
+    TokenType type = parseLine(sp.head).type;
+    if(type != Empty && type != label) return false;
+    s = sp.tail;
+  }
+  return true;
+}
+
+// Restores the pointers the body set, the result stays on the stack
+char* restorePointers(int* pointerSlot, Buffer* bufout) {
+  for(int p = 0; p < 2; p++) {
+    if(pointerSlot[p] < 0) continue;
+    WriteTemp(pointerSlot[p]);
+    WriteStrNL("D=M");
+    WriteA(p ? S("THAT") : S("THIS"));
+    WriteStrNL("M=D");
+  }
+  return NULL;
+}
+
+// What the call costs instead: the call as it is made, to a static frame or not, and f as compile translates it
+long callCost(Token t, Function* f, Context* ctx) {
+  Byte* b = malloc(CHUNKSIZE);
+  if(!b) return 0;
+  Buffer buf = BufferInit(b, CHUNKSIZE);
+  Context scratch = *ctx;
+  scratch.tail = false;
+
+  // A function only ever inlined is not emitted, called it would get a static frame as it makes no calls
+  Function g = *f;
+  if(!f->live) g.staticFrame = true;
+  char* err = syncSP(&scratch, &buf);
+  if(!err) err = g.staticFrame ? staticCall(t, &g, &scratch, &buf) : callf(t, &scratch, &buf);
+  scratch.func = &g;
+  scratch.funcName = f->name;
+  scratch.staticsFile = f->file;
+  scratch.sp = 0;
+  if(!err) err = emitLines(f->code, &scratch, &buf);
+  ctx->ir = scratch.ir;
+  ctx->scratch = scratch.scratch;
+
+  long cost = err ? 0 : (long)countInstructions(BufferToSpan(&buf));
+  free(b);
+  return cost;
+}
+
+// A command of the body of an inlined function, with its arguments and locals in their temp slots
+char* renameLine(Span line, Token t, int* argSlot, int* localSlot, Buffer* bufout) {
+  bool arg = SpanEqual(t.arg1, S("argument")), local = SpanEqual(t.arg1, S("local"));
+  if((t.type == push || t.type == pop) && (arg || local)) {
+    Size i = SpanToUlong(t.arg2);
+    WriteStr(t.type == push ? "push temp " : "pop temp ");
+    WriteStr(TempNames[arg ? argSlot[i] : localSlot[i]]);
+  } else {
+    WriteSpan(line);
+  }
+  WriteStr("\n");
+  return NULL;
+}
+
+// For the report
+char* recordInline(Context* ctx, InlineSite site) {
+  if(ctx->inlinedCount == ctx->inlinedCap) {
+    int32_t cap = ctx->inlinedCap ? ctx->inlinedCap * 2 : 64;
+    InlineSite* sites = realloc(ctx->inlined, cap * sizeof(InlineSite));
+    if(!sites) return "Out of memory.";
+    ctx->inlined = sites;
+    ctx->inlinedCap = cap;
+  }
+  ctx->inlined[ctx->inlinedCount++] = site;
+  return NULL;
+}
+
+// Replaces 'call f n' with the body of f. Arguments and locals go in temp slots the body doesn't use,
+// which is safe as no function can expect temp to survive a call.
+char* emitInline(Span line, Token t, Function* f, Context* ctx, Buffer* bufout) {
+  Size nArgs = SpanToUlong(t.arg2);
+  int argSlot[TEMPSLOTS], localSlot[TEMPSLOTS], pointerSlot[2] = { -1, -1 };
+
+  // Free slots from the top, the compiler uses temp 0 for arrays
+  int next = TEMPSLOTS - 1;
+  for(Size i = 0; i < TEMPSLOTS; i++) argSlot[i] = f->argsUsed >> i & 1 ? takeSlot(f->tempsUsed, &next) : -1;
+  for(int32_t i = 0; i < f->locals; i++) localSlot[i] = takeSlot(f->tempsUsed, &next);
+  for(int p = 0; p < 2; p++) if(f->pointersSet >> p & 1) pointerSlot[p] = takeSlot(f->tempsUsed, &next);
+  uint8_t temps = f->tempsUsed;
+  for(int i = next + 1; i < TEMPSLOTS; i++) temps |= 1 << i;
+
+  if(Comments != NoComments) {
+    WriteStr("// inline ");
+    WriteSpan(SpanTrim(removeLineComment(line)));
+    WriteStr("\n");
+  }
+  Size start = bufout->index;
+
+  // Arguments are on the stack, last one on top
+  for(Size i = nArgs; i-- > 0;) {
+    popd
+    if(i < TEMPSLOTS && argSlot[i] >= 0) {
+      WriteTemp(argSlot[i]);
+      WriteStrNL("M=D");
+    }
+  }
+  for(int32_t i = 0; i < f->locals; i++) {
+    WriteTemp(localSlot[i]);
+    WriteStrNL("M=0");
+  }
+  for(int p = 0; p < 2; p++) {
+    if(pointerSlot[p] < 0) continue;
+    WriteA(p ? S("THAT") : S("THIS"));
+    WriteStrNL("D=M");
+    WriteTemp(pointerSlot[p]);
+    WriteStrNL("M=D");
+  }
+
+  // Labels of the body are made unique to this site, statics are those of its own file
+  char name[1100];
+  snprintf(name, sizeof(name), "%.*s$inline%u", (int)ctx->funcName.len, (char*)ctx->funcName.ptr, ctx->inlineCount);
+  ctx->inlineCount += 1;
+  char end[1200];
+  snprintf(end, sizeof(end), "%s.end", name);
+
+  Span callerName = ctx->funcName;
+  char* callerStatics = ctx->staticsFile;
+  ctx->funcName = SpanFromString(name);
+  ctx->staticsFile = f->file;
+  ctx->inlineTemps = temps;
+
+  Span s = SpanCut(f->code, '\n').tail;
+  bool jumpsToEnd = false;
+  Size textSize = f->code.len + 1; // Renamed commands are no longer
+  Byte* textBytes = malloc(textSize);
+  char* err = textBytes ? NULL : "Out of memory.";
+
+  while(s.len > 0 && !err) {
+    // The commands up to the next return are translated as those of a function, through the IR
+    Buffer text = BufferInit(textBytes, textSize);
+    Span bodyLine = SPAN0;
+    Token bt = { Empty, SPAN0, SPAN0 };
+    while(s.len > 0 && !err) {
+      SpanPair sp = SpanCut(s, '\n');
+      bodyLine = sp.head;
+      s = sp.tail;
+      bt = parseLine(bodyLine);
+      if(bt.type == returne) break;
+      err = renameLine(bodyLine, bt, argSlot, localSlot, &text);
+    }
+    if(!err) err = emitLines(BufferToSpan(&text), ctx, bufout);
+    if(err || bt.type != returne) break;
+
+    // The last return falls through to the code after the call
+    if(Comments == FullComments) {
+      WriteStr("\n// ");
+      WriteSpan(bodyLine);
+      WriteStr("\n");
+    }
+    bool last = onlyLabels(s);
+    err = syncSP(ctx, bufout);
+    if(!err) err = restorePointers(pointerSlot, bufout);
+    if(!err && !last) {
+      WriteA(SpanFromString(end));
+      WriteStrNL("0;JMP");
+      jumpsToEnd = true;
+    }
+  }
+  free(textBytes);
+  ctx->funcName = callerName;
+  ctx->staticsFile = callerStatics;
+  ctx->inlineTemps = 0;
+  if(err) return err;
+  if(jumpsToEnd) {
+    WriteLabel(SpanFromString(end));
+  }
+
+  return recordInline(ctx, (InlineSite) { callerName, f->name, callCost(t, f, ctx) - (long)Counted(start) });
 }
 
-SpanResult compile(Span s, Buffer* bufout) {
-#define Write(_k) if(BufferCopy(_k,bufout).error) return SPANERR("Writing buffer too small")
+// Translates ctx->source into chunks that get written out as they fill
+char* compile(Context* ctx) {
+  Span s = ctx->source;
+
+  CheckF(newChunk(ctx));
+
+  // Dead functions are translated as live ones are, then taken back out: only their size is kept
+  Function* dead = NULL;
+  // A return right after a tail call can't be reached
+  bool unreached = false;
 
   while(true) {
     SpanPair sp = SpanCut(s, '\n');
@@ -475,35 +2961,120 @@ SpanResult compile(Span s, Buffer* bufout) {
     if(line.len == 0) break;
     s = sp.tail;
 
-    Write(S("\n// "));
-    Write(line);
-    Write(S("\n"));
-
     Token token = parseLine(line);
-    char* error = tokenToOps(token, bufout);
-    if(error) {
-      return SPANERR(error); 
+
+    if(token.type == function) {
+      if(dead) ctx->sp = 0;
+      Function* f = FTGet(&Functions, token.arg1);
+      dead = f && !f->live ? f : NULL;
+      ctx->func = f;
+    }
+
+    if(token.type == returne && unreached) {
+      unreached = false;
+      continue;
     }
+    if(token.type != Empty) unreached = false;
+
+    Function* callee = token.type == call ? FTGet(&Functions, token.arg1) : NULL;
+    Size nArgs = SpanToUlong(token.arg2);
+    bool inlined = inlineSite(ctx->func, callee, nArgs);
+
+    // Between stack frames the new arguments must fit where the current ones are, callers pass at least as many as
+    // are used
+    bool labelled = false;
+    ctx->tail = TailCalls && callee && !inlined && ctx->func &&
+                (callee->staticFrame || inStaticFrame(ctx) || (int32_t)nArgs <= ctx->func->args) &&
+                beforeReturn(s, &labelled);
+
+    // Straight-line commands go through the IR together
+    bool run = UseIR && irCommand(token.type);
+    if(run) extendRun(&line, &token, &s);
+
+    // If the chunk fills up, redo the command at the start of a new one
+    Size start = ctx->out.index, from = start;
+    unsigned labels = ctx->labelCount, rets = ctx->retCount, inlines = ctx->inlineCount, profs = ctx->profileCount;
+    unsigned tails = ctx->tailCalls;
+    int32_t stackTop = ctx->sp;
+    int32_t sites = ctx->inlinedCount;
+    Size pending = ctx->pending;
+
+    char* error = inlined ? emitInline(line, token, callee, ctx, &ctx->out) :
+                  run ? emitRun(line, ctx, &ctx->out) : emitProfiled(line, token, ctx, &ctx->out);
+    if(error && start > 0) {
+      ctx->out.index = start;
+      ctx->labelCount = labels;
+      ctx->retCount = rets;
+      ctx->inlineCount = inlines;
+      ctx->profileCount = profs;
+      ctx->tailCalls = tails;
+      ctx->sp = stackTop;
+      ctx->inlinedCount = sites;
+      ctx->pending = pending;
+      sealChunk(ctx);
+      CheckF(newChunk(ctx));
+      from = ctx->out.index;
+      error = inlined ? emitInline(line, token, callee, ctx, &ctx->out) :
+              run ? emitRun(line, ctx, &ctx->out) : emitProfiled(line, token, ctx, &ctx->out);
+    }
+    if(error) return error;
+    Size words = countInstructions(SPAN(ctx->out.data.ptr + from, ctx->out.index - from));
+    if(dead) {
+      dead->romSize += words;
+      ctx->out.index = from;
+      ctx->labelCount = labels;
+      ctx->retCount = rets;
+      ctx->inlineCount = inlines;
+      ctx->profileCount = profs;
+      ctx->tailCalls = tails;
+      ctx->inlinedCount = sites;
+    } else {
+      countRom(ctx, token, inlined, run ? ctx->ir : NULL, words);
+    }
+    unreached = ctx->tail && !labelled;
+    ctx->tail = false;
+  }
+
+  Buffer* bufout = &ctx->out;
+  if(CHUNKSIZE - bufout->index < 64) {
+    sealChunk(ctx);
+    CheckF(newChunk(ctx));
+    bufout = &ctx->out;
   }
+  Size end = bufout->index;
+  CheckF(syncSP(ctx, bufout));
+  WriteStrNL("(End)");
+  WriteStrNL("@End");
+  WriteStrNL("0;JMP");
+  Size words = countInstructions(SPAN(bufout->data.ptr + end, bufout->index - end));
+  ctx->rom.other += words;
+  ctx->rom.total += words;
 
-  Write(S("(End)"));
-  Write(S("\n"));
-  Write(S("@End"));
-  Write(S("\n"));
-  Write(S("0;JMP"));
-  Write(S("\n"));
+  return NULL;
+}
 
-#undef Write
-  return (SpanResult){BufferToSpan(bufout), 0};
+void reportInlining(Context* contexts, int count) {
+  int32_t sites = 0;
+  long saved = 0;
+
+  for(int i = 0; i < count; i++) {
+    for(int32_t j = 0; j < contexts[i].inlinedCount; j++) {
+      InlineSite* site = &contexts[i].inlined[j];
+      printf("Inlined %.*s in %.*s, about %ld cycles saved per call\n", (int)site->callee.len, (char*)site->callee.ptr,
+             (int)site->caller.len, (char*)site->caller.ptr, site->saved);
+      sites += 1;
+      saved += site->saved;
+    }
+    free(contexts[i].inlined);
+    contexts[i].inlined = NULL;
+  }
+  if(sites) printf("Inlined %d call sites, about %ld cycles saved if each runs once.\n", sites, saved);
 }
 
 void test(void);
 
-// Use only once not multithread
-inline static char *basename(char *path)
+inline static char *basename(char *path, char* filename)
 {
-    static char filename[1024]; // https://en.wikipedia.org/wiki/Comparison_of_file_systems#Limits
-  //
     strcpy(filename, path);
 
     char* s = strrchr(filename, '/');
@@ -517,68 +3088,531 @@ inline static char *basename(char *path)
     return start;
 }
 
+/* CACHE */
+
+// In directory mode the translation of each file is kept in <dir>/.vmcache/<file>.asm. Labels and statics are
+// scoped to the file, so a translation can be used again as long as nothing it was made from changed: the file, the
+// options and what was known of the functions it defines and calls, like where their frames are or their bodies if
+// inlined. The cache file starts with its key and what the reports need:
+//   // vmcache <key>
+//   // tailcalls <n>
+//   // rom <each count of RomCounts>
+//   // size <function> <instructions>
+//   // inlined <caller> <callee> <cycles saved>
+//   // end
+#define CACHEDIR ".vmcache"
+static char CacheDir[1024]; // Empty without a cache
+
+uint64_t mixHash(uint64_t h, uint64_t v) {
+  uint64_t pair[2] = { h, v };
+  return HashString((Byte*)pair, sizeof(pair));
+}
+
+// The translator itself, so that a cache made by another build is not used. Rebuilding the same code gives the same
+// executable, where the build time would not. Just for linux, elsewhere the cache has to be removed after a change.
+uint64_t translatorHash(void) {
+  int fd = open("/proc/self/exe", O_RDONLY);
+  struct stat st;
+  void* exe = fd < 0 || fstat(fd, &st) ? MAP_FAILED : mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(fd >= 0) close(fd);
+  if(exe == MAP_FAILED) return 0;
+  uint64_t h = HashString(exe, st.st_size);
+  munmap(exe, st.st_size);
+  return h;
+}
+
+// The options that change the output, and the translator itself
+uint64_t optionsKey(void) {
+  uint64_t h = translatorHash();
+  int64_t options[] = { Comments, InlineMax, TailCalls, UseIR, DumpIR, Profile };
+  for(size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) h = mixHash(h, options[i]);
+  return h;
+}
+
+// What translating f or a call to it depends on besides its code
+uint64_t functionFacts(Function* f) {
+  if(!f) return 1; // Not defined
+  uint64_t h = HashString(f->name.ptr, f->name.len);
+  int64_t facts[] = { f->live, f->balanced, f->inlinable, f->profiled && !f->timesCalled, f->staticFrame, f->frameBase,
+                      f->args, f->siteArgs, f->locals, f->argsUsed, f->tempsUsed, f->pointersSet, f->profileAddr };
+  for(size_t i = 0; i < sizeof(facts) / sizeof(facts[0]); i++) h = mixHash(h, facts[i]);
+  if(f->inlinable) {
+    h = mixHash(h, HashString(f->code.ptr, f->code.len));
+    h = mixHash(h, HashString((Byte*)f->file, strlen(f->file)));
+  }
+  return h;
+}
+
+uint64_t cacheKey(Context* ctx, uint64_t options) {
+  uint64_t h = mixHash(options, HashString(ctx->source.ptr, ctx->source.len));
+  for(Span s = ctx->source; s.len > 0;) {
+    SpanPair sp = SpanCut(s, '\n');
+    s = sp.tail;
+    Token t = parseLine(sp.head);
+    if(t.type == function || t.type == call) h = mixHash(h, functionFacts(FTGet(&Functions, t.arg1)));
+  }
+  return h;
+}
+
+void cachePath(Context* ctx, char* path, size_t size) {
+  snprintf(path, size, "%s/%s.asm", CacheDir, ctx->vmFileName);
+}
+
+// Checks the header up to '// end' and, if apply, takes in what it says. Returns the translation after it.
+SpanResult readCacheHeader(Span s, Context* ctx, bool apply) {
+  char first[64];
+  snprintf(first, sizeof(first), "// vmcache %016llx", (unsigned long long)ctx->cacheKey);
+  SpanPair sp = SpanCut(s, '\n');
+  if(!SpanEqual(sp.head, SpanFromString(first))) return SPANERR("Stale.");
+
+  while(true) {
+    sp = SpanCut(sp.tail, '\n');
+    if(SpanEqual(sp.head, S("// end"))) return SPANRESULT(sp.tail);
+
+    SpanPair kind = SpanCut(sp.head, ' ');
+    SpanPair a = SpanCut(SpanCut(kind.tail, ' ').tail, ' ');
+    SpanPair b = SpanCut(a.tail, ' ');
+    if(!SpanEqual(kind.head, S("//"))) return SPANERR("Bad header.");
+    Span tag = SpanCut(kind.tail, ' ').head;
+    if(SpanEqual(tag, S("tailcalls"))) {
+      if(apply) ctx->tailCalls = SpanToUlong(a.head);
+    } else if(SpanEqual(tag, S("rom"))) {
+      Span counts = SpanCut(kind.tail, ' ').tail;
+      for(size_t k = 0; k < ROMCOUNTS; k++) {
+        SpanPair n = SpanCut(counts, ' ');
+        if(!n.head.len) return SPANERR("Bad header.");
+        if(apply) ((Size*)&ctx->rom)[k] = SpanToUlong(n.head);
+        counts = n.tail;
+      }
+    } else if(SpanEqual(tag, S("size")) && a.tail.len) {
+      Function* f = FTGet(&Functions, a.head);
+      if(!f) return SPANERR("Bad header.");
+      if(apply) f->romSize = SpanToUlong(a.tail);
+    } else if(SpanEqual(tag, S("inlined")) && b.tail.len) {
+      long saved = b.tail.ptr[0] == '-' ? -(long)SpanToUlong((Span) {b.tail.ptr + 1, b.tail.len - 1}) :
+                                          (long)SpanToUlong(b.tail);
+      if(apply && recordInline(ctx, (InlineSite) { a.head, b.head, saved })) return SPANERR("Out of memory.");
+    } else {
+      return SPANERR("Bad header.");
+    }
+  }
+}
+
+// Returns true if the translation of ctx is in the cache. Otherwise it will be saved there.
+bool lookupCache(Context* ctx, uint64_t options) {
+  ctx->cacheKey = cacheKey(ctx, options);
+  ctx->saving = true;
+
+  char path[2048];
+  cachePath(ctx, path, sizeof(path));
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return false;
+  struct stat st;
+  Byte* data = fstat(fd, &st) || st.st_size == 0 ? NULL : malloc(st.st_size);
+  bool loaded = data && read(fd, data, st.st_size) == st.st_size;
+  close(fd);
+
+  Span s = SPAN(data, loaded ? st.st_size : 0);
+  if(!loaded || readCacheHeader(s, ctx, false).error) {
+    free(data);
+    return false;
+  }
+  ctx->cached = readCacheHeader(s, ctx, true).data;
+  ctx->cacheFile = data;
+  ctx->saving = false;
+  return true;
+}
+
+// Writes the cached translation as if it was just made
+char* replayCache(Context* ctx) {
+  for(Span s = ctx->cached; s.len > 0;) {
+    CheckF(newChunk(ctx));
+    Size n = s.len < CHUNKSIZE ? s.len : CHUNKSIZE;
+    memcpy(ctx->current->data, s.ptr, n);
+    ctx->out.index = n;
+    sealChunk(ctx);
+    s = (Span) {s.ptr + n, s.len - n};
+  }
+  return NULL;
+}
+
+char* writeCacheHeader(Context* ctx, Buffer* bufout) {
+  char first[64];
+  snprintf(first, sizeof(first), "// vmcache %016llx", (unsigned long long)ctx->cacheKey);
+  WriteStrNL(first);
+  WriteStr("// tailcalls ");
+  WriteNum(ctx->tailCalls);
+  WriteStr("\n// rom");
+  for(size_t k = 0; k < ROMCOUNTS; k++) {
+    WriteStr(" ");
+    WriteNum(((Size*)&ctx->rom)[k]);
+  }
+  WriteStr("\n");
+  for(int32_t i = 0; i < Functions.len; i++) {
+    Function* f = Functions.inOrder[i];
+    if(f->file != ctx->vmFileName) continue;
+    WriteStr("// size ");
+    WriteSpan(f->name);
+    WriteStr(" ");
+    WriteNum(f->romSize);
+    WriteStr("\n");
+  }
+  for(int32_t i = 0; i < ctx->inlinedCount; i++) {
+    InlineSite* site = &ctx->inlined[i];
+    WriteStr("// inlined ");
+    WriteSpan(site->caller);
+    WriteStr(" ");
+    WriteSpan(site->callee);
+    WriteStr(" ");
+    WriteInt(site->saved);
+    WriteStr("\n");
+  }
+  WriteStrNL("// end");
+  return NULL;
+}
+
+// Written to a temporary file first, so that a cache file is either complete or not there
+char* writeCache(Context* ctx) {
+  Size size = 128 + ROMCOUNTS * 24;
+  for(int32_t i = 0; i < Functions.len; i++) size += Functions.inOrder[i]->name.len + 32;
+  for(int32_t i = 0; i < ctx->inlinedCount; i++) size += ctx->inlined[i].caller.len + ctx->inlined[i].callee.len + 32;
+  Byte* header = malloc(size);
+  Buffer buf = BufferInit(header, size);
+  char* err = header ? writeCacheHeader(ctx, &buf) : "Out of memory.";
+
+  char path[2048], temp[2100];
+  cachePath(ctx, path, sizeof(path));
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  int fd = err ? -1 : open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(!err && fd < 0) err = "Cannot open the cache file for writing.";
+  if(!err) {
+    struct iovec iov[2] = { { header, buf.index }, { ctx->saved, ctx->savedLen } };
+    err = writeAll(fd, iov, 2);
+    if(close(fd) && !err) err = "Error closing the cache file.";
+    if(!err && rename(temp, path)) err = "Cannot rename the cache file.";
+    if(err) unlink(temp);
+  }
+
+  free(header);
+  free(ctx->saved);
+  ctx->saved = NULL;
+  return err;
+}
+
+/* WORKER POOL */
+
+#define MAXWORKERS 64
+
+typedef struct {
+  Context* contexts;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+} WorkQueue;
+
+void* worker(void* arg) {
+  WorkQueue* q = arg;
+
+  while(true) {
+    pthread_mutex_lock(&q->lock);
+    int i = q->next++;
+    pthread_mutex_unlock(&q->lock);
+
+    if(i >= q->count) return NULL;
+
+    Context* ctx = &q->contexts[i];
+    ctx->error = ctx->cacheFile ? replayCache(ctx) : compile(ctx);
+    finishContext(ctx);
+
+    // Without the cache it only takes longer
+    char* cacheError = ctx->saving && !ctx->error ? writeCache(ctx) : NULL;
+    if(cacheError) fprintf(stderr, "WARNING: %s: %s\n", ctx->vmFileName, cacheError);
+  }
+}
+
+// Translates all contexts, each one in its own output buffer
+void compileAll(Context* contexts, int count, int workers) {
+  WorkQueue q = { contexts, count, 0, PTHREAD_MUTEX_INITIALIZER };
+  pthread_t threads[MAXWORKERS];
+
+  if(workers > count) workers = count;
+  if(workers > MAXWORKERS) workers = MAXWORKERS;
+
+  // The main thread works too
+  int started = 0;
+  for(; started < workers - 1; started++) {
+    if(pthread_create(&threads[started], NULL, worker, &q)) break;
+  }
+  worker(&q);
+
+  for(int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// Other tools reuse the front end by including this file
+#ifndef VM_NO_MAIN
+
+// X.vm becomes X.vmb and X.vmb becomes X.vm
+int convertAll(char** paths, int count) {
+  static Byte in[MAXFILESIZE], out[MAXFILESIZE];
+
+  for(int i = 0; i < count; i++) {
+    Buffer bufin = BufferInit(in, sizeof(in));
+    Buffer bufout = BufferInit(out, sizeof(out));
+    char name[1024];
+    Size len = strlen(paths[i]);
+    bool binary = len >= 4 && !strcmp(paths[i] + len - 4, ".vmb");
+    if(binary) snprintf(name, sizeof(name), "%.*s", (int)len - 1, paths[i]);
+    else snprintf(name, sizeof(name), "%sb", paths[i]);
+
+    SpanResult sr = loadVm(paths[i], sizeof(in), &bufin);
+    char* err = sr.error;
+    if(!err && !binary) err = textToVmb(sr.data, &bufout);
+    if(!err) err = OsFlash(name, binary ? sr.data : BufferToSpan(&bufout));
+    if(err) {
+      fprintf(stderr, "Error converting %s.\n%s\n", paths[i], err);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int compareNames(const void* a, const void* b) {
+  return strcmp(*(char**)a, *(char**)b);
+}
+
+// The .vm files in dir, sorted so that the output does not depend on the directory. -1 if it cannot be read.
+int listVmFiles(char* dir, char** paths, int max) {
+  DIR* d = opendir(dir);
+  if(!d) return -1;
+
+  int n = 0;
+  for(struct dirent* e; (e = readdir(d));) {
+    size_t len = strlen(e->d_name);
+    if(len < 4 || strcmp(e->d_name + len - 3, ".vm")) continue;
+    if(n == max) {
+      n = max + 1; // Too many, as the caller will say
+      break;
+    }
+    paths[n] = malloc(strlen(dir) + len + 2);
+    if(!paths[n]) break;
+    sprintf(paths[n++], "%s/%s", dir, e->d_name);
+  }
+  closedir(d);
+  if(n <= max) qsort(paths, n, sizeof(char*), compareNames);
+  return n;
+}
+
 int themain(int argc, char** argv) {
   #ifdef TEST
     test();
     return 0;
   #endif
 
-  if(argc == 1) {
-    fprintf(stderr, "Usage: %s <asm_files>\n", argv[0]);
+  // Flags come first
+  int first = 1;
+  int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  bool keepAllFunctions = false;
+  bool staticFrames = true;
+  bool convert = false;
+  char* profilePath = NULL;
+  for(; first < argc && argv[first][0] == '-'; first++) {
+    if(!strcmp(argv[first], "-a")) keepAllFunctions = true;
+    else if(!strncmp(argv[first], "-j", 2) && atoi(argv[first] + 2) > 0) workers = atoi(argv[first] + 2);
+    else if(!strcmp(argv[first], "-c0")) Comments = NoComments;
+    else if(!strcmp(argv[first], "-c1")) Comments = ShortComments;
+    else if(!strcmp(argv[first], "-c2")) Comments = FullComments;
+    else if(!strncmp(argv[first], "-i", 2) && isdigit(argv[first][2])) InlineMax = atoi(argv[first] + 2);
+    else if(!strcmp(argv[first], "-r")) staticFrames = false;
+    else if(!strcmp(argv[first], "-t")) TailCalls = false;
+    else if(!strcmp(argv[first], "-s")) UseIR = false;
+    else if(!strcmp(argv[first], "-d")) DumpIR = true;
+    else if(!strcmp(argv[first], "-p1")) Profile = ProfileCalls;
+    else if(!strcmp(argv[first], "-p2")) Profile = ProfileCycles;
+    else if(!strcmp(argv[first], "-b")) convert = true;
+    else if(!strncmp(argv[first], "-m", 2)) RomTop = argv[first][2] ? atoi(argv[first] + 2) : 10;
+    else if(!strncmp(argv[first], "-f", 2) && argv[first][2]) profilePath = argv[first] + 2;
+    else {
+      fprintf(stderr, "Unknown option %s\n", argv[first]);
+      return -1;
+    }
+  }
+
+  if(first == argc) {
+    fprintf(stderr, "Usage: %s [-a] [-j<n>] [-c<0|1|2>] [-i<n>] [-r] [-t] [-s] [-d] [-p<1|2>] [-f<profile>] [-m<n>] [-b] <vm_files|dir>\n",
+            argv[0]);
+    fprintf(stderr, "  -a     translate all functions, not just the ones reachable from Sys.init\n");
+    fprintf(stderr, "  -j<n>  translate n files at a time (defaults to the number of cores)\n");
+    fprintf(stderr, "  -c<n>  comments before each command: 0 none, 1 command only, 2 whole line (default)\n");
+    fprintf(stderr, "  -i<n>  inline functions of up to n commands that make no calls, 0 disables (default %d)\n", INLINEMAX);
+    fprintf(stderr, "  -r     keep every frame on the stack, as if any function could be recursive\n");
+    fprintf(stderr, "  -t     no tail calls, a call right before a return makes a new frame\n");
+    fprintf(stderr, "  -s     translate each stack command on its own instead of going through the register IR\n");
+    fprintf(stderr, "  -d     write the IR of each block to the output as comments\n");
+    fprintf(stderr, "  -p<n>  count calls to each function, 2 counts their cycles too, in RAM from %d as listed in out.map.\n"
+                    "         Turns inlining off so that every function is counted.\n", PROFILEBASE);
+    fprintf(stderr, "  -f<p>  lay out branches and inline by the counts in profile p, as written by vmi -f<p>\n");
+    fprintf(stderr, "  -m<n>  report ROM use by command, segment and file, with the n largest functions (default 10)\n");
+    fprintf(stderr, "  -b     convert each file between text and binary, X.vm to X.vmb and back, instead of translating\n");
+    fprintf(stderr, "Files ending in .vmb are read as binary. A directory stands for its .vm files, their translations\n"
+                    "are kept in %s there and only the files that changed are translated again.\n", CACHEDIR);
     return -1;
   }
 
+  if(convert) return convertAll(argv + first, argc - first);
 
-  #define MAXFILESIZE 1<<20
-  static Byte fileout[MAXFILESIZE];
-  Buffer bufout = BufferInit(fileout, MAXFILESIZE);
+  char* profileError = profilePath ? loadProfile(profilePath) : NULL;
+  if(profileError) {
+    fprintf(stderr, "ERROR: %s: %s\n", profilePath, profileError);
+    return -1;
+  }
 
-  // Call Sys.init
-  char* err = bootstrap(&bufout);
-  if(err) {
-    fprintf(stderr, "Error writing bootstrapping code??");
+  // A directory stands for the .vm files in it, which are translated through the cache
+  #define MAXFILES 1024
+  static char* listed[MAXFILES];
+  char** inputs = argv + first;
+  int count = argc - first;
+  struct stat st;
+  if(count == 1 && !stat(inputs[0], &st) && S_ISDIR(st.st_mode)) {
+    count = listVmFiles(inputs[0], listed, MAXFILES);
+    if(count <= 0) {
+      fprintf(stderr, count ? "Cannot list the directory %s.\n" : "No .vm files in %s.\n", inputs[0]);
+      return -1;
+    }
+    snprintf(CacheDir, sizeof(CacheDir), "%s/" CACHEDIR, inputs[0]);
+    mkdir(CacheDir, 0755); // Failing here, saving will say why
+    inputs = listed;
+  }
+
+  if(count > MAXFILES) {
+    fprintf(stderr, "Too many input files.\n");
     return -1;
   }
 
-  // Processes all files
-  for(int i = 1; i < argc; i++) {
-    VmFileName = basename(argv[i]);
+  // Load all files first, the whole program is needed to know which functions are called
+  static Byte filein[MAXFILESIZE];
+  static Context contexts[MAXFILES];
+  Size loaded = 0;
+  Size statics = 0;
 
-    static Byte filein [MAXFILESIZE];
-    Buffer bufin  = BufferInit(filein , MAXFILESIZE);
+  for(int i = 0; i < count; i++) {
+    Buffer bufin = BufferInit(filein + loaded, MAXFILESIZE - loaded);
 
-    // Load asm file
-    SpanResult sr = OsSlurp(argv[i], MAXFILESIZE, &bufin);
+    SpanResult sr = loadVm(inputs[i], MAXFILESIZE - loaded, &bufin);
     if(sr.error) {
-      fprintf(stderr, "Error reading file %s.\n%s\n", argv[i], sr.error);
+      fprintf(stderr, "Error reading file %s.\n%s\n", inputs[i], sr.error);
       return -1;
     }
+    loaded += sr.data.len;
+
+    Context* ctx    = &contexts[i];
+    ctx->vmFileName = basename(inputs[i], ctx->fileNameBuf);
+    ctx->staticsFile = ctx->vmFileName;
+    ctx->funcName   = SpanFromString(ctx->vmFileName); // For code outside of any function
+
+    // The file laid out again goes after it
+    if(profilePath) {
+      Buffer laid = BufferInit(filein + loaded, MAXFILESIZE - loaded);
+      char* layoutError = layoutFile(sr.data, ctx->funcName, &laid);
+      if(layoutError) {
+        fprintf(stderr, "Error laying out file %s.\n%s\n", inputs[i], layoutError);
+        return -1;
+      }
+      sr.data = BufferToSpan(&laid);
+      loaded += sr.data.len;
+    }
+    ctx->source     = sr.data;
 
-    // Produce Assembler
-    SpanResult sResult = compile(sr.data, &bufout);
-    if(sResult.error) {
-      fprintf(stderr, "ERROR: %s\n", sResult.error);
+    statics += countStatics(sr.data);
+    char* scanError = scanFunctions(sr.data, ctx->vmFileName);
+    if(scanError) {
+      fprintf(stderr, "ERROR: %s\n", scanError);
       return -1;
     }
   }
 
-  // Save into output file
-  Span s = BufferToSpan(&bufout);
+  if(Profile) InlineMax = 0;
+  if(profilePath) profileCalls();
+  for(int32_t i = 0; i < Functions.len; i++) {
+    analyzeFunction(Functions.inOrder[i]);
+    analyzeInline(Functions.inOrder[i]);
+  }
+  if(profilePath) {
+    reportLayout();
+    reportProfileInlining();
+  }
+
+  // Without a Sys.init there is no root to start from, so everything is kept
+  if(keepAllFunctions || !markLive(S("Sys.init"))) markAllLive();
+
+  int32_t frameWords = staticFrames ? assignFramesMeasuringDead(statics) : 0;
+  int32_t profiledCount = Profile ? assignProfileCounters() : 0;
 
-  Byte newName[1024];
-  Buffer nbuf = BufferInit(newName, 1024);
-  Span oldName = SpanFromString(argv[1]);
+  // Files are looked up only now, their keys depend on what is known of the whole program
+  int cachedCount = 0;
+  uint64_t options = optionsKey();
+  for(int i = 0; i < count && CacheDir[0]; i++) cachedCount += lookupCache(&contexts[i], options);
+
+  // Output file goes next to the first input file
+  char outName[1024];
+  Span oldName = SpanFromString(inputs[0]);
   Span baseName = SpanRCut(oldName, '/').head; // just for linux
+  snprintf(outName, sizeof(outName), "%.*s/out.asm", (int)baseName.len, (char*)baseName.ptr);
+
+  if(Profile) {
+    char mapName[1024];
+    snprintf(mapName, sizeof(mapName), "%.*s/out.map", (int)baseName.len, (char*)baseName.ptr);
+    char* mapError = writeProfileMap(mapName);
+    if(mapError) {
+      fprintf(stderr, "ERROR: %s\n", mapError);
+      return -1;
+    }
+  }
+
+  int fd = open(outName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    fprintf(stderr, "Cannot open %s for writing.\n", outName);
+    return -1;
+  }
+
+  // Call Sys.init. Without one the code starts at the first command, the tests of project 07 set up the RAM.
+  Byte bootout[1024];
+  Buffer bootbuf = BufferInit(bootout, sizeof(bootout));
+  struct iovec bootiov = { bootout, 0 };
+  char* err = FTGet(&Functions, S("Sys.init")) ? bootstrap(&bootbuf) : NULL;
+  bootiov.iov_len = bootbuf.index;
+  if(!err) err = writeAll(fd, &bootiov, 1);
+  if(err) {
+    fprintf(stderr, "Error writing bootstrapping code: %s\n", err);
+    close(fd);
+    unlink(outName);
+    return -1;
+  }
 
-  BufferCopy(baseName, &nbuf);
-  BufferCopy(S("/out.asm"), &nbuf);
-  BufferPushByte(&nbuf, 0);
+  // Produce Assembler
+  Out = (Writer) { contexts, count, 0, fd, NULL, PTHREAD_MUTEX_INITIALIZER };
+  compileAll(contexts, count, workers);
 
-  char* writeError = OsFlash((char*)BufferToSpan(&nbuf).ptr, s);
-  if(writeError) {
-    fprintf(stderr, "%s\n", writeError);
+  for(int i = 0; i < count && !err; i++) err = contexts[i].error;
+  if(!err) err = Out.error;
+  if(close(fd) && !err) err = "Error closing the output file.";
+  if(err) {
+    fprintf(stderr, "ERROR: %s\n", err);
+    unlink(outName);
     return -1;
   }
+
+  reportInlining(contexts, count);
+  unsigned tailCalls = 0;
+  for(int i = 0; i < count; i++) tailCalls += contexts[i].tailCalls;
+  if(tailCalls) printf("Tail calls at %u call sites.\n", tailCalls);
+  reportStaticFrames(frameWords);
+  reportDeadFunctions();
+  if(Profile) printf("Profiling %d of %d functions in RAM from %d.\n", profiledCount, Functions.len, PROFILEBASE);
+  if(RomTop >= 0) reportRom(contexts, count, countInstructions(BufferToSpan(&bootbuf)));
+  if(CacheDir[0]) printf("Translated %d of %d files, the others were in %s.\n", count - cachedCount, count, CacheDir);
+  for(int i = 0; i < count; i++) free(contexts[i].cacheFile);
   return 0;
 }
 
@@ -587,6 +3621,14 @@ void SpanPuts(Span s) {
   puts("\n");
   fflush(stdout);
 }
+// Times what is found in s, for the tests
+int countIn(Span s, char* what) {
+  Size len = strlen(what);
+  int n = 0;
+  for(Size i = 0; i + len <= s.len; i++) n += !memcmp(s.ptr + i, what, len);
+  return n;
+}
+
 void test() {
   #define TPARSE(_tt,_a1,_a2) { \
     Token t = parseLine(S(#_tt " " #_a1 " " #_a2)); \
@@ -598,9 +3640,115 @@ void test() {
   TPARSE(push , const, 3);
   TPARSE(pop , const, 3);
 
-  Byte b[1 << 10];
-  Buffer buf = BufferInit(b, 1 << 10);
-  SpanResult sr = compile(S("push const 3"), &buf);
-  (void)sr;
+  Context ctx = { .vmFileName = "Test", .staticsFile = "Test", .funcName = S("Test.f"), .source = S("push const 3") };
+  assert(compile(&ctx));
+  free(ctx.current);
+
+  #define TCODE(_line, _asm) { \
+    Byte _b[1 << 10]; \
+    Buffer _buf = BufferInit(_b, sizeof(_b)); \
+    assert(!tokenToOps(parseLine(S(_line)), &ctx, &_buf)); \
+    assert(SpanEqual(BufferToSpan(&_buf), S(_asm))); \
+    }
+
+  // One block, SP in RAM only catches up when the top gets too far from it or at the label
+  TCODE("push constant 0", "@SP\nA=M\nM=0\n");
+  TCODE("push constant 7", "@7\nD=A\n@SP\nA=M+1\nM=D\n");
+  TCODE("push temp 2", "@7\nD=M\n@SP\nA=M+1\nA=A+1\nM=D\n");
+  TCODE("push local 1", "@LCL\nA=M+1\nD=M\n@SP\nM=M+1\nM=M+1\nM=M+1\n@SP\nA=M\nM=D\n");
+  TCODE("pop pointer 1", "@SP\nA=M\nD=M\n@THAT\nM=D\n");
+  TCODE("pop argument 2", "@SP\nA=M-1\nD=M\n@ARG\nA=M\nA=A+1\nA=A+1\nM=D\n");
+
+  assert(countInstructions(S("\n// push\n(L)\n@SP\nM=M+1\n")) == 2);
+
+  TCODE("label LOOP", "@SP\nM=M-1\n(Test.f$LOOP)\n");
+  TCODE("eq", "@SP\nA=M-1\nD=M\n@SP\nA=M-1\nA=A-1\nA=M\nD=D-A\n@Test$LABEL0\nD;JEQ\n@Test$LABEL1\n0;JMP\n"
+    "(Test$LABEL0)\nD=-1\n@Test$LABEL2\n0;JMP\n(Test$LABEL1)\nD=0\n@Test$LABEL2\n0;JMP\n(Test$LABEL2)\n"
+    "@SP\nA=M-1\nA=A-1\nM=D\n");
+  TCODE("neg", "@SP\nA=M-1\nA=A-1\nM=-M\n");
+  TCODE("sub", "@SP\nA=M-1\nA=A-1\nD=M\n@SP\nA=M-1\nA=A-1\nA=A-1\nM=M-D\n");
+  TCODE("goto LOOP", "@SP\nM=M-1\nM=M-1\n@Test.f$LOOP\n0;JMP\n");
+  assert(ctx.sp == 0);
+
+  // Tail calls into a static frame, which gets the return address of ours: from a stack frame that is taken down
+  // with the result to go where ARG is, and from a static frame that puts THIS back
+  Function* h = FTAdd(&Functions, S("Test.h"));
+  *h = (Function) { .name = S("Test.h"), .args = 1, .staticFrame = true, .frameBase = 4 };
+  ctx.tail = true;
+  TCODE("call Test.h 1", "@SP\nAM=M-1\nD=M\n@$frame.5\nM=D\n@LCL\nD=M\n@R13\nM=D\n@5\nA=D-A\nD=M\n@$frame.4\nM=D\n"
+    "@ARG\nD=M\n@SP\nM=D\n@R13\nD=M\n@1\nA=D-A\nD=M\n@THAT\nM=D\n@R13\nD=M\n@2\nA=D-A\nD=M\n@THIS\nM=D\n"
+    "@R13\nD=M\n@3\nA=D-A\nD=M\n@ARG\nM=D\n@R13\nD=M\n@4\nA=D-A\nD=M\n@LCL\nM=D\n@Test.h\n0;JMP\n");
+  Function g = { .name = S("Test.g"), .args = 1, .pointersSet = 1, .staticFrame = true, .frameBase = 0 };
+  ctx.func = &g;
+  TCODE("call Test.h 1", "@SP\nAM=M-1\nD=M\n@$frame.5\nM=D\n@$frame.0\nD=M\n@$frame.4\nM=D\n@$frame.2\nD=M\n@THIS\nM=D\n"
+    "@Test.h\n0;JMP\n");
+  assert(ctx.tailCalls == 2);
+  ctx.tail = false;
+  ctx.func = NULL;
+  memset(&Functions, 0, sizeof(Functions));
+
+  // The IR keeps the values in registers and updates the local in place
+  Byte irb[1 << 10];
+  Buffer irBuf = BufferInit(irb, sizeof(irb));
+  assert(!emitRun(S("push local 0\npush constant 1\nadd\npop local 0\n"), &ctx, &irBuf));
+  assert(SpanEqual(BufferToSpan(&irBuf), S("\n// push local 0\n\n// push constant 1\n\n// add\n\n// pop local 0\n@LCL\nA=M\nM=M+1\n")));
+  assert(ctx.sp == 0);
+  // All of it is the store to the local
+  countRom(&ctx, (Token) {pop, S("local"), S("0")}, false, ctx.ir, 3);
+  assert(ctx.rom.total == 3 && ctx.rom.commands[pop] == 3 && ctx.rom.pops[segmentId(S("local"))] == 3);
+  free(ctx.ir);
+
+  Function abs = { .name = S("Test.abs"), .code = S("function Test.abs 0\npush argument 0\npush constant 0\nlt\n"
+    "if-goto NEG\npush argument 0\nreturn\nlabel NEG\npush argument 0\nneg\nreturn\n") };
+  analyzeFunction(&abs);
+  analyzeInline(&abs);
+  assert(abs.balanced && abs.inlinable && abs.argsUsed == 1 && inlineSite(NULL, &abs, 1) && !inlineSite(NULL, &abs, 0));
+
+  Function rec = { .name = S("Test.rec"), .code = S("function Test.rec 0\npush argument 0\ncall Test.rec 1\nreturn\n") };
+  analyzeFunction(&rec);
+  analyzeInline(&rec);
+  assert(rec.balanced && rec.calls && !rec.inlinable);
+
+  // The IR keeps no values in the temp slots of the arguments while the body runs, arguments 0 and 1 are in
+  // temp 7 and 6
+  Function sum = { .name = S("Test.sum"), .code = S("function Test.sum 0\npush argument 1\npush argument 1\n"
+    "push argument 1\npush constant 5\npop temp 0\nadd\nadd\npush argument 0\nadd\nreturn\n") };
+  analyzeFunction(&sum);
+  analyzeInline(&sum);
+  assert(sum.inlinable && sum.tempsUsed == 1);
+  Function caller = { .name = S("Test.caller"), .balanced = true };
+  Context site = { .vmFileName = "Test", .staticsFile = "Test", .funcName = S("Test.caller"), .func = &caller };
+  Byte sb[4096];
+  Buffer siteBuf = BufferInit(sb, sizeof(sb));
+  assert(!emitInline(S("call Test.sum 2"), (Token) { call, S("Test.sum"), S("2") }, &sum, &site, &siteBuf));
+  assert(countIn(BufferToSpan(&siteBuf), "@12\nM=D\n") == 1 && countIn(BufferToSpan(&siteBuf), "@11\nM=D\n") == 1);
+  assert(site.inlineTemps == 0);
+  free(site.inlined);
+  free(site.ir);
+  free(site.scratch);
+
+  // The arm that runs most falls through, the not goes as the if-goto is negated
+  Byte laid[512];
+  Buffer laidBuf = BufferInit(laid, sizeof(laid));
+  Branches[0] = (BranchProfile) { S("Test.g$ELSE"), 1, 9 };
+  BranchCount = 1;
+  DecisionCount = 0;
+  assert(!layoutFile(S("function Test.g 0\npush argument 0\npush constant 0\nlt\nnot\nif-goto ELSE\npush constant 1\n"
+                       "goto END\nlabel ELSE\npush constant 2\nlabel END\nreturn\n"), S("Test"), &laidBuf));
+  assert(SpanEqual(BufferToSpan(&laidBuf), S("function Test.g 0\npush argument 0\npush constant 0\nlt\nif-goto ELSE.arm\n"
+                   "label ELSE\npush constant 2\ngoto END\nlabel ELSE.arm\npush constant 1\nlabel END\nreturn\n")));
+  assert(DecisionCount == 1 && Decisions[0].kind == SwapArms && SpanEqual(Decisions[0].func, S("Test.g")) &&
+         SpanEqual(Decisions[0].label, S("ELSE")) && Decisions[0].taken == 1 && Decisions[0].fell == 9);
+  BranchCount = 0;
+  DecisionCount = 0;
+
+  Byte bin[256], text[256];
+  Buffer binBuf = BufferInit(bin, sizeof(bin)), textBuf = BufferInit(text, sizeof(text));
+  Span source = S("function Test.f 2\npush constant 300\nlabel L1\nif-goto L1\ncall Test.f 1\npop that 5\nreturn\n");
+  assert(!textToVmb(S("// Comment\nfunction Test.f 2\npush constant 300\nlabel L1\nif-goto L1\n\ncall Test.f 1\n"
+                      "pop that 5 // Comment\nreturn\n"), &binBuf));
+  assert(!vmbToText(BufferToSpan(&binBuf), &textBuf));
+  assert(SpanEqual(BufferToSpan(&textBuf), source));
 }
 
+#endif // VM_NO_MAIN
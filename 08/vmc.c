@@ -0,0 +1,346 @@
+// Translates .vm programs to C. Each VM function becomes a C function over a simulated RAM array,
+// labels become C labels and calls become C calls. Frames keep the Hack layout so RAM looks the same
+// as with the Hack translation, except that return addresses are call site numbers.
+// The output is built with the system compiler, e.g. 'cc -O2 out.c -o out'.
+#define VM_NO_MAIN
+#include "vm.c"
+
+/* RUNTIME */
+
+// Goes before the translated functions
+static const char Prelude[] =
+  "// Generated from VM code\n"
+  "#include <stdint.h>\n"
+  "#include <stdio.h>\n"
+  "#include <stdlib.h>\n"
+  "\n"
+  "#pragma GCC diagnostic ignored \"-Wunused-label\"\n"
+  "#pragma GCC diagnostic ignored \"-Wunused-function\"\n"
+  "\n"
+  "static int16_t Ram[32768];\n"
+  "\n"
+  "#define AT(_a) Ram[(uint16_t)(_a) & 32767]\n"
+  "#define SP   Ram[0]\n"
+  "#define LCL  Ram[1]\n"
+  "#define ARG  Ram[2]\n"
+  "#define THIS Ram[3]\n"
+  "#define THAT Ram[4]\n"
+  "\n"
+  "#define PUSH(_v) { int16_t _p = (_v); AT(SP) = _p; SP += 1; }\n"
+  "#define POP(_l) { SP -= 1; _l = AT(SP); }\n"
+  "#define UNARY(_e) { int16_t x = AT(SP - 1); AT(SP - 1) = (int16_t)(_e); }\n"
+  "#define BINARY(_e) { int16_t y = AT(SP - 1); SP -= 1; int16_t x = AT(SP - 1); AT(SP - 1) = (int16_t)(_e); }\n"
+  "#define IFGOTO(_l) { SP -= 1; if(AT(SP)) goto _l; }\n"
+  "#define LOCALS(_n) for(int _i = 0; _i < (_n); _i++) PUSH(0)\n"
+  "#define CALL(_f, _n, _ret) { \\\n"
+  "  int16_t _args = SP - (_n); \\\n"
+  "  PUSH(_ret); PUSH(LCL); PUSH(ARG); PUSH(THIS); PUSH(THAT); \\\n"
+  "  ARG = _args; LCL = SP; \\\n"
+  "  _f(); }\n"
+  "#define RETURN { \\\n"
+  "  int16_t _frame = LCL; \\\n"
+  "  AT(ARG) = AT(SP - 1); SP = ARG + 1; \\\n"
+  "  THAT = AT(_frame - 1); THIS = AT(_frame - 2); ARG = AT(_frame - 3); LCL = AT(_frame - 4); \\\n"
+  "  return; }\n"
+  "\n"
+  "static void Halt(void);\n"
+  "\n";
+
+// Goes after Start, the options are the ones of the interpreter minus the step limit
+static const char Epilogue[] =
+  "static int Prints[32768];\n"
+  "static int PrintCount = 0;\n"
+  "static const char* ScreenFile = NULL;\n"
+  "\n"
+  "static void Halt(void) {\n"
+  "  for(int i = 0; i < PrintCount; i++) printf(\"RAM[%d] = %d\\n\", Prints[i], Ram[Prints[i]]);\n"
+  "\n"
+  "  FILE* f = ScreenFile ? fopen(ScreenFile, \"wb\") : NULL;\n"
+  "  if(f) {\n"
+  "    fprintf(f, \"P1\\n512 256\\n\");\n"
+  "    for(int row = 0; row < 256; row++) {\n"
+  "      for(int col = 0; col < 512; col++) fputc(Ram[16384 + row * 32 + col / 16] >> (col % 16) & 1 ? '1' : '0', f);\n"
+  "      fputc('\\n', f);\n"
+  "    }\n"
+  "    fclose(f);\n"
+  "  }\n"
+  "  exit(0);\n"
+  "}\n"
+  "\n"
+  "int main(int argc, char** argv) {\n"
+  "  for(int i = 1; i < argc; i++) {\n"
+  "    int addr, value;\n"
+  "    if(sscanf(argv[i], \"-s%d=%d\", &addr, &value) == 2 && addr >= 0 && addr < 32768) Ram[addr] = value;\n"
+  "    else if(sscanf(argv[i], \"-p%d\", &addr) == 1 && addr >= 0 && addr < 32768 && PrintCount < 32768) Prints[PrintCount++] = addr;\n"
+  "    else if(argv[i][0] == '-' && argv[i][1] == 'd' && argv[i][2]) ScreenFile = argv[i] + 2;\n"
+  "    else {\n"
+  "      fprintf(stderr, \"Usage: %s [-s<addr>=<value>]... [-p<addr>]... [-d<screen.pbm>]\\n\", argv[0]);\n"
+  "      return -1;\n"
+  "    }\n"
+  "  }\n"
+  "  Start();\n"
+  "  Halt();\n"
+  "  return 0;\n"
+  "}\n";
+
+/* TRANSLATION */
+
+#define STATICBASE 16
+#define MAXSTATICS (256 - STATICBASE) // Above that they would run into the stack
+
+// Translated functions and the code outside of any function, which goes in Start
+static Byte FuncsMem[1 << 24];
+static Byte TopMem[1 << 20];
+static Buffer Funcs;
+static Buffer Top;
+
+static int32_t NextStatic = STATICBASE;
+static int32_t CallSites = 0;
+
+// Letters and digits are kept, anything else becomes _XX so that different names stay different
+char* writeIdent(char* prefix, Span name, Buffer* bufout) {
+  WriteStr(prefix);
+  for(Size i = 0; i < name.len; i++) {
+    Byte c = name.ptr[i];
+    if(isalnum(c)) {
+      if(BufferPushByte(bufout, c).error) return "Writing buffer too small";
+    } else {
+      char hex[8];
+      sprintf(hex, "_%02X", c);
+      WriteStr(hex);
+    }
+  }
+  return NULL;
+}
+
+#define WriteFunc(_f) CheckF(writeIdent("F_", (_f), bufout))
+#define WriteLabelName(_l) { \
+  char _lb[1024]; \
+  snprintf(_lb, sizeof(_lb), "%.*s$%.*s", (int)funcName.len, (char*)funcName.ptr, (int)(_l).len, (char*)(_l).ptr); \
+  CheckF(writeIdent("L_", SpanFromString(_lb), bufout)); }
+
+// The C expression for the RAM word of segment[idx]. Statics get addresses in order of first use, as with the assembler.
+char* writeLocation(Span segment, Span idx, int32_t* statics, Buffer* bufout) {
+  if(SpanEqual(segment, S("static"))) {
+    Size i = SpanToUlong(idx);
+    if(i >= MAXSTATICS) return "Too many static variables.";
+    if(statics[i] < 0) {
+      if(NextStatic >= STATICBASE + MAXSTATICS) return "Too many static variables.";
+      statics[i] = NextStatic++;
+    }
+    WriteStr("Ram["); WriteNum(statics[i]); WriteStr("]");
+    return NULL;
+  }
+
+  char* base = SpanEqual(segment, S("temp"))    ? "Ram[5 + " :
+               SpanEqual(segment, S("pointer")) ? "Ram[3 + " :
+               SpanEqual(segment, S("local"))    ? "AT(LCL + " :
+               SpanEqual(segment, S("argument")) ? "AT(ARG + " :
+               SpanEqual(segment, S("this"))     ? "AT(THIS + " :
+               SpanEqual(segment, S("that"))     ? "AT(THAT + " : NULL;
+  if(!base) return "Not a known segment type.";
+  WriteStr(base); WriteSpan(idx); WriteStr(base[0] == 'R' ? "]" : ")");
+  return NULL;
+}
+
+// Translates the live functions of one file, the code before the first function goes to Start
+char* translate(Span s, Span file) {
+  Span funcName = file; // For code outside of any function
+  Buffer* bufout = &Top;
+  bool skip = false;      // In a dead function or a definition overridden by a later one
+  Span lastLabel = SPAN0; // If nothing came after it
+
+  int32_t statics[MAXSTATICS];
+  for(int i = 0; i < MAXSTATICS; i++) statics[i] = -1;
+
+  while(s.len > 0) {
+    SpanPair sp = SpanCut(s, '\n');
+    Span line = sp.head;
+    s = sp.tail;
+
+    Token t = parseLine(line);
+    if(t.type == Empty) continue;
+    if(t.type == Error) return "An error occurred.";
+
+    if(t.type == function) {
+      Function* f = FTGet(&Functions, t.arg1);
+      if(bufout == &Funcs && !skip) WriteStr("}\n\n");
+      skip = !f || !f->live || f->code.ptr != line.ptr;
+      bufout = &Funcs;
+      funcName = t.arg1;
+      lastLabel = SPAN0;
+      if(skip) continue;
+
+      WriteStr("static void "); WriteFunc(t.arg1); WriteStr("(void) {\n");
+      WriteStr("  LOCALS("); WriteSpan(t.arg2); WriteStr(");\n");
+      continue;
+    }
+    if(skip) continue;
+
+    WriteStr("  ");
+    switch(t.type) {
+      case push:
+        if(SpanEqual(t.arg1, S("constant"))) {
+          WriteStr("PUSH("); WriteSpan(t.arg2); WriteStr(");\n");
+        } else {
+          WriteStr("PUSH("); CheckF(writeLocation(t.arg1, t.arg2, statics, bufout)); WriteStr(");\n");
+        }
+        break;
+      case pop:
+        WriteStr("POP("); CheckF(writeLocation(t.arg1, t.arg2, statics, bufout)); WriteStr(");\n");
+        break;
+      case add: WriteStr("BINARY(x + y);\n"); break;
+      case sub: WriteStr("BINARY(x - y);\n"); break;
+      case eq:  WriteStr("BINARY(x == y ? -1 : 0);\n"); break;
+      // By the sign of y - x as the Hack code does, the subtraction wraps
+      case gt:  WriteStr("BINARY((int16_t)(y - x) < 0 ? -1 : 0);\n"); break;
+      case lt:  WriteStr("BINARY((int16_t)(y - x) > 0 ? -1 : 0);\n"); break;
+      case and: WriteStr("BINARY(x & y);\n"); break;
+      case or:  WriteStr("BINARY(x | y);\n"); break;
+      case neg: WriteStr("UNARY(-x);\n"); break;
+      case not: WriteStr("UNARY(~x);\n"); break;
+      case label:
+        WriteLabelName(t.arg1); WriteStr(":;\n");
+        lastLabel = t.arg1;
+        continue;
+      case gotoe:
+        // A label that only jumps to itself can only spin, as at the end of Sys.halt
+        if(lastLabel.len && SpanEqual(lastLabel, t.arg1)) {
+          WriteStr("Halt();\n");
+        } else {
+          WriteStr("goto "); WriteLabelName(t.arg1); WriteStr(";\n");
+        }
+        break;
+      case gotoeif:
+        WriteStr("IFGOTO("); WriteLabelName(t.arg1); WriteStr(");\n");
+        break;
+      case call:
+        if(!FTGet(&Functions, t.arg1)) {
+          static char err[1024];
+          snprintf(err, sizeof(err), "Undefined function %.*s", (int)t.arg1.len, (char*)t.arg1.ptr);
+          return err;
+        }
+        // By contract Sys.halt never returns
+        if(SpanEqual(t.arg1, S("Sys.halt"))) {
+          WriteStr("Halt();\n");
+        } else {
+          WriteStr("CALL("); WriteFunc(t.arg1); WriteStr(", "); WriteSpan(t.arg2);
+          WriteStr(", "); WriteNum(CallSites++); WriteStr(");\n");
+        }
+        break;
+      case returne:
+        WriteStr("RETURN;\n");
+        break;
+      case function: case Empty: case Error:
+        break;
+    }
+    lastLabel = SPAN0;
+  }
+  if(bufout == &Funcs && !skip) WriteStr("}\n\n");
+  return NULL;
+}
+
+// Prototypes for all the live functions, so that they can call each other in any order
+char* writePrototypes(Buffer* bufout) {
+  for(int32_t i = 0; i < Functions.len; i++) {
+    Function* f = Functions.inOrder[i];
+    if(!f->live) continue;
+    WriteStr("static void "); WriteFunc(f->name); WriteStr("(void);\n");
+  }
+  WriteStr("\n");
+  return NULL;
+}
+
+// As the Hack bootstrap if there is a Sys.init. Otherwise the code outside functions runs with the RAM as set,
+// or the first function is entered directly as in the tests of a single function.
+char* writeStart(Span firstFunction, Buffer* bufout) {
+  WriteStr("static void Start(void) {\n");
+  if(FTGet(&Functions, S("Sys.init"))) {
+    WriteStr("  SP = 256;\n");
+    WriteStr("  CALL("); WriteFunc(S("Sys.init")); WriteStr(", 0, "); WriteNum(CallSites++); WriteStr(");\n");
+  } else if(Top.index) {
+    WriteSpan(BufferToSpan(&Top));
+  } else if(firstFunction.len) {
+    WriteStr("  "); WriteFunc(firstFunction); WriteStr("();\n");
+  }
+  WriteStr("}\n\n");
+  return NULL;
+}
+
+int themain(int argc, char** argv) {
+  if(argc < 2) {
+    fprintf(stderr, "Usage: %s <vm_files>\n", argv[0]);
+    fprintf(stderr, "  Writes out.c next to the first file, build it with 'cc -O2 out.c -o out'\n");
+    return -1;
+  }
+
+  Funcs = BufferInit(FuncsMem, sizeof(FuncsMem));
+  Top = BufferInit(TopMem, sizeof(TopMem));
+
+  // Load all files first, the whole program is needed to know which functions are called
+  static Byte filein[MAXFILESIZE];
+  static Span sources[1024];
+  static char fileNameBufs[1024][1024];
+  static char* files[1024];
+  if(argc - 1 > 1024) {
+    fprintf(stderr, "Too many input files.\n");
+    return -1;
+  }
+  Size loaded = 0;
+
+  for(int i = 1; i < argc; i++) {
+    char* file = files[i - 1] = basename(argv[i], fileNameBufs[i - 1]);
+    Buffer bufin = BufferInit(filein + loaded, MAXFILESIZE - loaded);
+
+    SpanResult sr = loadVm(argv[i], MAXFILESIZE - loaded, &bufin);
+    if(sr.error) {
+      fprintf(stderr, "Error reading file %s.\n%s\n", argv[i], sr.error);
+      return -1;
+    }
+    loaded += sr.data.len;
+    sources[i - 1] = sr.data;
+
+    char* scanError = scanFunctions(sr.data, file);
+    if(scanError) {
+      fprintf(stderr, "ERROR: %s\n", scanError);
+      return -1;
+    }
+  }
+
+  // Without a Sys.init there is no root to start from, so everything is kept
+  if(!markLive(S("Sys.init"))) markAllLive();
+
+  for(int i = 1; i < argc; i++) {
+    char* err = translate(sources[i - 1], SpanFromString(files[i - 1]));
+    if(err) {
+      fprintf(stderr, "ERROR: %s: %s\n", argv[i], err);
+      return -1;
+    }
+  }
+
+  static Byte outMem[(1 << 24) + (1 << 21)];
+  Buffer out = BufferInit(outMem, sizeof(outMem));
+  Span firstFunction = Functions.len ? Functions.inOrder[0]->name : SPAN0;
+
+  char* err = BufferCopy(SpanFromString((char*)Prelude), &out).error;
+  if(!err) err = writePrototypes(&out);
+  if(!err) err = BufferCopy(BufferToSpan(&Funcs), &out).error;
+  if(!err) err = writeStart(firstFunction, &out);
+  if(!err) err = BufferCopy(SpanFromString((char*)Epilogue), &out).error;
+  if(err) {
+    fprintf(stderr, "ERROR: %s\n", err);
+    return -1;
+  }
+
+  // Output file goes next to the first input file
+  char outName[1024];
+  Span baseName = SpanRCut(SpanFromString(argv[1]), '/').head; // just for linux
+  snprintf(outName, sizeof(outName), "%.*s/out.c", (int)baseName.len, (char*)baseName.ptr);
+
+  err = OsFlash(outName, BufferToSpan(&out));
+  if(err) {
+    fprintf(stderr, "Error writing %s.\n%s\n", outName, err);
+    return -1;
+  }
+  return 0;
+}
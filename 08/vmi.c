@@ -0,0 +1,485 @@
+// Runs .vm programs directly, without going through the assembler and the CPU emulator.
+// The front end (parseLine and TokenType) is the one of the translator.
+#define VM_NO_MAIN
+#include "vm.c"
+
+// Computed goto is a GCC extension
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/* INSTRUCTIONS */
+
+#define OPS \
+  X(PushConstant) X(PushLocal) X(PushArgument) X(PushThis) X(PushThat) \
+  X(PushTemp) X(PushPointer) X(PushStatic) \
+  X(PopLocal) X(PopArgument) X(PopThis) X(PopThat) \
+  X(PopTemp) X(PopPointer) X(PopStatic) \
+  X(Add) X(Sub) X(Neg) X(Eq) X(Gt) X(Lt) X(And) X(Or) X(Not) \
+  X(Goto) X(IfGoto) X(Call) X(Function) X(Return) X(Halt) X(Nop)
+
+typedef enum {
+#define X(_n) Op##_n,
+  OPS
+#undef X
+} Op;
+
+// arg is the index, constant, static address or jump target. nArgs is only used by call.
+typedef struct {
+  void* handler;
+  Op op;
+  int32_t arg;
+  int32_t nArgs;
+} Instr;
+
+// Return addresses are instruction indexes stored in a 16 bits word
+#define MAXINSTRS (1 << 16)
+static Instr Code[MAXINSTRS];
+static Span Targets[MAXINSTRS]; // Label or function to resolve for jumps and calls
+static int32_t CodeLen = 0;
+
+// Counted with -f: calls of each function by the index of its Function instruction, runs of each IfGoto
+static bool Counting = false;
+static int64_t Counts[MAXINSTRS];
+static int64_t Jumps[MAXINSTRS];
+
+#define RAMSIZE (1 << 15)
+static int16_t Ram[RAMSIZE];
+
+#define SCREEN 16384
+#define KBD 24576
+#define STATICBASE 16
+
+/* SYMBOLS */
+
+#define EXP 14
+#define LOADFACTOR 60
+#define MAXLEN (1 << EXP) * LOADFACTOR / 100
+
+typedef struct {
+  Span symbol;
+  int32_t value;
+} Entry;
+
+typedef struct {
+  Entry entries[1<<EXP];
+  int32_t len;
+} SymbolTable;
+
+// Labels and functions go to instruction indexes, statics to RAM addresses
+static SymbolTable Labels;
+static SymbolTable Statics;
+
+// Backing store for the names made up here, like 'Function$label'
+static Byte NamesMem[1 << 20];
+static Buffer Names;
+
+Entry* STFind(SymbolTable* st, Span symbol, bool add) {
+  assert(st);
+  assert(SpanValid(symbol));
+
+  if(add && MAXLEN < st->len) return NULL; // OOM
+
+  uint64_t h = HashString(symbol.ptr, symbol.len);
+  for(int32_t i = h;;) {
+    i = HashLookup(h, EXP, i);
+    Entry* e = &st->entries[i];
+
+    if(SpanEqual(symbol, e->symbol)) return e;
+    if(e->symbol.ptr == 0) {
+      if(!add) return NULL;
+      st->len += 1;
+      e->symbol = symbol;
+      e->value = -1;
+      return e;
+    }
+  }
+}
+
+// Returns an empty span if there is no space left
+Span saveName(Span a, char* sep, Span b) {
+  Size start = Names.index;
+  if(BufferCopy(a, &Names).error || BufferCopy(SpanFromString(sep), &Names).error ||
+     BufferCopy(b, &Names).error) return SPAN0;
+  return SPAN(Names.data.ptr + start, Names.index - start);
+}
+
+/* LOADER */
+
+// Returns -1 if the segment is not known
+int segmentOp(Span segment, bool push) {
+  #define SEGOPS \
+    X(local, Local) \
+    X(argument, Argument) \
+    X(this, This) \
+    X(that, That) \
+    X(temp, Temp) \
+    X(pointer, Pointer) \
+    X(static, Static)
+
+  #define X(_s, _o) if(SpanEqual(segment, S(#_s))) return push ? OpPush##_o : OpPop##_o;
+  SEGOPS
+  #undef X
+  if(push && SpanEqual(segment, S("constant"))) return OpPushConstant;
+  return -1;
+}
+
+char* emit(Op op, int32_t arg, int32_t nArgs, Span target) {
+  if(CodeLen == MAXINSTRS) return "Program too big.";
+  Code[CodeLen] = (Instr) { .op = op, .arg = arg, .nArgs = nArgs };
+  Targets[CodeLen] = target;
+  CodeLen += 1;
+  return NULL;
+}
+
+char* defineLabel(Span name) {
+  if(!name.len) return "Too many labels.";
+  Entry* e = STFind(&Labels, name, true);
+  if(!e) return "Too many labels.";
+  e->value = CodeLen;
+  return NULL;
+}
+
+// Turns the text of one file into instructions, jump targets are resolved later
+char* load(Span s, Span file) {
+  Span funcName = file; // For code outside of any function
+
+  while(s.len > 0) {
+    SpanPair sp = SpanCut(s, '\n');
+    s = sp.tail;
+
+    Token t = parseLine(sp.head);
+    switch(t.type) {
+      case push: case pop: {
+        int op = segmentOp(t.arg1, t.type == push);
+        if(op < 0) return "Not a known segment type.";
+
+        int32_t arg = SpanToUlong(t.arg2);
+        if(op == OpPushStatic || op == OpPopStatic) {
+          Span name = saveName(file, ".", t.arg2);
+          Entry* e = name.len ? STFind(&Statics, name, true) : NULL;
+          if(!e) return "Too many static variables.";
+          if(e->value < 0) e->value = STATICBASE + Statics.len - 1;
+          arg = e->value;
+        }
+        CheckF(emit(op, arg, 0, SPAN0));
+        break;
+      }
+#define ARITH(_t, _o) case _t: CheckF(emit(_o, 0, 0, SPAN0)); break;
+      ARITH(add, OpAdd) ARITH(sub, OpSub) ARITH(neg, OpNeg) ARITH(eq, OpEq) ARITH(gt, OpGt)
+      ARITH(lt, OpLt) ARITH(and, OpAnd) ARITH(or, OpOr) ARITH(not, OpNot) ARITH(returne, OpReturn)
+#undef ARITH
+      case label:
+        CheckF(defineLabel(saveName(funcName, "$", t.arg1)));
+        break;
+      case gotoe:
+        CheckF(emit(OpGoto, 0, 0, saveName(funcName, "$", t.arg1)));
+        break;
+      case gotoeif:
+        CheckF(emit(OpIfGoto, 0, 0, saveName(funcName, "$", t.arg1)));
+        break;
+      case function:
+        funcName = t.arg1;
+        CheckF(defineLabel(funcName));
+        CheckF(emit(OpFunction, SpanToUlong(t.arg2), 0, funcName)); // The name is for the profile
+        break;
+      case call:
+        // By contract Sys.halt never returns, so stop there instead of spinning
+        if(SpanEqual(t.arg1, S("Sys.halt"))) {
+          CheckF(emit(OpHalt, 0, 0, SPAN0));
+        } else {
+          CheckF(emit(OpCall, 0, SpanToUlong(t.arg2), t.arg1));
+        }
+        break;
+      case Empty:
+        break;
+      case Error:
+        return "An error occurred.";
+    }
+  }
+  return NULL;
+}
+
+// Fills in the instruction index of every jump and call. A goto to itself can only spin, so it halts.
+char* resolve(void) {
+  static char err[1024];
+
+  for(int32_t i = 0; i < CodeLen; i++) {
+    Op op = Code[i].op;
+    if(op != OpGoto && op != OpIfGoto && op != OpCall) continue;
+
+    Entry* e = STFind(&Labels, Targets[i], false);
+    if(!e) {
+      snprintf(err, sizeof(err), "Undefined label or function %.*s", (int)Targets[i].len, (char*)Targets[i].ptr);
+      return err;
+    }
+    Code[i].arg = e->value;
+    if(op == OpGoto && e->value == i) Code[i].op = OpHalt;
+  }
+  return NULL;
+}
+
+/* INTERPRETER */
+
+#define SP   Ram[0]
+#define LCL  Ram[1]
+#define ARG  Ram[2]
+#define THIS Ram[3]
+#define THAT Ram[4]
+#define TEMP 5
+
+#define AT(_a) Ram[(uint16_t)(_a) & (RAMSIZE - 1)]
+#define TOP AT(SP - 1)
+
+// Returns the number of instructions executed. Stops at Halt or after maxSteps.
+int64_t run(int32_t start, int64_t maxSteps) {
+  static void* handlers[] = {
+#define X(_n) &&_n,
+    OPS
+#undef X
+  };
+
+  // Direct threading: each instruction points straight at its handler
+  static bool threaded = false;
+  if(!threaded) {
+    for(int32_t i = 0; i < CodeLen; i++) Code[i].handler = handlers[Code[i].op];
+    for(int32_t i = 0; Counting && i < CodeLen; i++) {
+      if(Code[i].op == OpCall) Code[i].handler = &&CountCall;
+      if(Code[i].op == OpIfGoto) Code[i].handler = &&CountIfGoto;
+    }
+    threaded = true;
+  }
+
+  Instr* ip = &Code[start];
+  int64_t steps = maxSteps;
+  int16_t v;
+
+#define NEXT SM if(--steps < 0) goto Halt; goto *ip->handler; EM
+#define JUMP(_i) SM ip = &Code[(_i)]; NEXT; EM
+#define PUSHV(_v) SM v = (_v); AT(SP) = v; SP += 1; EM
+#define POPV SM SP -= 1; v = AT(SP); EM
+#define BINARY(_expr) SM int16_t y = TOP; SP -= 1; int16_t x = TOP; TOP = (int16_t)(_expr); ip++; NEXT; EM
+
+  NEXT;
+
+PushConstant: PUSHV(ip->arg); ip++; NEXT;
+PushLocal:    PUSHV(AT(LCL + ip->arg)); ip++; NEXT;
+PushArgument: PUSHV(AT(ARG + ip->arg)); ip++; NEXT;
+PushThis:     PUSHV(AT(THIS + ip->arg)); ip++; NEXT;
+PushThat:     PUSHV(AT(THAT + ip->arg)); ip++; NEXT;
+PushTemp:     PUSHV(Ram[TEMP + ip->arg]); ip++; NEXT;
+PushPointer:  PUSHV(Ram[3 + ip->arg]); ip++; NEXT;
+PushStatic:   PUSHV(Ram[ip->arg]); ip++; NEXT;
+
+PopLocal:     POPV; AT(LCL + ip->arg) = v; ip++; NEXT;
+PopArgument:  POPV; AT(ARG + ip->arg) = v; ip++; NEXT;
+PopThis:      POPV; AT(THIS + ip->arg) = v; ip++; NEXT;
+PopThat:      POPV; AT(THAT + ip->arg) = v; ip++; NEXT;
+PopTemp:      POPV; Ram[TEMP + ip->arg] = v; ip++; NEXT;
+PopPointer:   POPV; Ram[3 + ip->arg] = v; ip++; NEXT;
+PopStatic:    POPV; Ram[ip->arg] = v; ip++; NEXT;
+
+Add: BINARY(x + y);
+Sub: BINARY(x - y);
+Eq:  BINARY(x == y ? -1 : 0);
+// By the sign of y - x as the Hack code does, the subtraction wraps
+Gt:  BINARY((int16_t)(y - x) < 0 ? -1 : 0);
+Lt:  BINARY((int16_t)(y - x) > 0 ? -1 : 0);
+And: BINARY(x & y);
+Or:  BINARY(x | y);
+Neg: TOP = (int16_t)-TOP; ip++; NEXT;
+Not: TOP = (int16_t)~TOP; ip++; NEXT;
+
+Goto: JUMP(ip->arg);
+IfGoto:
+  POPV;
+  if(v) JUMP(ip->arg);
+  ip++; NEXT;
+
+Call: {
+  // Same frame as the Hack translation, the return address is an instruction index
+  int16_t args = SP - ip->nArgs;
+  PUSHV(ip - Code + 1);
+  PUSHV(LCL); PUSHV(ARG); PUSHV(THIS); PUSHV(THAT);
+  ARG = args;
+  LCL = SP;
+  JUMP(ip->arg);
+}
+Function:
+  for(int32_t i = 0; i < ip->arg; i++) PUSHV(0);
+  ip++; NEXT;
+Return: {
+  int16_t frame = LCL;
+  uint16_t ret = (uint16_t)AT(frame - 5);
+  POPV;
+  AT(ARG) = v;
+  SP = ARG + 1;
+  THAT = AT(frame - 1);
+  THIS = AT(frame - 2);
+  ARG  = AT(frame - 3);
+  LCL  = AT(frame - 4);
+  if(ret >= CodeLen) goto Halt; // A frame not made by a call, as in the tests of a single function
+  JUMP(ret);
+}
+Nop: ip++; NEXT;
+
+CountCall:
+  Counts[ip->arg] += 1;
+  goto Call;
+CountIfGoto:
+  Counts[ip - Code] += 1;
+  Jumps[ip - Code] += TOP != 0;
+  goto IfGoto;
+
+Halt:
+#undef NEXT
+#undef JUMP
+#undef PUSHV
+#undef POPV
+#undef BINARY
+  return maxSteps - (steps < 0 ? 0 : steps);
+}
+
+// The profile that vm -f reads, see PROFILE GUIDED there
+char* writeProfile(char* path) {
+  FILE* f = fopen(path, "w");
+  if(!f) return "Cannot open the profile for writing.";
+
+  fprintf(f, "// call <function> <times called>, branch <function>$<label> <times jumped> <times not jumped>\n");
+  for(int32_t i = 0; i < CodeLen; i++) {
+    Span name = Targets[i];
+    if(Code[i].op == OpFunction) {
+      fprintf(f, "call %.*s %lld\n", (int)name.len, (char*)name.ptr, (long long)Counts[i]);
+    } else if(Code[i].op == OpIfGoto) {
+      fprintf(f, "branch %.*s %lld %lld\n", (int)name.len, (char*)name.ptr, (long long)Jumps[i],
+              (long long)(Counts[i] - Jumps[i]));
+    }
+  }
+  return fclose(f) ? "Error writing the profile." : NULL;
+}
+
+// Plain PBM of the memory mapped screen, black pixels are ones as on the Hack screen
+char* dumpScreen(char* path) {
+  FILE* f = fopen(path, "wb");
+  if(!f) return "Cannot open the screen dump file.";
+
+  fprintf(f, "P1\n512 256\n");
+  for(int row = 0; row < 256; row++) {
+    for(int col = 0; col < 512; col++) {
+      fputc(Ram[SCREEN + row * 32 + col / 16] >> (col % 16) & 1 ? '1' : '0', f);
+    }
+    fputc('\n', f);
+  }
+  return fclose(f) ? "Error writing the screen dump file." : NULL;
+}
+
+int themain(int argc, char** argv) {
+  int64_t maxSteps = INT64_MAX;
+  char* screenFile = NULL;
+  char* profileFile = NULL;
+  int32_t printAddrs[RAMSIZE];
+  int printCount = 0;
+
+  // Flags come first
+  int first = 1;
+  for(; first < argc && argv[first][0] == '-'; first++) {
+    char* a = argv[first];
+    int addr, value;
+
+    if(a[1] == 'n' && atoll(a + 2) > 0) maxSteps = atoll(a + 2);
+    else if(a[1] == 's' && sscanf(a + 2, "%d=%d", &addr, &value) == 2 && addr >= 0 && addr < RAMSIZE) Ram[addr] = value;
+    else if(a[1] == 'p' && sscanf(a + 2, "%d", &addr) == 1 && addr >= 0 && addr < RAMSIZE) printAddrs[printCount++] = addr;
+    else if(a[1] == 'd' && a[2]) screenFile = a + 2;
+    else if(a[1] == 'f' && a[2]) profileFile = a + 2;
+    else {
+      fprintf(stderr, "Unknown option %s\n", a);
+      return -1;
+    }
+  }
+
+  if(first == argc) {
+    fprintf(stderr, "Usage: %s [-n<steps>] [-s<addr>=<value>]... [-p<addr>]... [-d<screen.pbm>] [-f<profile>] <vm_files>\n",
+            argv[0]);
+    fprintf(stderr, "  -n<steps>         stop after this many VM commands\n");
+    fprintf(stderr, "  -s<addr>=<value>  set RAM[addr] before running, e.g. the keyboard at %d\n", KBD);
+    fprintf(stderr, "  -p<addr>          print RAM[addr] when done\n");
+    fprintf(stderr, "  -d<screen.pbm>    dump the screen when done\n");
+    fprintf(stderr, "  -f<profile>       count calls and branches, for vm -f<profile>\n");
+    return -1;
+  }
+
+  Names = BufferInit(NamesMem, sizeof(NamesMem));
+
+  static Byte filein[MAXFILESIZE];
+  Size loaded = 0;
+
+  for(int i = first; i < argc; i++) {
+    Buffer bufin = BufferInit(filein + loaded, MAXFILESIZE - loaded);
+
+    SpanResult sr = loadVm(argv[i], MAXFILESIZE - loaded, &bufin);
+    if(sr.error) {
+      fprintf(stderr, "Error reading file %s.\n%s\n", argv[i], sr.error);
+      return -1;
+    }
+    loaded += sr.data.len;
+
+    // Static names must outlive the loop
+    char fileNameBuf[1024];
+    Span file = saveName(SpanFromString(basename(argv[i], fileNameBuf)), "", SPAN0);
+
+    char* err = file.len ? load(sr.data, file) : "Too many names.";
+    if(err) {
+      fprintf(stderr, "ERROR: %s: %s\n", argv[i], err);
+      return -1;
+    }
+  }
+
+  // As the translator, call Sys.init if there is one. Otherwise run from the top with the RAM as set.
+  Entry* sysInit = STFind(&Labels, S("Sys.init"), false);
+  int32_t start = 0;
+  if(sysInit) {
+    start = CodeLen;
+    SP = 256;
+    char* err = emit(OpCall, 0, 0, S("Sys.init"));
+    if(!err) err = emit(OpHalt, 0, 0, SPAN0);
+    if(err) {
+      fprintf(stderr, "ERROR: %s\n", err);
+      return -1;
+    }
+  } else {
+    char* err = emit(OpHalt, 0, 0, SPAN0);
+    if(err) {
+      fprintf(stderr, "ERROR: %s\n", err);
+      return -1;
+    }
+  }
+
+  char* err = resolve();
+  if(err) {
+    fprintf(stderr, "ERROR: %s\n", err);
+    return -1;
+  }
+
+  Counting = profileFile != NULL;
+  int64_t steps = run(start, maxSteps);
+
+  printf("Executed %lld VM commands\n", (long long)steps);
+  for(int i = 0; i < printCount; i++) {
+    printf("RAM[%d] = %d\n", printAddrs[i], Ram[printAddrs[i]]);
+  }
+
+  if(profileFile) {
+    char* profileErr = writeProfile(profileFile);
+    if(profileErr) {
+      fprintf(stderr, "%s\n", profileErr);
+      return -1;
+    }
+  }
+
+  if(screenFile) {
+    char* dumpErr = dumpScreen(screenFile);
+    if(dumpErr) {
+      fprintf(stderr, "%s\n", dumpErr);
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -19,6 +19,10 @@
 #define HASH_IMPL
 #include "ulib/Hash.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /** TOKENIZER **/
 
 #define TOKENS \
@@ -41,6 +45,7 @@ static char* tokenNames[] = { TOKENS };
 typedef struct {
   TokenType type;
   Span value;
+  int id; // Of keywords and symbols, see KEYWORDS
 } Token;
 
 typedef struct {
@@ -50,6 +55,66 @@ typedef struct {
 } TokenResult;
 
 
+// Sources are mostly comments and indentation, these skip them 16 bytes at a time where SSE2 is there. Each returns
+// how many bytes come before what it looks for, s.len if it is not there.
+#define IsSpace(_c) ((_c) == ' ' || (_c) == '\t' || (_c) == '\n' || (_c) == '\r')
+
+static inline Size spaceRun(Span s) {
+  Size i = 0;
+#ifdef __SSE2__
+  for(; i + 16 <= s.len; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i*)(s.ptr + i));
+    __m128i sp = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                              _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    unsigned other = ~_mm_movemask_epi8(sp) & 0xFFFF;
+    if(other) return i + __builtin_ctz(other);
+  }
+#endif
+  while(i < s.len && IsSpace(s.ptr[i])) i++;
+  return i;
+}
+
+static inline Size findByte(Span s, Byte b) {
+  Size i = 0;
+#ifdef __SSE2__
+  for(; i + 16 <= s.len; i += 16) {
+    unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(s.ptr + i)), _mm_set1_epi8((char)b)));
+    if(m) return i + __builtin_ctz(m);
+  }
+#endif
+  while(i < s.len && s.ptr[i] != b) i++;
+  return i;
+}
+
+// Of the '*' of the first "*/"
+static inline Size findCommentEnd(Span s) {
+  Size i = 0;
+#ifdef __SSE2__
+  for(; i + 17 <= s.len; i += 16) {
+    __m128i star  = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(s.ptr + i)), _mm_set1_epi8('*'));
+    __m128i slash = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(s.ptr + i + 1)), _mm_set1_epi8('/'));
+    unsigned m = _mm_movemask_epi8(_mm_and_si128(star, slash));
+    if(m) return i + __builtin_ctz(m);
+  }
+#endif
+  for(; i + 1 < s.len; i++) if(s.ptr[i] == '*' && s.ptr[i + 1] == '/') return i;
+  return s.len;
+}
+
+static inline Size countByte(Span s, Byte b) {
+  Size n = 0, i = 0;
+#ifdef __SSE2__
+  for(; i + 16 <= s.len; i += 16) {
+    unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(s.ptr + i)), _mm_set1_epi8((char)b)));
+    n += __builtin_popcount(m);
+  }
+#endif
+  for(; i < s.len; i++) n += s.ptr[i] == b;
+  return n;
+}
+
+#define SKIP(_n) SM Size _k = (_n); rest.ptr += _k; rest.len -= _k; EM
+
 #define ETOK ((char)-1)
 
 #define FIRSTSTATE                                \
@@ -80,21 +145,52 @@ typedef struct {
   name:                                           \
   ADVANCE
 
-#define RETTOKEN(tokenType, ptr, len) return (TokenResult) { (Token) {tokenType, SPAN(ptr, len)}, rest, NULL }
+#define RETTOKEN(tokenType, ptr, len) return (TokenResult) { (Token) {tokenType, SPAN(ptr, len), 0}, rest, NULL }
+#define RETID(tokenType, ptr, len, id) return (TokenResult) { (Token) {tokenType, SPAN(ptr, len), (id)}, rest, NULL }
 
 #define CASENUMBER case '0':case '1':case '2':case '3':case '4':case '5':case '6':case '7':case '8':case '9'
 #define CASESYMBOL case '{':case '}':case '(':case ')':case '[':case ']':case '.':case ',':case ';': \
   case '+':case '-':case '*':case '&':case '|':case '<':case '>':case '=': case '~'
 #define CASESPACES case ' ': case '\t': case '\n': case '\r'
 
+static const bool EndsName[256] = {
+  [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\r'] = 1, [(Byte)ETOK] = 1,
+  ['{'] = 1, ['}'] = 1, ['('] = 1, [')'] = 1, ['['] = 1, [']'] = 1, ['.'] = 1, [','] = 1, [';'] = 1,
+  ['+'] = 1, ['-'] = 1, ['*'] = 1, ['&'] = 1, ['|'] = 1, ['<'] = 1, ['>'] = 1, ['='] = 1, ['~'] = 1
+};
+
 #define KEYWORDS Y(class) Y(constructor) Y(function) Y(method) Y(field) Y(static) Y(var) \
   Y(int) Y(char) Y(boolean) Y(void) Y(true) Y(false) Y(null) Y(this) Y(let) \
   Y(do) Y(if) Y(else) Y(while) Y(return)
 
-#define Y(k) || SpanEqual(S(#k),s)
-#define IsKeyword (0 KEYWORDS) 
+// The parser compares ids instead of strings. A symbol is its character, keywords come after all characters.
+#define Y(k) Kw_##k,
+enum { KwBase = 127, KEYWORDS KwEnd };
+#undef Y
+#define Y(k) { (Byte*)#k, sizeof(#k) - 1 },
+static Span keywordNames[] = { KEYWORDS };
+#undef Y
+
+// A perfect hash: no two keywords have the same length and end characters in this mix
+#define KWEXP 6
+#define KwHash(_s) ((2 * (_s).len + (_s).ptr[0] + 7 * (_s).ptr[(_s).len - 1]) & ((1 << KWEXP) - 1))
+static int keywordTable[1 << KWEXP];
+
+void initKeywords(void) {
+  for(int id = KwBase + 1; id < KwEnd; id++) {
+    Span k = keywordNames[id - KwBase - 1];
+    assert(!keywordTable[KwHash(k)]);
+    keywordTable[KwHash(k)] = id;
+  }
+}
 
-TokenResult nextToken(Span data) {
+// 0 if s is not a keyword
+static inline int keywordId(Span s) {
+  int id = keywordTable[KwHash(s)];
+  return id && SpanEqual(s, keywordNames[id - KwBase - 1]) ? id : 0;
+}
+
+static inline TokenResult nextToken(Span data) {
   FIRSTSTATE {
     case ETOK:
       RETTOKEN(Eof, NULL, 0);
@@ -109,39 +205,30 @@ TokenResult nextToken(Span data) {
       goto maybeComment;
     CASESYMBOL:
       startPtr = curPtr;
-      RETTOKEN(symbol, startPtr, 1);
+      RETID(symbol, startPtr, 1, ch);
     CASESPACES:
+      SKIP(spaceRun(rest));
       goto FirstState;
     default:
       startPtr = curPtr;
       goto identifierOrKeyword;
   }
   STATE(maybeComment) {
-    case '/':
-      goto lineComment;
-    case '*':
-      goto starComment;
-    default:
-      RETTOKEN(symbol, startPtr, 1);
-  }
-  STATE(lineComment) {
-    case ETOK:
-      RETTOKEN(Eof, NULL, 0);
-    case '\n':
+    case '/': {
+      // Up to the line end, which goes too
+      Size n = findByte(rest, '\n');
+      if(n == rest.len) RETTOKEN(Eof, NULL, 0);
+      SKIP(n + 1);
       goto FirstState;
+    }
+    case '*': {
+      Size n = findCommentEnd(rest);
+      if(n == rest.len) RETTOKEN(Eof, NULL, 0);
+      SKIP(n + 2);
+      goto FirstState;
+    }
     default:
-      goto lineComment;
-  }
-  STATE(starComment) {
-    case ETOK:
-      RETTOKEN(Eof, NULL, 0);
-    case '*':
-      if(rest.len > 0 && *nextPtr == '/') {
-        rest.ptr++;rest.len--;
-        goto FirstState;
-      }
-    default:
-      goto starComment;
+      RETID(symbol, startPtr, 1, '/');
   }
   STATE(identifierOrKeyword) {
     case ETOK: CASESPACES: CASESYMBOL:
@@ -150,11 +237,15 @@ TokenResult nextToken(Span data) {
 
       // Eat back one char because otherwise we might miss a symbol
       rest.ptr--;rest.len++;
-      // TODO: IsKeyword should be parametize by s. Goofy now.
-      if(IsKeyword) RETTOKEN(keyword, s.ptr, s.len);
-      else RETTOKEN(identifier, s.ptr, s.len);
-    default:
+      int id = keywordId(s);
+      RETID(id ? keyword : identifier, s.ptr, s.len, id);
+    default: {
+      // The rest of the name at once, it ends where the cases above do
+      Size n = 0;
+      while(n < rest.len && !EndsName[rest.ptr[n]]) n++;
+      SKIP(n);
       goto identifierOrKeyword;
+    }
   }
   STATE(stringConstant) {
     case '"':
@@ -177,6 +268,67 @@ TokenResult nextToken(Span data) {
   }
 }
 
+// The whole file is lexed before parsing, into one array for each field of the tokens. The parser walks it by
+// index, and errors can say the line.
+typedef struct {
+  Byte* types;
+  int16_t* ids;
+  uint32_t* offsets; // In source
+  uint32_t* lengths;
+  int32_t* lines;
+  int32_t len;
+  int32_t cap;
+  Span source;
+} Tokens;
+
+static Tokens Toks;
+
+static char* growTokens(Tokens* ts) {
+  int32_t cap = ts->cap ? ts->cap * 2 : 1 << 12;
+  #define GROW(_a) SM void* _p = realloc(ts->_a, cap * sizeof(*ts->_a)); if(!_p) return "Out of memory."; ts->_a = _p; EM
+  GROW(types); GROW(ids); GROW(offsets); GROW(lengths); GROW(lines);
+  #undef GROW
+  ts->cap = cap;
+  return NULL;
+}
+
+// Ends with Eof, or with an Error token where lexing stopped
+char* lexAll(Span data, Tokens* ts) {
+  ts->len = 0;
+  ts->source = data;
+  int32_t line = 1;
+  Byte* counted = data.ptr;
+
+  for(Span rest = data;;) {
+    if(ts->len == ts->cap) {
+      char* err = growTokens(ts);
+      if(err) return err;
+    }
+    TokenResult tr = nextToken(rest);
+    if(tr.error) return tr.error;
+
+    Token t = tr.token;
+    Byte* at = t.type == Eof ? data.ptr + data.len : t.value.ptr;
+    line += countByte(SPAN(counted, at - counted), '\n');
+    counted = at;
+
+    int32_t i = ts->len++;
+    ts->types[i]   = t.type;
+    ts->ids[i]     = t.id;
+    ts->offsets[i] = at - data.ptr;
+    ts->lengths[i] = t.value.len;
+    ts->lines[i]   = line;
+    if(t.type == Eof || t.type == Error) return NULL;
+    rest = tr.rest;
+  }
+}
+
+// Past the end is the last token
+static inline Token tokenAt(Tokens* ts, int32_t i) {
+  if(i >= ts->len) i = ts->len - 1;
+  return (Token) { ts->types[i], SPAN(ts->source.ptr + ts->offsets[i], ts->lengths[i]), ts->ids[i] };
+}
+
 Span xmlNormalize(Span s) {
   switch(s.ptr[0]) {
     case '<': return S("&lt;");
@@ -195,24 +347,24 @@ Span xmlNormalize(Span s) {
 #define WriteXmlSpan(_tag,_value) WriteStr("<"); WriteStr(_tag); WriteStr(">"); \
   WriteSpan(_value); WriteStr("</"); WriteStr(_tag); WriteStrNL(">")
 
-char* EmitTokenizerXml(Span rest, Buffer* bufout) {
+char* EmitTokenizerXml(Span data, Buffer* bufout) {
 
     WriteStrNL("<tokens>");
 
-    while(true) {
-      TokenResult sResult = nextToken(rest);
-      if(sResult.error) return sResult.error;
+    char* error = lexAll(data, &Toks);
+    if(error) return error;
 
-      if(sResult.token.type == Error) return "Error token type shouldn't be generated";
+    for(int32_t i = 0; i < Toks.len; i++) {
+      Token t = tokenAt(&Toks, i);
 
-      if(sResult.token.type == Eof) break;
+      if(t.type == Error) return "Error token type shouldn't be generated";
 
-      char* type  = tokenNames[sResult.token.type];
-      Span value = xmlNormalize(sResult.token.value);
+      if(t.type == Eof) break;
 
-      WriteXmlSpan(type, value);
+      char* type  = tokenNames[t.type];
+      Span value = xmlNormalize(t.value);
 
-      rest = sResult.rest;
+      WriteXmlSpan(type, value);
     }
 
     WriteStrNL("</tokens>");
@@ -222,20 +374,27 @@ char* EmitTokenizerXml(Span rest, Buffer* bufout) {
 /** END TOKENIZER **/
 
 /** SYMBOL TABLE **/
-#define EXP 12
-#define LOADFACTOR 60
-#define MAXLEN (1 << EXP) * LOADFACTOR / 100
+// One table for the class and the subroutine being compiled. Symbols are pushed on a stack and chained from their
+// hash bucket newest first, so a single walk finds a local before a field of the same name. Starting a scope pops
+// what the last one declared instead of clearing the whole table. Both the stack and the buckets grow as needed.
+#define STMINEXP 8
 
 typedef struct {
   Span symbol;
   Span type;
   Span kind;
   int16_t num;
+  uint32_t hash;
+  int32_t next; // Older entry in the same bucket, -1 at the end
 } Entry;
 
 typedef struct {
-  Entry entries[1<<EXP];
+  Entry* entries;
   int32_t len;
+  int32_t cap;
+  int32_t* buckets; // Newest entry of each, -1 if none
+  int exp;
+  int32_t subroutineStart; // -1 until the first subroutine, class variables all come before
 
   // Indexes for kinds of variables
   int16_t staticCount;
@@ -245,44 +404,78 @@ typedef struct {
   int16_t argCount;
 } SymbolTable;
 
+static void STChain(SymbolTable* st, int32_t i) {
+  Entry* e = &st->entries[i];
+  int32_t* bucket = &st->buckets[e->hash & ((1 << st->exp) - 1)];
+  e->next = *bucket;
+  *bucket = i;
+}
+
+// Twice the buckets, chained again from the oldest entry so that newer ones still come first
+static char* STGrowBuckets(SymbolTable* st) {
+  int exp = st->buckets ? st->exp + 1 : STMINEXP;
+  int32_t* buckets = realloc(st->buckets, sizeof(int32_t) << exp);
+  if(!buckets) return "Out of memory.";
+  st->buckets = buckets;
+  st->exp = exp;
+  memset(buckets, 0xFF, sizeof(int32_t) << exp);
+  for(int32_t i = 0; i < st->len; i++) STChain(st, i);
+  return NULL;
+}
+
 char* STAdd(SymbolTable* st, Span symbol, Span type, Span kind, Size num) {
   assert(st);
   assert(SpanValid(symbol));
 
-  if(MAXLEN < st->len) return "Symbol table too small to contain all symbols in the program."; // OOM
-
-  uint64_t h = HashString(symbol.ptr, symbol.len);
-  for(int32_t i = h;;) {
-    i = HashLookup(h, EXP, i);
-    Entry* e = &st->entries[i];
-    // Insert it either if it already exist (overwrite) or if the cell is empty (0)
-    if(SpanEqual(symbol, e->symbol) || e->symbol.ptr == 0) {
-      st->len += e->symbol.ptr == 0;
-      // Last wins, likely wrong. More likely should err on duplicated symbol.
-      *e = (Entry) { symbol, type, kind, num };
-      return NULL;
-    }
+  if(st->len == st->cap) {
+    int32_t cap = st->cap ? st->cap * 2 : 1 << STMINEXP;
+    Entry* entries = realloc(st->entries, cap * sizeof(Entry));
+    if(!entries) return "Out of memory.";
+    st->entries = entries;
+    st->cap = cap;
+  }
+  if(!st->buckets || st->len >= 1 << st->exp) {
+    char* err = STGrowBuckets(st);
+    if(err) return err;
   }
+
+  // A symbol declared again hides the old one, last wins. Likely wrong, more likely should err.
+  st->entries[st->len] = (Entry) { symbol, type, kind, num, (uint32_t)HashString(symbol.ptr, symbol.len), -1 };
+  STChain(st, st->len++);
+  return NULL;
 }
-Entry* STGet(SymbolTable* st, Span symbol) {
+
+Entry* STLookup(SymbolTable* st, Span symbol) {
   assert(st);
   assert(SpanValid(symbol));
 
-  uint64_t h = HashString(symbol.ptr, symbol.len);
-  for(int32_t i = h;;) {
-    i = HashLookup(h, EXP, i);
+  if(!st->len) return NULL;
+  uint32_t h = (uint32_t)HashString(symbol.ptr, symbol.len);
+  for(int32_t i = st->buckets[h & ((1 << st->exp) - 1)]; i >= 0; i = st->entries[i].next) {
     Entry* e = &st->entries[i];
+    if(e->hash == h && SpanEqual(symbol, e->symbol)) return e;
+  }
+  return NULL;
+}
 
-    if(e->symbol.ptr == 0) return NULL;
-
-    if(SpanEqual(symbol, e->symbol)) {
-      return e;
-    }
+// Drops the entries from mark on, their buckets get back the older ones
+static void STPop(SymbolTable* st, int32_t mark) {
+  while(st->len > mark) {
+    Entry* e = &st->entries[--st->len];
+    st->buckets[e->hash & ((1 << st->exp) - 1)] = e->next;
   }
 }
 
-void STInit(SymbolTable* st) {
-  *st = (SymbolTable) {0};
+void STEnterClass(SymbolTable* st) {
+  STPop(st, 0);
+  st->subroutineStart = -1;
+  st->staticCount = st->fieldCount = st->varCount = st->argCount = 0;
+}
+
+void STEnterSubroutine(SymbolTable* st) {
+  if(st->subroutineStart < 0) st->subroutineStart = st->len;
+  STPop(st, st->subroutineStart);
+  st->varCount = st->argCount = 0;
 }
 
 int16_t STCount(SymbolTable* st, Span kind, bool increase) {
@@ -297,19 +490,12 @@ int16_t STCount(SymbolTable* st, Span kind, bool increase) {
 #define SaveKind Save(kind)
 #define SaveArg Span kind = S("arg")
 #define SaveVar Span kind = S("var")
-#define StAdd(_st) SM; char* err = STAdd(&_st, symb, type, kind, STCount(&_st, kind, true)); if(err) return err; EM
+#define StAdd SM; char* err = STAdd(&St, symb, type, kind, STCount(&St, kind, true)); if(err) return err; EM
 
-static SymbolTable StClass;
-static SymbolTable StSubroutine;
-
-Entry* STLookup(Span symbol) {
-  Entry* ret   = STGet(&StClass, symbol);
-  if(!ret) ret = STGet(&StSubroutine, symbol); 
-  return ret;
-}
+static SymbolTable St;
 
 #define CheckStLookup(_n, _v) \
-  Entry* _n = STLookup(_v); \
+  Entry* _n = STLookup(&St, _v); \
   if(!_n) return cerror("Left side of assignment not in the symbol table", S(#_n), _v);
 
 /** END SYMBOL TABLE **/
@@ -324,28 +510,100 @@ Span kindToSeg(Span k) {
   KTS(var,local);
   return k;
 }
-#define Push(kind, idx) SM WriteStr("push "); WriteSpan(kindToSeg(kind)); WriteStr(" "); \
-  WriteSpan(SpanFromUlong(idx)); WriteStrNL(""); EM
-#define Pop(kind, idx) SM WriteStr("pop "); WriteSpan(kindToSeg(kind)); WriteStr(" "); \
-  WriteSpan(SpanFromUlong(idx)); WriteStrNL(""); EM
+// With -b the output is binary VM as described in 08/vm.c: opcodes and segments are numbered in its order, names and
+// labels go in a string table that is written before the commands.
+#define VMBOPS X(push) X(pop) X(add) X(sub) X(eq) X(gt) X(lt) X(neg) X(not) X(and) X(or) X(label) X(function) \
+  X(call) X(goto) X(ifgoto) X(return)
+#define X(_n) Op_##_n,
+typedef enum { VMBOPS } VmOp;
+#undef X
+
+static char* vmSegments[] = { "argument", "local", "static", "constant", "this", "that", "pointer", "temp" };
+
+static bool Binary = false;
+
+#define SEXP 12
+#define LOADFACTOR 60
+#define SMAXLEN (1 << SEXP) * LOADFACTOR / 100
+
+// Strings of the binary output, interned. The bytes are copied as labels and names are built on the stack.
+typedef struct {
+  Span entries[1<<SEXP];
+  int32_t ids[1<<SEXP];
+  Span inOrder[SMAXLEN + 1];
+  int32_t len;
+  Byte bytes[1<<16];
+  Size used;
+} StringTable;
+
+static StringTable Strings;
+
+int32_t internString(Span s) {
+  uint64_t h = HashString(s.ptr, s.len);
+  for(int32_t i = h;;) {
+    i = HashLookup(h, SEXP, i);
+    Span* e = &Strings.entries[i];
+    if(e->ptr && SpanEqual(s, *e)) return Strings.ids[i];
+    if(e->ptr) continue;
+
+    if(SMAXLEN < Strings.len || Strings.used + s.len > (Size)sizeof(Strings.bytes)) return -1; // OOM
+    memcpy(Strings.bytes + Strings.used, s.ptr, s.len);
+    *e = SPAN(Strings.bytes + Strings.used, s.len);
+    Strings.used += s.len;
+    Strings.ids[i] = Strings.len;
+    Strings.inOrder[Strings.len] = *e;
+    return Strings.len++;
+  }
+}
+
+char* writeVarint(Size n, Buffer* bufout) {
+  do {
+    if(BufferPushByte(bufout, (Byte)((n & 0x7F) | (n > 0x7F ? 0x80 : 0))).error) return "Writing buffer too small";
+    n >>= 7;
+  } while(n > 0);
+  return NULL;
+}
+
+Byte segmentId(Span seg) {
+  for(Byte i = 0; i < sizeof(vmSegments) / sizeof(*vmSegments); i++) if(SpanEqual(seg, SpanFromString(vmSegments[i]))) return i;
+  return 0xFF;
+}
+
+#define BinByte(_b) if(BufferPushByte(bufout, (Byte)(_b)).error) return "Writing buffer too small"
+#define BinVarint(_n) SM char* _err = writeVarint((_n), bufout); if(_err) return _err; EM
+#define BinString(_s) SM int32_t _id = internString(_s); if(_id < 0) return "Too many names."; BinVarint(_id); EM
+#define BinName(_c, _m) SM Byte _nb[512]; Buffer _b = BufferInit(_nb, sizeof(_nb)); \
+  if(BufferCopy(_c, &_b).error || BufferCopy(S("."), &_b).error || BufferCopy(_m, &_b).error) return "Name too long"; \
+  BinString(BufferToSpan(&_b)); EM
+#define BinLabel(_op, n) SM char _lb[16]; snprintf(_lb, sizeof(_lb), "L%d", (n)); \
+  BinByte(_op); BinString(SpanFromString(_lb)); EM
+
+#define Push(kind, idx) SM if(Binary) { BinByte(Op_push); BinByte(segmentId(kindToSeg(kind))); BinVarint(idx); break; } \
+  WriteStr("push "); WriteSpan(kindToSeg(kind)); WriteStr(" "); WriteSpan(SpanFromUlong(idx)); WriteStrNL(""); EM
+#define Pop(kind, idx) SM if(Binary) { BinByte(Op_pop); BinByte(segmentId(kindToSeg(kind))); BinVarint(idx); break; } \
+  WriteStr("pop "); WriteSpan(kindToSeg(kind)); WriteStr(" "); WriteSpan(SpanFromUlong(idx)); WriteStrNL(""); EM
 
 #define PushEntry(e) Push(e->kind, e->num)
 #define PopEntry(e)  Pop(e->kind, e->num)
 
-#define Arith(s)      SM WriteStrNL(#s); EM
-#define Label(n)      SM WriteStr("label "); WriteStr("L"); WriteSpan(SpanFromUlong(n)); WriteStrNL(""); EM
-#define Goto(n)       SM WriteStr("goto "); WriteStr("L"); WriteSpan(SpanFromUlong(n)); WriteStrNL("");EM
-#define IfGoto(n)     SM WriteStr("if-goto "); WriteStr("L"); WriteSpan(SpanFromUlong(n)); WriteStrNL("");EM
+#define Arith(s)      SM if(Binary) { BinByte(Op_##s); break; } WriteStrNL(#s); EM
+#define Label(n)      SM if(Binary) { BinLabel(Op_label, n); break; } \
+  WriteStr("label "); WriteStr("L"); WriteSpan(SpanFromUlong(n)); WriteStrNL(""); EM
+#define Goto(n)       SM if(Binary) { BinLabel(Op_goto, n); break; } \
+  WriteStr("goto "); WriteStr("L"); WriteSpan(SpanFromUlong(n)); WriteStrNL("");EM
+#define IfGoto(n)     SM if(Binary) { BinLabel(Op_ifgoto, n); break; } \
+  WriteStr("if-goto "); WriteStr("L"); WriteSpan(SpanFromUlong(n)); WriteStrNL("");EM
 
-#define Call(s,n)     SM WriteStr("call "); WriteStr(s); WriteStr(" "); WriteSpan(SpanFromUlong(n)); WriteStrNL(""); EM
-#define CallC(c, m,n) SM WriteStr("call "); WriteSpan(c); WriteStr("."); WriteSpan(m); \
-  WriteStr(" "); WriteSpan(SpanFromUlong(n)); WriteStrNL(""); EM
+#define Call(s,n)     SM if(Binary) { BinByte(Op_call); BinString(S(s)); BinVarint(n); break; } \
+  WriteStr("call "); WriteStr(s); WriteStr(" "); WriteSpan(SpanFromUlong(n)); WriteStrNL(""); EM
+#define CallC(c, m,n) SM if(Binary) { BinByte(Op_call); BinName(c, m); BinVarint(n); break; } \
+  WriteStr("call "); WriteSpan(c); WriteStr("."); WriteSpan(m); WriteStr(" "); WriteSpan(SpanFromUlong(n)); WriteStrNL(""); EM
 
-#define FunctionName(s) SM WriteStr("function "); WriteSpan(baseName); \
-  WriteStr("."); WriteSpan(s); WriteStr(" "); EM
-#define FunctionParams(n) SM WriteSpan(SpanFromUlong(n)); WriteStrNL(""); EM
+#define FunctionName(s) SM if(Binary) { BinByte(Op_function); BinName(baseName, s); break; } \
+  WriteStr("function "); WriteSpan(baseName); WriteStr("."); WriteSpan(s); WriteStr(" "); EM
+#define FunctionParams(n) SM if(Binary) { BinVarint(n); break; } WriteSpan(SpanFromUlong(n)); WriteStrNL(""); EM
 
-#define Return        SM WriteStrNL("return"); EM
+#define Return        SM if(Binary) { BinByte(Op_return); break; } WriteStrNL("return"); EM
 
 /** END EMITTER **/
 
@@ -353,29 +611,28 @@ Span kindToSeg(Span k) {
 
 // Make threadlocal if multithreaded
 static Token tok;
-static Span rest;
+static int32_t pos; // Of tok in Toks
 static Span baseName;
 
 
 #define NextToken SM \
-  TokenResult tr = nextToken(rest); \
-  if(tr.error) return tr.error; \
-  tok = tr.token; rest = tr.rest; EM
+  if(pos < Toks.len - 1) pos++; \
+  tok = tokenAt(&Toks, pos); EM
 
-#define ConsumeTokenIf(__tt, __value) SM \
-  if(IsToken(__tt, __value)) NextToken; else tokenerr; EM
+#define ConsumeTokenIf(__cond) SM \
+  if(__cond) NextToken; else tokenerr; EM
 #define ConsumeToken SM NextToken; EM
 
 #define ConsumeType SM if(IsType) ConsumeToken; else tokenerr; EM
-#define ConsumeIdentifier SM ConsumeTokenIf(identifier, ""); EM
-#define ConsumeKeyword(_kw) SM ConsumeTokenIf(keyword, _kw); EM
-#define ConsumeSymbol(_sy) SM ConsumeTokenIf(symbol, _sy); EM
+#define ConsumeIdentifier SM ConsumeTokenIf(IsToken(identifier)); EM
+#define ConsumeKeyword(_kw) SM ConsumeTokenIf(IsKeyword(_kw)); EM
+#define ConsumeSymbol(_sy) SM ConsumeTokenIf(IsSymbol(_sy)); EM
 
-#undef IsKeyword
-#define IsToken(_tt, _v) isToken(tok, (_tt), (_v))
-#define IsSymbol(_v) isToken(tok, symbol, (_v))
-#define IsKeyword(_v) isToken(tok, keyword, (_v))
-#define IsType  IsToken(keyword, "int") || IsToken(keyword, "char") || IsToken(keyword, "boolean") || IsToken(identifier,"")
+// Ids are unique across token types, see KEYWORDS
+#define IsToken(_tt) (tok.type == (_tt))
+#define IsSymbol(_c) (tok.id == (_c))
+#define IsKeyword(_k) (tok.id == Kw_##_k)
+#define IsType  (IsKeyword(int) || IsKeyword(char) || IsKeyword(boolean) || IsToken(identifier))
 
 #define DECLARE(_rule) char* compile ## _rule(Buffer* bufout) 
 
@@ -390,10 +647,10 @@ static Span baseName;
 // is stored in the tree.
 static int __sArgs = -1;
 static int labelCount = 0;
-static Span LastFuncType = {0};
+static int LastFuncKind = 0; // Keyword id of constructor, function or method
 static Span LastFuncName = {0};
 static Span LastClassName = {0};
-static Span LastFuncReturn = {0};
+static bool LastFuncVoid = false;
 
 #define InvokeExpressionList \
   Invoke(expressionList); \
@@ -404,7 +661,9 @@ char* cerror(char* startMessage, Span s1, Span s2) {
   static Byte buf[1024];
   Buffer bufo = BufferInit(buf, sizeof(buf));
   Buffer* bufout = &bufo;
-  WriteSpan(baseName); WriteStr(" : ");
+  WriteSpan(baseName);
+  if(pos >= 0 && pos < Toks.len) { WriteStr(":"); WriteSpan(SpanFromUlong(Toks.lines[pos])); }
+  WriteStr(" : ");
   WriteStr(startMessage); WriteStr(" : "); WriteSpan(s1); WriteStr(" ");WriteSpan(s2); WriteStrNL("");
   bufo.data.ptr[bufo.index] = 0;
   return (char*)buf;
@@ -416,60 +675,48 @@ char* cerrorS(char* startMessage, char* s1, char* s2) {
   return cerror(startMessage, SpanFromString(s1), SpanFromString(s2));
 }
 
-bool isToken(Token tok, TokenType tt, char* value) {
-
-  if(tok.type != tt)
-    return false;
-
-  Span svalue = SpanFromString(value);
-  if(svalue.len != 0 && !SpanEqual(svalue, tok.value))
-    return false;
-
-  return true;
-}
-
 STARTRULE(classVarDec)
   SaveKind; ConsumeToken;
   SaveType; ConsumeType;
   SaveSymb; ConsumeIdentifier;
 
-  StAdd(StClass);
+  StAdd;
 
-  while(!IsSymbol(";")) {
-      ConsumeSymbol(",");
+  while(!IsSymbol(';')) {
+      ConsumeSymbol(',');
 
       SaveSymb; ConsumeIdentifier;
-      StAdd(StClass);
+      StAdd;
   }
   ConsumeToken;
 ENDRULE
 
 STARTRULE(parameterList)
-  while(!IsSymbol(")")) {
+  while(!IsSymbol(')')) {
 
     SaveArg;
     SaveType; ConsumeType;
     SaveSymb; ConsumeIdentifier;
   
-    StAdd(StSubroutine);
+    StAdd;
 
-    if(IsSymbol(",")) {
+    if(IsSymbol(',')) {
       ConsumeToken;
     }
   }
 ENDRULE
 
 STARTRULE(varDec)
-  SaveVar; ConsumeKeyword("var");
+  SaveVar; ConsumeKeyword(var);
   SaveType; ConsumeType;
   SaveSymb; ConsumeIdentifier;
 
-  StAdd(StSubroutine);
+  StAdd;
 
-  while(!IsSymbol(";")) {
-    ConsumeSymbol(",");
+  while(!IsSymbol(';')) {
+    ConsumeSymbol(',');
     SaveSymb; ConsumeIdentifier;
-    StAdd(StSubroutine);
+    StAdd;
   }
   ConsumeToken;
 ENDRULE
@@ -477,20 +724,18 @@ ENDRULE
 DECLARE(expression);
 DECLARE(expressionList);
 
-Span ConstToStr(Span c) {
-  #define CTS(_c, _s) if(SpanEqual(S(_c),c)) return S(_s)
-  CTS("null", "push constant 0");
-  CTS("false", "push constant 0");
-  CTS("true", "push constant 1\nneg");
-  CTS("this", "push pointer 0");
-  return S("ERROR");
+char* keywordConstant(int id, Buffer* bufout) {
+  if(id == Kw_true) { Push(S("constant"), 1); Arith(neg); }
+  else if(id == Kw_this) Push(S("pointer"), 0);
+  else Push(S("constant"), 0); // null and false
+  return NULL;
 }
 
 STARTRULE(term)
-  if(IsToken(integerConstant,"")) {
+  if(IsToken(integerConstant)) {
     Push(S("constant"),SpanToUlong(tok.value));
     ConsumeToken;
-  } else if(IsToken(stringConstant,"")) {
+  } else if(IsToken(stringConstant)) {
     Push(S("constant"), tok.value.len);
     Call("String.new", 1);
     for(Size i = 0; i < tok.value.len; i++) {
@@ -498,15 +743,16 @@ STARTRULE(term)
       Call("String.appendChar", 2);
     }
     ConsumeToken;
-  } else if(IsKeyword("true") || IsKeyword("false") || IsKeyword("null") || IsKeyword("this")) {
-    WriteSpan(ConstToStr(tok.value)); WriteStrNL("");
+  } else if(IsKeyword(true) || IsKeyword(false) || IsKeyword(null) || IsKeyword(this)) {
+    char* error = keywordConstant(tok.id, bufout);
+    if(error) return error;
     ConsumeToken;
-  } else if(IsToken(identifier,"")) { // can be a varName, array, subroutine call or method call (with '.')
+  } else if(IsToken(identifier)) { // can be a varName, array, subroutine call or method call (with '.')
     Span startId = tok.value;
-    Entry* stFound = STLookup(startId);
+    Entry* stFound = STLookup(&St, startId);
     ConsumeIdentifier;
 
-    if(IsSymbol("[")) { // Array
+    if(IsSymbol('[')) { // Array
       ConsumeToken;
 
       // Push on the stack arr[i] which is *(arr + i)
@@ -517,8 +763,8 @@ STARTRULE(term)
       Pop(S("pointer"),1);
       Push(S("that"),0);
 
-      ConsumeSymbol("]");
-    } else if(IsSymbol("(")) { // Method call on this
+      ConsumeSymbol(']');
+    } else if(IsSymbol('(')) { // Method call on this
       ConsumeToken;
 
       Push(S("pointer"),0);
@@ -527,19 +773,19 @@ STARTRULE(term)
       // PushEntry(thisp);
 
       InvokeExpressionList;
-      ConsumeSymbol(")");
+      ConsumeSymbol(')');
       CallC(LastClassName,startId,nArgs + 1);
-    } else if(IsSymbol(".")) { // func or method
+    } else if(IsSymbol('.')) { // func or method
       ConsumeToken;
       Span funcOrMethod = tok.value;
       ConsumeIdentifier;
-      ConsumeSymbol("(");
+      ConsumeSymbol('(');
 
       if(stFound)  // method call, push the object as the first parameter
         PushEntry(stFound);
 
       InvokeExpressionList;
-      ConsumeSymbol(")");
+      ConsumeSymbol(')');
 
       if(stFound) { // method call, there is one parameter more (the object to call it on)
         CallC(stFound->type, funcOrMethod, nArgs + 1);
@@ -550,59 +796,71 @@ STARTRULE(term)
       if(!stFound) cerror("Variable not found", startId, SPAN0);
       PushEntry(stFound);
     }
-  } else if(IsSymbol("(")) {
+  } else if(IsSymbol('(')) {
     ConsumeToken;
     Invoke(expression);
-    ConsumeSymbol(")");
-  } else if(IsSymbol("-") || IsSymbol("~")){
-    Span op = tok.value;
+    ConsumeSymbol(')');
+  } else if(IsSymbol('-') || IsSymbol('~')){
+    int op = tok.id;
     ConsumeToken;
     Invoke(term);
-    if(SpanEqual(op, S("-")))
+    if(op == '-')
       Arith(neg);
     else
       Arith(not);
   } else tokenerr;
 ENDRULE
 
-Span OpToStr(Span c) {
-  #define OTS(_c, _s) if(SpanEqual(S(_c),c)) return S(_s)
-  OTS("+", "add");
-  OTS("-", "sub");
-  OTS("*", "call Math.multiply 2");
-  OTS("/", "call Math.divide 2");
-  OTS("&", "and");
-  OTS("|", "or");
-  OTS("<", "lt");
-  OTS(">", "gt");
-  OTS("=", "eq");
-  return S("ERROR");
+#define BINARYOPS \
+  OTS('+', Arith(add)) \
+  OTS('-', Arith(sub)) \
+  OTS('*', Call("Math.multiply", 2)) \
+  OTS('/', Call("Math.divide", 2)) \
+  OTS('&', Arith(and)) \
+  OTS('|', Arith(or)) \
+  OTS('<', Arith(lt)) \
+  OTS('>', Arith(gt)) \
+  OTS('=', Arith(eq))
+
+static inline bool isBinaryOp(int id) {
+  #define OTS(_c, _e) case _c:
+  switch(id) { BINARYOPS return true; default: return false; }
+  #undef OTS
+}
+
+char* binaryOp(int c, Buffer* bufout) {
+  #define OTS(_c, _e) case _c: _e; return NULL;
+  switch(c) { BINARYOPS }
+  #undef OTS
+  return "Unknown operator";
 }
 STARTRULE(expression)
   Invoke(term);
-  while(IsSymbol("+") || IsSymbol("-") || IsSymbol("*") || IsSymbol("/") || IsSymbol("&") ||
-                 IsSymbol("|") || IsSymbol("<") || IsSymbol(">") || IsSymbol("=")) {
-      Span op = OpToStr(tok.value);
+  while(isBinaryOp(tok.id)) {
+      int op = tok.id;
       ConsumeToken;
 
       Invoke(term);
 
-      WriteSpan(op); WriteStrNL("");
+      char* error = binaryOp(op, bufout);
+      if(error) return error;
     }
 ENDRULE
 
 STARTRULE(expressionList)
-  __sArgs = 0;
-  while(!IsSymbol(")")) {
-    __sArgs++;
+  // Counted here, an argument can have calls of its own that set __sArgs
+  int args = 0;
+  while(!IsSymbol(')')) {
+    args++;
     Invoke(expression);
-    if(IsSymbol(","))
+    if(IsSymbol(','))
       ConsumeToken;
   }
+  __sArgs = args;
 ENDRULE
 
 STARTRULE(letStatement)
-  ConsumeKeyword("let");
+  ConsumeKeyword(let);
 
   CheckStLookup(left,tok.value);
 
@@ -610,7 +868,7 @@ STARTRULE(letStatement)
 
   bool arraryAssignment = false;
 
-  if(IsSymbol("[")) {
+  if(IsSymbol('[')) {
     ConsumeToken;
 
     arraryAssignment = true;
@@ -618,10 +876,10 @@ STARTRULE(letStatement)
     Invoke(expression);
     Arith(add); // expr2 top of stack
   
-    ConsumeSymbol("]");
+    ConsumeSymbol(']');
   }
 
-  ConsumeSymbol("=");
+  ConsumeSymbol('=');
   Invoke(expression);
 
   if(arraryAssignment) {
@@ -632,16 +890,16 @@ STARTRULE(letStatement)
   } else {
     PopEntry(left);
   }
-  ConsumeSymbol(";");
+  ConsumeSymbol(';');
 ENDRULE
 
 DECLARE(statements);
 
 STARTRULE(ifStatement)
-  ConsumeKeyword("if");
-  ConsumeSymbol("(");
+  ConsumeKeyword(if);
+  ConsumeSymbol('(');
   Invoke(expression);
-  ConsumeSymbol(")");
+  ConsumeSymbol(')');
 
   Arith(not);
 
@@ -650,58 +908,58 @@ STARTRULE(ifStatement)
 
   IfGoto(l1);
 
-  ConsumeSymbol("{");
+  ConsumeSymbol('{');
   Invoke(statements);
-  ConsumeSymbol("}");
+  ConsumeSymbol('}');
   Goto(l2);
 
   Label(l1);
-  if(IsKeyword("else")) {
+  if(IsKeyword(else)) {
      ConsumeToken;
-     ConsumeSymbol("{");
+     ConsumeSymbol('{');
      Invoke(statements);
-     ConsumeSymbol("}");
+     ConsumeSymbol('}');
   }
   Label(l2);
 ENDRULE
 
 STARTRULE(whileStatement)
-  ConsumeKeyword("while");
+  ConsumeKeyword(while);
 
   int l1 = labelCount++;
   int l2 = labelCount++;
 
   Label(l1);
-  ConsumeSymbol("(");
+  ConsumeSymbol('(');
   Invoke(expression);
-  ConsumeSymbol(")");
+  ConsumeSymbol(')');
 
   Arith(not);
   IfGoto(l2);
 
-  ConsumeSymbol("{");
+  ConsumeSymbol('{');
   Invoke(statements);
-  ConsumeSymbol("}");
+  ConsumeSymbol('}');
   Goto(l1);
 
   Label(l2);
 ENDRULE
 
 STARTRULE(doStatement)
-  ConsumeKeyword("do");
+  ConsumeKeyword(do);
   Invoke(expression);
   Pop(S("temp"), 0);
-  ConsumeSymbol(";");
+  ConsumeSymbol(';');
 ENDRULE
 
 STARTRULE(returnStatement)
-  ConsumeKeyword("return");
-  if(!IsSymbol(";"))
+  ConsumeKeyword(return);
+  if(!IsSymbol(';'))
     Invoke(expression);
-  ConsumeSymbol(";");
+  ConsumeSymbol(';');
 
   // void returning function must return something
-  if(SpanEqual(LastFuncReturn, S("void"))) {
+  if(LastFuncVoid) {
     Push(S("constant"),0);
   }
   Return;
@@ -709,31 +967,31 @@ ENDRULE
 
 STARTRULE(statements)
   while(true) {
-    if(IsKeyword("let")) Invoke(letStatement);
-    else if(IsKeyword("if")) Invoke(ifStatement);
-    else if(IsKeyword("while")) Invoke(whileStatement);
-    else if(IsKeyword("do")) Invoke(doStatement);
-    else if(IsKeyword("return")) Invoke(returnStatement);
+    if(IsKeyword(let)) Invoke(letStatement);
+    else if(IsKeyword(if)) Invoke(ifStatement);
+    else if(IsKeyword(while)) Invoke(whileStatement);
+    else if(IsKeyword(do)) Invoke(doStatement);
+    else if(IsKeyword(return)) Invoke(returnStatement);
     else break;
   } 
 ENDRULE
 
 STARTRULE(subroutineBody)
-  ConsumeSymbol("{");
+  ConsumeSymbol('{');
 
-  while(IsKeyword("var")) {
+  while(IsKeyword(var)) {
     Invoke(varDec);
   }
 
   FunctionName(LastFuncName);
-  int16_t vars = STCount(&StSubroutine, S("var"), false);
+  int16_t vars = STCount(&St, S("var"), false);
   FunctionParams(vars);
 
-  if(SpanEqual(LastFuncType, S("method"))) {
+  if(LastFuncKind == Kw_method) {
     Push(S("argument"),0);
     Pop(S("pointer"),0);
-  } else if(SpanEqual(LastFuncType, S("constructor"))) {
-    int16_t fields = STCount(&StClass, S("field"), false);
+  } else if(LastFuncKind == Kw_constructor) {
+    int16_t fields = STCount(&St, S("field"), false);
     Push(S("constant"), fields);
     Call("Memory.alloc",1);
     Pop(S("pointer"),0);
@@ -742,26 +1000,26 @@ STARTRULE(subroutineBody)
   Invoke(statements);
 
   // void returning functions might not contain a 'return statement'
-  if(SpanEqual(LastFuncReturn, S("void"))) {
+  if(LastFuncVoid) {
     Push(S("constant"),0);
     Return;
   }
-  ConsumeSymbol("}");
+  ConsumeSymbol('}');
 ENDRULE
 
 
 STARTRULE(subroutineDec)
 
-  // Reset subroutine symbol table when declaring new subroutine.
-  STInit(&StSubroutine);
+  // Drop the symbols of the previous subroutine
+  STEnterSubroutine(&St);
   
-  LastFuncType = tok.value;
+  LastFuncKind = tok.id;
 
   ConsumeToken;
   
-  LastFuncReturn = tok.value;
+  LastFuncVoid = IsKeyword(void);
 
-  if(IsType || IsToken(keyword, "void")) {
+  if(IsType || IsKeyword(void)) {
     ConsumeToken;
   } else
       tokenerr;
@@ -769,40 +1027,40 @@ STARTRULE(subroutineDec)
   LastFuncName = tok.value;
   ConsumeIdentifier;
 
-  if(SpanEqual(LastFuncType, S("method"))) {
-    STAdd(&StSubroutine, S("this"), LastClassName, S("arg"), STCount(&StSubroutine,S("arg"), true));
+  if(LastFuncKind == Kw_method) {
+    char* err = STAdd(&St, S("this"), LastClassName, S("arg"), STCount(&St, S("arg"), true));
+    if(err) return err;
   }
 
-  ConsumeSymbol("(");
+  ConsumeSymbol('(');
   Invoke(parameterList);
-  ConsumeSymbol(")");
+  ConsumeSymbol(')');
   Invoke(subroutineBody);
 ENDRULE
 
 
 STARTRULE(class)
 
-  // Reset symble tables when starting a new class
-  STInit(&StClass);
-  STInit(&StSubroutine);
+  // Drop the symbols of the previous class
+  STEnterClass(&St);
 
   NextToken; // Just one class x file, trivial to extend to multiple ones
 
-  ConsumeKeyword("class");
+  ConsumeKeyword(class);
 
   LastClassName = tok.value;
 
   ConsumeIdentifier;
-  ConsumeSymbol("{");
+  ConsumeSymbol('{');
 
   // This is a translator (one pass). All declarations must come first to fill the symbol table
   // before compiling subroutines.
-  while(IsKeyword("static") || IsKeyword("field"))
+  while(IsKeyword(static) || IsKeyword(field))
     Invoke(classVarDec);
 
-  while(!IsSymbol("}")) {
+  while(!IsSymbol('}')) {
 
-    if(IsKeyword("constructor") || IsKeyword("function") || IsKeyword("method"))
+    if(IsKeyword(constructor) || IsKeyword(function) || IsKeyword(method))
       Invoke(subroutineDec);
     else
       tokenerr;
@@ -813,15 +1071,1226 @@ ENDRULE
 
 /** END PARSER **/
 
+/** AST **/
+
+// By default a class is parsed into a tree first, so that it can be improved before any VM is written. The rules
+// above write VM as they parse and are kept to compare against, with -d. Nodes live in an arena that is emptied
+// for each class.
+#define ARENABLOCK (1 << 20)
+
+static bool Direct = false;   // -d
+static bool Optimize = true;  // -n turns the passes off, the tree is written as the rules above would
+
+#define CheckF(_call) SM char* _err = (_call); if(_err) return _err; EM
+
+typedef struct ArenaBlock {
+  struct ArenaBlock* next;
+  Size used;
+  Byte data[ARENABLOCK];
+} ArenaBlock;
+
+static ArenaBlock* Arena;
+
+void* arenaAlloc(Size size) {
+  size = (size + 7) & ~(Size)7;
+  if(!Arena || Arena->used + size > ARENABLOCK) {
+    ArenaBlock* b = malloc(sizeof(ArenaBlock));
+    if(!b) return NULL;
+    b->next = Arena;
+    b->used = 0;
+    Arena = b;
+  }
+  void* p = Arena->data + Arena->used;
+  Arena->used += size;
+  return p;
+}
+
+// Keeps one block for the next class
+void arenaReset(void) {
+  while(Arena && Arena->next) {
+    ArenaBlock* next = Arena->next;
+    free(Arena);
+    Arena = next;
+  }
+  if(Arena) Arena->used = 0;
+}
+
+typedef enum {
+  // Expressions
+  NConst, NString, NThis, NVar, NIndex, NCall, NUnary, NBinary,
+  NSaveTemp, // a, also kept in the local n for the same reads after it
+  NThat,     // The array element being assigned, already in THAT
+  NPeek,     // The word at the address a
+  // Statements
+  NLet, NLetIndex, NIf, NWhile, NDo, NReturn,
+  NPool,     // Builds the string a into the static n, the first time it runs
+  NPoke      // Writes b at the address a
+} NodeKind;
+
+typedef struct Node {
+  NodeKind kind;
+  int op;             // Symbol id of the operator. For NLetIndex, 1 if the element is in THAT while a is computed.
+  int32_t n;          // Value of NConst, argument count of NCall, local of NSaveTemp
+  Span text;          // NString, class or object type of NCall
+  Span name;          // Subroutine of NCall
+  int32_t line;       // Of NCall, for -x
+  Entry var;          // Copied, the subroutine scope is gone by the time the class is written
+  struct Node* a;     // Operand, index, value, condition, object of a method call
+  struct Node* b;     // Second operand, index of NLetIndex
+  struct Node* list;  // Arguments of NCall, statements of NIf and NWhile
+  struct Node* orElse;
+  struct Node* next;
+} Node;
+
+typedef struct Subroutine {
+  Span name;
+  int kind;           // Keyword id
+  bool isVoid;
+  int32_t vars;       // Locals, with those added by the passes
+  int16_t fields;     // For constructors
+  Node* body;
+  struct Subroutine* next;
+} Subroutine;
+
+#define NewNode(_n, _kind) Node* _n = arenaAlloc(sizeof(Node)); if(!_n) return "Out of memory."; \
+  *_n = (Node) { .kind = (_kind) }
+
+#define STARTNODE(_rule) char* node ## _rule(Node** out) { char* __funcName = #_rule; (void) __funcName;
+#define ENDNODE SM return NULL; EM; }
+#define InvokeNode(_rule, _out) SM char* error = node ## _rule(_out); if(error) return error; EM
+
+char* nodeexpression(Node** out);
+
+// Into call->list
+char* nodeArguments(Node* call) {
+  Node** tail = &call->list;
+  while(!IsSymbol(')')) {
+    call->n++;
+    InvokeNode(expression, tail);
+    tail = &(*tail)->next;
+    if(IsSymbol(','))
+      ConsumeToken;
+  }
+  return NULL;
+}
+
+STARTNODE(term)
+  if(IsToken(integerConstant)) {
+    NewNode(n, NConst);
+    n->n = SpanToUlong(tok.value);
+    *out = n;
+    ConsumeToken;
+  } else if(IsToken(stringConstant)) {
+    NewNode(n, NString);
+    n->text = tok.value;
+    *out = n;
+    ConsumeToken;
+  } else if(IsKeyword(true) || IsKeyword(false) || IsKeyword(null)) {
+    NewNode(n, NConst);
+    n->n = IsKeyword(true) ? -1 : 0;
+    *out = n;
+    ConsumeToken;
+  } else if(IsKeyword(this)) {
+    NewNode(n, NThis);
+    *out = n;
+    ConsumeToken;
+  } else if(IsToken(identifier)) {
+    Span startId = tok.value;
+    Entry* stFound = STLookup(&St, startId);
+    ConsumeIdentifier;
+
+    if(IsSymbol('[')) {
+      ConsumeToken;
+      if(!stFound) return "Array identifier not declared";
+      NewNode(n, NIndex);
+      n->var = *stFound;
+      *out = n;
+      InvokeNode(expression, &n->a);
+      ConsumeSymbol(']');
+    } else if(IsSymbol('(')) { // Method call on this
+      ConsumeToken;
+      NewNode(n, NCall);
+      NewNode(self, NThis);
+      *n = (Node) { .kind = NCall, .text = LastClassName, .name = startId, .a = self, .line = Toks.lines[pos] };
+      *out = n;
+      char* error = nodeArguments(n);
+      if(error) return error;
+      ConsumeSymbol(')');
+    } else if(IsSymbol('.')) { // Function, or method of the object in a variable
+      ConsumeToken;
+      NewNode(n, NCall);
+      n->name = tok.value;
+      n->line = Toks.lines[pos];
+      n->text = startId;
+      *out = n;
+      ConsumeIdentifier;
+      ConsumeSymbol('(');
+      if(stFound) {
+        NewNode(object, NVar);
+        object->var = *stFound;
+        n->a = object;
+        n->text = stFound->type;
+      }
+      char* error = nodeArguments(n);
+      if(error) return error;
+      ConsumeSymbol(')');
+    } else {
+      if(!stFound) return cerror("Variable not found", startId, SPAN0);
+      NewNode(n, NVar);
+      n->var = *stFound;
+      *out = n;
+    }
+  } else if(IsSymbol('(')) {
+    ConsumeToken;
+    InvokeNode(expression, out);
+    ConsumeSymbol(')');
+  } else if(IsSymbol('-') || IsSymbol('~')) {
+    NewNode(n, NUnary);
+    n->op = tok.id;
+    *out = n;
+    ConsumeToken;
+    InvokeNode(term, &n->a);
+  } else tokenerr;
+ENDNODE
+
+STARTNODE(expression)
+  InvokeNode(term, out);
+  while(isBinaryOp(tok.id)) {
+    NewNode(n, NBinary);
+    n->op = tok.id;
+    n->a = *out;
+    *out = n;
+    ConsumeToken;
+    InvokeNode(term, &n->b);
+  }
+ENDNODE
+
+char* nodestatements(Node** out);
+
+STARTNODE(letStatement)
+  ConsumeKeyword(let);
+  CheckStLookup(left, tok.value);
+  NewNode(n, NLet);
+  n->var = *left;
+  *out = n;
+  ConsumeIdentifier;
+
+  if(IsSymbol('[')) {
+    ConsumeToken;
+    n->kind = NLetIndex;
+    InvokeNode(expression, &n->b);
+    ConsumeSymbol(']');
+  }
+  ConsumeSymbol('=');
+  InvokeNode(expression, &n->a);
+  ConsumeSymbol(';');
+ENDNODE
+
+STARTNODE(ifStatement)
+  NewNode(n, NIf);
+  *out = n;
+  ConsumeKeyword(if);
+  ConsumeSymbol('(');
+  InvokeNode(expression, &n->a);
+  ConsumeSymbol(')');
+  ConsumeSymbol('{');
+  InvokeNode(statements, &n->list);
+  ConsumeSymbol('}');
+  if(IsKeyword(else)) {
+    ConsumeToken;
+    ConsumeSymbol('{');
+    InvokeNode(statements, &n->orElse);
+    ConsumeSymbol('}');
+  }
+ENDNODE
+
+STARTNODE(whileStatement)
+  NewNode(n, NWhile);
+  *out = n;
+  ConsumeKeyword(while);
+  ConsumeSymbol('(');
+  InvokeNode(expression, &n->a);
+  ConsumeSymbol(')');
+  ConsumeSymbol('{');
+  InvokeNode(statements, &n->list);
+  ConsumeSymbol('}');
+ENDNODE
+
+STARTNODE(doStatement)
+  NewNode(n, NDo);
+  *out = n;
+  ConsumeKeyword(do);
+  InvokeNode(expression, &n->a);
+  ConsumeSymbol(';');
+ENDNODE
+
+STARTNODE(returnStatement)
+  NewNode(n, NReturn);
+  *out = n;
+  ConsumeKeyword(return);
+  if(!IsSymbol(';'))
+    InvokeNode(expression, &n->a);
+  ConsumeSymbol(';');
+ENDNODE
+
+STARTNODE(statements)
+  *out = NULL;
+  while(true) {
+    if(IsKeyword(let)) InvokeNode(letStatement, out);
+    else if(IsKeyword(if)) InvokeNode(ifStatement, out);
+    else if(IsKeyword(while)) InvokeNode(whileStatement, out);
+    else if(IsKeyword(do)) InvokeNode(doStatement, out);
+    else if(IsKeyword(return)) InvokeNode(returnStatement, out);
+    else break;
+    out = &(*out)->next;
+  }
+ENDNODE
+
+char* nodeSubroutine(Subroutine** out) {
+  char* __funcName = "subroutineDec";
+  Subroutine* sub = arenaAlloc(sizeof(Subroutine));
+  if(!sub) return "Out of memory.";
+  *sub = (Subroutine) { .kind = tok.id };
+  *out = sub;
+
+  STEnterSubroutine(&St);
+  ConsumeToken;
+  sub->isVoid = IsKeyword(void);
+  if(IsType || IsKeyword(void)) {
+    ConsumeToken;
+  } else
+      tokenerr;
+
+  sub->name = tok.value;
+  ConsumeIdentifier;
+  if(sub->kind == Kw_method) {
+    char* err = STAdd(&St, S("this"), LastClassName, S("arg"), STCount(&St, S("arg"), true));
+    if(err) return err;
+  }
+
+  ConsumeSymbol('(');
+  char* error = compileparameterList(NULL);
+  if(error) return error;
+  ConsumeSymbol(')');
+
+  ConsumeSymbol('{');
+  while(IsKeyword(var)) {
+    error = compilevarDec(NULL);
+    if(error) return error;
+  }
+  sub->vars = STCount(&St, S("var"), false);
+  sub->fields = STCount(&St, S("field"), false);
+  InvokeNode(statements, &sub->body);
+  ConsumeSymbol('}');
+  return NULL;
+}
+
+char* nodeClass(Subroutine** out) {
+  char* __funcName = "class";
+  STEnterClass(&St);
+  *out = NULL;
+
+  NextToken;
+  ConsumeKeyword(class);
+  LastClassName = tok.value;
+  ConsumeIdentifier;
+  ConsumeSymbol('{');
+
+  while(IsKeyword(static) || IsKeyword(field)) {
+    char* error = compileclassVarDec(NULL);
+    if(error) return error;
+  }
+
+  while(!IsSymbol('}')) {
+    if(!IsKeyword(constructor) && !IsKeyword(function) && !IsKeyword(method)) tokenerr;
+    char* error = nodeSubroutine(out);
+    if(error) return error;
+    out = &(*out)->next;
+  }
+  ConsumeToken;
+  return NULL;
+}
+
+/** END AST **/
+
+/** PASSES **/
+
+// Jack is 16 bits, constants as written can go past that and are left alone
+static inline bool isConst(Node* e) { return e && e->kind == NConst && e->n >= -32768 && e->n <= 32767; }
+static inline int32_t wrap16(int32_t v) { return ((v + 32768) & 0xFFFF) - 32768; }
+
+static inline bool sameVar(Entry* a, Entry* b) { return a->num == b->num && SpanEqual(a->kind, b->kind); }
+
+// Replaces e by its operand, in place as e may be in a list
+static void replaceBy(Node* e, Node* by) {
+  Node* next = e->next;
+  *e = *by;
+  e->next = next;
+}
+
+static void setConst(Node* e, int32_t v) {
+  Node* next = e->next;
+  *e = (Node) { .kind = NConst, .n = wrap16(v), .next = next };
+}
+
+// Computes what it can as the VM would. Comparisons are left alone when the subtraction they are made with would
+// overflow, 08/vm.c computes y - x, and divisions by 0.
+void foldExpression(Node* e) {
+  if(!e) return;
+  foldExpression(e->a);
+  foldExpression(e->b);
+  if(e->kind == NCall) for(Node* arg = e->list; arg; arg = arg->next) foldExpression(arg);
+
+  Node* a = e->a, * b = e->b;
+  if(e->kind == NUnary && isConst(a)) {
+    setConst(e, e->op == '-' ? -a->n : ~a->n);
+  } else if(e->kind == NBinary && isConst(a) && isConst(b)) {
+    int32_t x = a->n, y = b->n;
+    bool overflows = wrap16(y - x) != y - x;
+    switch(e->op) {
+      case '+': setConst(e, x + y); break;
+      case '-': setConst(e, x - y); break;
+      case '*': setConst(e, x * y); break;
+      case '/': if(y) setConst(e, x / y); break;
+      case '&': setConst(e, x & y); break;
+      case '|': setConst(e, x | y); break;
+      case '=': setConst(e, x == y ? -1 : 0); break;
+      case '<': if(!overflows) setConst(e, x < y ? -1 : 0); break;
+      case '>': if(!overflows) setConst(e, x > y ? -1 : 0); break;
+    }
+  } else if(e->kind == NBinary) {
+    // Operations that give back one of their operands
+    int32_t left = isConst(a) ? a->n : 2, right = isConst(b) ? b->n : 2;
+    switch(e->op) {
+      case '+': if(!left) replaceBy(e, b); else if(!right) replaceBy(e, a); break;
+      case '-': if(!right) replaceBy(e, a); break;
+      case '*': if(left == 1) replaceBy(e, b); else if(right == 1) replaceBy(e, a); break;
+      case '/': if(right == 1) replaceBy(e, a); break;
+      case '|': if(!left) replaceBy(e, b); else if(!right) replaceBy(e, a); break;
+      case '&': if(left == -1) replaceBy(e, b); else if(right == -1) replaceBy(e, a); break;
+    }
+  }
+}
+
+void foldStatements(Node* s) {
+  for(; s; s = s->next) {
+    foldExpression(s->a);
+    foldExpression(s->b);
+    foldStatements(s->list);
+    foldStatements(s->orElse);
+  }
+}
+
+// Drops the branches a constant condition never takes and what comes after a return. Returns true if the
+// statements never get to their end. Conditions are tested with not and if-goto, only -1 is true.
+bool dropDeadCode(Node** list) {
+  for(Node** at = list; *at;) {
+    Node* s = *at;
+    if(s->kind == NIf && isConst(s->a)) {
+      Node* taken = s->a->n == -1 ? s->list : s->orElse;
+      Node** end = &taken;
+      while(*end) end = &(*end)->next;
+      *end = s->next;
+      *at = taken;
+      continue;
+    }
+    if(s->kind == NWhile && isConst(s->a) && s->a->n != -1) {
+      *at = s->next;
+      continue;
+    }
+
+    bool ends = s->kind == NReturn;
+    if(s->kind == NIf) {
+      bool thenEnds = dropDeadCode(&s->list);
+      bool elseEnds = dropDeadCode(&s->orElse);
+      ends = thenEnds && elseEnds;
+    } else if(s->kind == NWhile) {
+      dropDeadCode(&s->list);
+      ends = isConst(s->a); // Always true, there is no break
+    }
+    if(ends) {
+      s->next = NULL;
+      return true;
+    }
+    at = &s->next;
+  }
+  return false;
+}
+
+bool sameExpression(Node* a, Node* b) {
+  if(a->kind != b->kind) return false;
+  switch(a->kind) {
+    case NConst:  return a->n == b->n;
+    case NThis:   return true;
+    case NVar:    return sameVar(&a->var, &b->var);
+    case NIndex:  return sameVar(&a->var, &b->var) && sameExpression(a->a, b->a);
+    case NUnary:  return a->op == b->op && sameExpression(a->a, b->a);
+    case NBinary: return a->op == b->op && sameExpression(a->a, b->a) && sameExpression(a->b, b->b);
+    default:      return false;
+  }
+}
+
+// Calls can change any variable but the locals and arguments, so can strings as they are built with calls
+bool hasCalls(Node* e) {
+  if(!e) return false;
+  if(e->kind == NCall || e->kind == NString) return true;
+  return hasCalls(e->a) || hasCalls(e->b);
+}
+
+// What the statements of a loop change
+#define MAXASSIGNED 64
+typedef struct {
+  Entry* assigned[MAXASSIGNED];
+  int count;
+  bool tooMany;
+  bool calls;
+  bool memory;  // Array elements, fields or statics
+} Effects;
+
+void loopEffects(Node* s, Effects* fx) {
+  for(; s; s = s->next) {
+    fx->calls = fx->calls || hasCalls(s->a) || hasCalls(s->b);
+    if(s->kind == NLetIndex) fx->memory = true;
+    if(s->kind == NLet) {
+      if(fx->count < MAXASSIGNED) fx->assigned[fx->count++] = &s->var;
+      else fx->tooMany = true;
+      fx->memory = fx->memory || (!SpanEqual(s->var.kind, S("var")) && !SpanEqual(s->var.kind, S("arg")));
+    }
+    loopEffects(s->list, fx);
+    loopEffects(s->orElse, fx);
+  }
+}
+
+// Same value at each iteration. Dividing can fail, so it is only done where it was written.
+bool invariant(Node* e, Effects* fx) {
+  switch(e->kind) {
+    case NConst: case NThis:
+      return true;
+    case NVar:
+      if(fx->tooMany) return false;
+      for(int i = 0; i < fx->count; i++) if(sameVar(fx->assigned[i], &e->var)) return false;
+      return SpanEqual(e->var.kind, S("var")) || SpanEqual(e->var.kind, S("arg")) || (!fx->calls && !fx->memory);
+    case NUnary:
+      return invariant(e->a, fx);
+    case NBinary:
+      return e->op != '/' && invariant(e->a, fx) && invariant(e->b, fx);
+    default:
+      return false;
+  }
+}
+
+static Entry tempEntry(int32_t n) { return (Entry) { .symbol = S(""), .kind = S("var"), .num = n }; }
+
+typedef struct {
+  Subroutine* sub;
+  Effects fx;
+  Node* hoisted;      // Lets to put before the loop
+  Node** hoistedTail;
+} Hoisting;
+
+// Takes the largest invariant operations out, into a local set before the loop
+char* hoistExpression(Node* e, Hoisting* h) {
+  if(!e) return NULL;
+  if((e->kind == NUnary || e->kind == NBinary) && invariant(e, &h->fx)) {
+    Node* let = h->hoisted;
+    while(let && !sameExpression(let->a, e)) let = let->next;
+    if(!let) {
+      Node* value = arenaAlloc(sizeof(Node));
+      let = arenaAlloc(sizeof(Node));
+      if(!value || !let) return "Out of memory.";
+      *value = *e;
+      value->next = NULL;
+      *let = (Node) { .kind = NLet, .var = tempEntry(h->sub->vars++), .a = value };
+      *h->hoistedTail = let;
+      h->hoistedTail = &let->next;
+    }
+    Node* next = e->next;
+    *e = (Node) { .kind = NVar, .var = let->var, .next = next };
+    return NULL;
+  }
+  CheckF(hoistExpression(e->a, h));
+  CheckF(hoistExpression(e->b, h));
+  for(Node* arg = e->kind == NCall ? e->list : NULL; arg; arg = arg->next) CheckF(hoistExpression(arg, h));
+  return NULL;
+}
+
+char* hoistStatements(Node* s, Hoisting* h) {
+  for(; s; s = s->next) {
+    CheckF(hoistExpression(s->a, h));
+    CheckF(hoistExpression(s->b, h));
+    CheckF(hoistStatements(s->list, h));
+    CheckF(hoistStatements(s->orElse, h));
+  }
+  return NULL;
+}
+
+// Inner loops first, what they hoisted can then go out of the outer ones too
+char* hoistLoops(Node** list, Subroutine* sub) {
+  for(Node** at = list; *at; at = &(*at)->next) {
+    Node* s = *at;
+    CheckF(hoistLoops(&s->list, sub));
+    CheckF(hoistLoops(&s->orElse, sub));
+    if(s->kind != NWhile) continue;
+
+    Hoisting h = { .sub = sub };
+    h.hoistedTail = &h.hoisted;
+    h.fx.calls = hasCalls(s->a);
+    loopEffects(s->list, &h.fx);
+    CheckF(hoistExpression(s->a, &h));
+    CheckF(hoistStatements(s->list, &h));
+    if(!h.hoisted) continue;
+    *h.hoistedTail = s;
+    *at = h.hoisted;
+    at = h.hoistedTail;
+  }
+  return NULL;
+}
+
+// Array elements read more than once in a statement are read once and kept in a local. Nothing can write to memory
+// in between as long as there are no calls. An index with no array elements of its own is left to compare.
+bool plainIndex(Node* e) {
+  if(!e) return true;
+  if(e->kind == NIndex || e->kind == NCall || e->kind == NString) return false;
+  return plainIndex(e->a) && plainIndex(e->b);
+}
+
+#define MAXREADS 64
+typedef struct {
+  Node* reads[MAXREADS]; // In the order they are made
+  int count;
+} Reads;
+
+void collectReads(Node* e, Reads* r) {
+  if(!e) return;
+  collectReads(e->a, r);
+  collectReads(e->b, r);
+  if(e->kind == NIndex && plainIndex(e->a) && r->count < MAXREADS) r->reads[r->count++] = e;
+}
+
+// Returns how many locals it used
+int32_t shareReads(Reads* r, int32_t firstTemp) {
+  int32_t temps = 0;
+  for(int i = 0; i < r->count; i++) {
+    Node* first = r->reads[i];
+    if(first->kind != NIndex) continue; // Done with an earlier one
+    int32_t temp = firstTemp + temps;
+    bool shared = false;
+    for(int j = i + 1; j < r->count; j++) {
+      Node* e = r->reads[j];
+      if(e->kind != NIndex || !sameExpression(first, e)) continue;
+      Node* next = e->next;
+      *e = (Node) { .kind = NVar, .var = tempEntry(temp), .next = next };
+      shared = true;
+    }
+    if(!shared) continue;
+    Node* read = arenaAlloc(sizeof(Node));
+    if(!read) return -1;
+    *read = *first;
+    read->next = NULL;
+    *first = (Node) { .kind = NSaveTemp, .n = temp, .a = read, .next = first->next };
+    temps++;
+  }
+  return temps;
+}
+
+// The element being assigned stays in THAT when the value reads it and nothing else moves THAT: no other elements
+// and no calls, Math.multiply and Math.divide included.
+bool usesThat(Node* e, Node* let) {
+  if(!e) return false;
+  if(e->kind == NIndex) return !sameVar(&e->var, &let->var) || !sameExpression(e->a, let->b) || usesThat(e->a, let);
+  if(e->kind == NCall || e->kind == NString || (e->kind == NBinary && (e->op == '*' || e->op == '/'))) return true;
+  return usesThat(e->a, let) || usesThat(e->b, let);
+}
+
+bool readsElement(Node* e, Node* let) {
+  if(!e) return false;
+  if(e->kind == NIndex && sameVar(&e->var, &let->var) && sameExpression(e->a, let->b)) return true;
+  return readsElement(e->a, let) || readsElement(e->b, let);
+}
+
+void readFromThat(Node* e, Node* let) {
+  if(!e) return;
+  if(e->kind == NIndex && sameVar(&e->var, &let->var) && sameExpression(e->a, let->b)) {
+    Node* next = e->next;
+    *e = (Node) { .kind = NThat, .next = next };
+    return;
+  }
+  readFromThat(e->a, let);
+  readFromThat(e->b, let);
+}
+
+// Locals for a statement are free again after it, returns the most any statement needed
+int32_t shareStatements(Node* s, int32_t firstTemp) {
+  int32_t most = 0;
+  for(; s; s = s->next) {
+    int32_t inner = shareStatements(s->list, firstTemp);
+    int32_t inElse = shareStatements(s->orElse, firstTemp);
+    if(inner > most) most = inner;
+    if(inElse > most) most = inElse;
+
+    if(s->kind == NLetIndex && plainIndex(s->b) && readsElement(s->a, s) && !usesThat(s->a, s)) {
+      s->op = 1;
+      readFromThat(s->a, s);
+      continue;
+    }
+    if(hasCalls(s->a) || hasCalls(s->b)) continue;
+    Reads r = { .count = 0 };
+    collectReads(s->b, &r); // The index of an element assigned is computed first
+    collectReads(s->a, &r);
+    int32_t temps = shareReads(&r, firstTemp);
+    if(temps < 0) return -1;
+    if(temps > most) most = temps;
+  }
+  return most;
+}
+
+// Multiplying and dividing by a constant without calling Math. There are no shifts in VM: a product is made of
+// doublings and adds, a quotient by 2^k of the bits of the dividend moved down one at a time. Both keep what they
+// need twice in a local of their own, free again once the result is on the stack.
+#define MAXMULSTEPS 12
+
+#define MAXPENDING 8
+
+typedef struct {
+  Subroutine* sub;
+  int32_t operand;  // Locals, -1 until needed
+  int32_t partial;
+  int32_t pending[MAXPENDING]; // First operands of Math.min and max, by depth, while the second is computed
+  bool outOfMemory;
+} Reducing;
+
+static int32_t reduceTemp(Reducing* r, int32_t* temp) {
+  if(*temp < 0) *temp = r->sub->vars++;
+  return *temp;
+}
+
+static Node* newNode(Reducing* r, Node n) {
+  Node* p = arenaAlloc(sizeof(Node));
+  if(p) *p = n;
+  else r->outOfMemory = true;
+  return p;
+}
+
+#define MkBinary(_op, _a, _b) newNode(r, (Node) { .kind = NBinary, .op = (_op), .a = (_a), .b = (_b) })
+#define MkConst(_v)           newNode(r, (Node) { .kind = NConst, .n = wrap16(_v) })
+#define MkTemp(_t)            newNode(r, (Node) { .kind = NVar, .var = tempEntry(_t) })
+#define MkSave(_e, _t)        newNode(r, (Node) { .kind = NSaveTemp, .n = (_t), .a = (_e) })
+// -1 when the sign bit of e is set, e < 0 compares as 0 - e does and that wraps for -32768
+#define MkNegative(_e)        MkBinary('=', MkBinary('&', (_e), MkConst(-32768)), MkConst(-32768))
+
+// Read again for free
+static inline bool simpleOperand(Node* e) { return e->kind == NVar || e->kind == NThis || e->kind == NConst; }
+
+// To read e again after it, it is simple or kept in a local
+static Node* again(Node* e, Reducing* r) {
+  if(!e) return NULL;
+  if(e->kind == NSaveTemp) return MkTemp(e->n);
+  return newNode(r, (Node) { .kind = e->kind, .n = e->n, .var = e->var });
+}
+
+static int bitLength(uint32_t c) { int n = 0; while(c) { n++; c >>= 1; } return n; }
+static int bitCount(uint32_t c) { int n = 0; while(c) { n += c & 1; c >>= 1; } return n; }
+
+// x * c for 1 < c < 32768, or NULL if it would take too long a sequence
+static Node* multiplyBy(Node* x, int32_t c, Reducing* r) {
+  int top = bitLength(c) - 1;
+  if(top + bitCount(c) - 1 > MAXMULSTEPS) return NULL;
+  Node* first = simpleOperand(x) ? x : MkSave(x, reduceTemp(r, &r->operand));
+  Node* acc = first;
+  for(int bit = top - 1; bit >= 0; bit--) {
+    Node* twice = acc == first ? acc : MkSave(acc, reduceTemp(r, &r->partial));
+    acc = MkBinary('+', twice, again(twice, r));
+    if(c >> bit & 1) acc = MkBinary('+', acc, again(first, r));
+  }
+  return acc;
+}
+
+// x / 2^k for 0 < k < 15, truncated towards zero as Math.divide does. Negative dividends get 2^k - 1 added first,
+// then bit i goes to i - k and the sign fills the top k bits.
+static Node* divideBy(Node* x, int k, Reducing* r) {
+  int32_t t = reduceTemp(r, &r->operand);
+  Node* bias = MkBinary('&', MkNegative(MkTemp(t)), MkConst((1 << k) - 1));
+  Node* biased = MkSave(MkBinary('+', MkSave(x, t), bias), t);
+  Node* acc = MkBinary('&', MkNegative(biased), MkConst(-(1 << (15 - k))));
+  for(int bit = k; bit < 15; bit++) {
+    Node* set = MkBinary('>', MkBinary('&', MkTemp(t), MkConst(1 << bit)), MkConst(0));
+    acc = MkBinary('|', acc, MkBinary('&', set, MkConst(1 << (bit - k))));
+  }
+  return acc;
+}
+
+// Functions of the OS done inline, they are short enough that the call costs more than they do. Math.min and max
+// pick with a mask, b + ((a - b) & -1) is a: there are no branches inside an expression. They compare as 12/Math.jack
+// does, overflow included.
+static bool Intrinsics = true;  // -i turns them off
+static bool ListIntrinsics = false; // -x
+
+#define INTRINSICS Y(Memory, peek, 1) Y(Memory, poke, 2) Y(Math, abs, 1) Y(Math, min, 2) Y(Math, max, 2) \
+  Y(Keyboard, keyPressed, 0)
+
+#define Y(_c, _f, _n) I_##_c##_##_f,
+typedef enum { INTRINSICS I_None } Intrinsic;
+#undef Y
+
+static Intrinsic intrinsicOf(Node* call) {
+  if(call->kind != NCall || call->a) return I_None;
+  #define Y(_c, _f, _n) \
+    if(call->n == (_n) && SpanEqual(call->text, S(#_c)) && SpanEqual(call->name, S(#_f))) return I_##_c##_##_f;
+  INTRINSICS
+  #undef Y
+  return I_None;
+}
+
+static void listIntrinsic(Node* call) {
+  if(ListIntrinsics) printf("%.*s:%d: %.*s.%.*s\n", (int)baseName.len, baseName.ptr, call->line,
+                             (int)call->text.len, call->text.ptr, (int)call->name.len, call->name.ptr);
+}
+
+// Can be read again after what follows it is computed
+static bool stable(Node* e, Node* following) {
+  if(e->kind == NConst || e->kind == NThis) return true;
+  if(e->kind != NVar) return false;
+  return SpanEqual(e->var.kind, S("var")) || SpanEqual(e->var.kind, S("arg")) || !hasCalls(following);
+}
+
+char* expandExpression(Node* e, Reducing* r, int depth) {
+  if(!e) return NULL;
+  Intrinsic in = intrinsicOf(e);
+  bool pending = (in == I_Math_min || in == I_Math_max) && depth < MAXPENDING;
+  CheckF(expandExpression(e->a, r, depth));
+  CheckF(expandExpression(e->b, r, depth));
+  for(Node* arg = e->kind == NCall ? e->list : NULL; arg; arg = arg->next)
+    CheckF(expandExpression(arg, r, arg != e->list && pending ? depth + 1 : depth));
+  if(in == I_None || in == I_Memory_poke || ((in == I_Math_min || in == I_Math_max) && !pending)) return NULL;
+
+  Node* x = e->list, * y = x ? x->next : NULL, * expanded = NULL;
+  if(x) x->next = NULL;
+  switch(in) {
+    case I_Memory_peek:
+      expanded = newNode(r, (Node) { .kind = NPeek, .a = x });
+      break;
+    case I_Keyboard_keyPressed:
+      expanded = newNode(r, (Node) { .kind = NPeek, .a = MkConst(24576) });
+      break;
+    case I_Math_abs: {
+      // x - 2x is -x
+      Node* first = stable(x, NULL) ? x : MkSave(x, reduceTemp(r, &r->operand));
+      Node* twice = MkBinary('+', again(first, r), again(first, r));
+      expanded = MkBinary('-', first, MkBinary('&', twice, MkBinary('<', again(first, r), MkConst(0))));
+      break;
+    }
+    default: { // min and max
+      if(r->pending[depth] < 0) r->pending[depth] = r->sub->vars++;
+      Node* a = stable(x, y) ? x : MkSave(x, r->pending[depth]);
+      Node* b = stable(y, NULL) ? y : MkSave(y, reduceTemp(r, &r->operand));
+      Node* picksA = in == I_Math_max ? MkBinary('>', again(a, r), again(b, r))
+                                      : MkBinary('<', again(a, r), MkBinary('+', again(b, r), MkConst(1)));
+      expanded = MkBinary('+', MkBinary('&', MkBinary('-', a, b), picksA), again(b, r));
+    }
+  }
+  if(r->outOfMemory) return "Out of memory.";
+  listIntrinsic(e);
+  replaceBy(e, expanded);
+  return NULL;
+}
+
+char* expandStatements(Node* s, Reducing* r) {
+  for(; s; s = s->next) {
+    CheckF(expandExpression(s->a, r, 0));
+    CheckF(expandExpression(s->b, r, 0));
+    CheckF(expandStatements(s->list, r));
+    CheckF(expandStatements(s->orElse, r));
+    if(s->kind == NDo && intrinsicOf(s->a) == I_Memory_poke) {
+      Node* call = s->a;
+      listIntrinsic(call);
+      s->kind = NPoke;
+      s->a = call->list;
+      s->b = call->list->next;
+      s->a->next = NULL;
+    }
+  }
+  return NULL;
+}
+
+#undef MkBinary
+#undef MkConst
+#undef MkTemp
+#undef MkSave
+
+static int powerOfTwo(int32_t c) {
+  for(int k = 1; k < 15; k++) if(c == 1 << k) return k;
+  return 0;
+}
+
+char* reduceExpression(Node* e, Reducing* r) {
+  if(!e) return NULL;
+  CheckF(reduceExpression(e->a, r));
+  CheckF(reduceExpression(e->b, r));
+  for(Node* arg = e->kind == NCall ? e->list : NULL; arg; arg = arg->next) CheckF(reduceExpression(arg, r));
+  if(e->kind != NBinary || (e->op != '*' && e->op != '/')) return NULL;
+
+  Node* x = e->a, * constant = e->b;
+  if(e->op == '*' && isConst(x) && !isConst(constant)) { x = e->b; constant = e->a; }
+  if(!isConst(constant)) return NULL;
+  int32_t c = constant->n;
+  if(c == 0 && e->op == '*' && !hasCalls(x)) {
+    setConst(e, 0);
+    return NULL;
+  }
+  bool negate = c < 0;
+  if(negate) c = -c;
+  if(c <= 1 || c > 32767) return NULL;
+
+  Node* reduced = NULL;
+  if(e->op == '*') reduced = multiplyBy(x, c, r);
+  else if(powerOfTwo(c)) reduced = divideBy(x, powerOfTwo(c), r);
+  if(negate && reduced) reduced = newNode(r, (Node) { .kind = NUnary, .op = '-', .a = reduced });
+  if(r->outOfMemory) return "Out of memory.";
+  if(reduced) replaceBy(e, reduced);
+  return NULL;
+}
+
+char* reduceStatements(Node* s, Reducing* r) {
+  for(; s; s = s->next) {
+    CheckF(reduceExpression(s->a, r));
+    CheckF(reduceExpression(s->b, r));
+    CheckF(reduceStatements(s->list, r));
+    CheckF(reduceStatements(s->orElse, r));
+  }
+  return NULL;
+}
+
+// Literals the callee only reads are built once into a static of the class, a use is then one push. Only those
+// passed to functions of the OS that print them: anything else could change the string or dispose of it. Statics
+// share RAM 16-255 with the static frames of 08/vm.c, so a class gets a few.
+#define MAXPOOLED 16
+
+typedef struct {
+  Span texts[MAXPOOLED];
+  int count;
+  int16_t base;     // First static after those of the class
+  int sites;
+  Size calls;       // Saved by one run of every site
+  Size words;
+} Pool;
+
+static Pool ClassPool;
+static bool PoolReport = false; // -s
+
+static int poolId(Pool* p, Span text) {
+  for(int i = 0; i < p->count; i++) if(SpanEqual(p->texts[i], text)) return i;
+  if(p->count == MAXPOOLED) return -1;
+  p->texts[p->count] = text;
+  return p->count++;
+}
+
+static bool onlyReads(Node* call) {
+  if(call->a) return false; // A method, of a variable
+  if(SpanEqual(call->text, S("Output"))) return SpanEqual(call->name, S("printString"));
+  if(SpanEqual(call->text, S("Keyboard"))) return SpanEqual(call->name, S("readLine")) || SpanEqual(call->name, S("readInt"));
+  return false;
+}
+
+void poolExpression(Node* e, Pool* p, uint32_t* used) {
+  if(!e) return;
+  poolExpression(e->a, p, used);
+  poolExpression(e->b, p, used);
+  for(Node* arg = e->kind == NCall ? e->list : NULL; arg; arg = arg->next) poolExpression(arg, p, used);
+  if(e->kind != NCall || !e->list || e->list->kind != NString || !onlyReads(e)) return;
+
+  Node* literal = e->list;
+  int id = poolId(p, literal->text);
+  if(id < 0) return;
+  Size len = literal->text.len;
+  *literal = (Node) { .kind = NVar, .var = { .symbol = S(""), .kind = S("static"), .num = p->base + id },
+                      .next = literal->next };
+  *used |= 1u << id;
+  p->sites++;
+  p->calls += 1 + len;                  // String.new and appendChar
+  p->words += 3 + (len ? len : 1);      // The object and its chars
+}
+
+void poolStatements(Node* s, Pool* p, uint32_t* used) {
+  for(; s; s = s->next) {
+    poolExpression(s->a, p, used);
+    poolExpression(s->b, p, used);
+    poolStatements(s->list, p, used);
+    poolStatements(s->orElse, p, used);
+  }
+}
+
+// The strings are built before the statement of the body they are used in, out of any loop
+char* poolStrings(Subroutine* sub, Pool* p) {
+  for(Node** at = &sub->body; *at; at = &(*at)->next) {
+    Node* s = *at;
+    uint32_t used = 0;
+    poolExpression(s->a, p, &used);
+    poolExpression(s->b, p, &used);
+    poolStatements(s->list, p, &used);
+    poolStatements(s->orElse, p, &used);
+    for(int id = 0; id < p->count; id++) {
+      if(!(used >> id & 1)) continue;
+      Node* literal = arenaAlloc(sizeof(Node));
+      Node* build = arenaAlloc(sizeof(Node));
+      if(!literal || !build) return "Out of memory.";
+      *literal = (Node) { .kind = NString, .text = p->texts[id] };
+      *build = (Node) { .kind = NPool, .n = p->base + id, .a = literal, .next = s };
+      *at = build;
+      at = &build->next;
+    }
+  }
+  return NULL;
+}
+
+char* optimize(Subroutine* sub) {
+  foldStatements(sub->body);
+  dropDeadCode(&sub->body);
+  CheckF(hoistLoops(&sub->body, sub));
+  int32_t temps = shareStatements(sub->body, sub->vars);
+  if(temps < 0) return "Out of memory.";
+  sub->vars += temps;
+  Reducing r = { .sub = sub, .operand = -1, .partial = -1 };
+  for(int i = 0; i < MAXPENDING; i++) r.pending[i] = -1;
+  if(Intrinsics) CheckF(expandStatements(sub->body, &r));
+  CheckF(reduceStatements(sub->body, &r));
+  CheckF(poolStrings(sub, &ClassPool));
+  return NULL;
+}
+
+/** END PASSES **/
+
+/** TREE EMITTER **/
+
+char* emitExpression(Node* e, Buffer* bufout) {
+  switch(e->kind) {
+    case NConst:
+      // Only positive constants can be pushed
+      if(e->n >= 0) Push(S("constant"), e->n);
+      else if(e->n == -32768) { Push(S("constant"), 32767); Arith(not); }
+      else { Push(S("constant"), -e->n); Arith(neg); }
+      break;
+    case NString:
+      Push(S("constant"), e->text.len);
+      Call("String.new", 1);
+      for(Size i = 0; i < e->text.len; i++) {
+        Push(S("constant"), e->text.ptr[i]);
+        Call("String.appendChar", 2);
+      }
+      break;
+    case NThis:
+      Push(S("pointer"), 0);
+      break;
+    case NVar:
+      PushEntry((&e->var));
+      break;
+    case NIndex:
+      PushEntry((&e->var));
+      CheckF(emitExpression(e->a, bufout));
+      Arith(add);
+      Pop(S("pointer"), 1);
+      Push(S("that"), 0);
+      break;
+    case NCall:
+      if(e->a) CheckF(emitExpression(e->a, bufout));
+      for(Node* arg = e->list; arg; arg = arg->next) CheckF(emitExpression(arg, bufout));
+      CallC(e->text, e->name, e->n + (e->a != NULL));
+      break;
+    case NUnary:
+      CheckF(emitExpression(e->a, bufout));
+      if(e->op == '-') Arith(neg);
+      else Arith(not);
+      break;
+    case NBinary:
+      CheckF(emitExpression(e->a, bufout));
+      CheckF(emitExpression(e->b, bufout));
+      CheckF(binaryOp(e->op, bufout));
+      break;
+    case NSaveTemp:
+      CheckF(emitExpression(e->a, bufout));
+      Pop(S("var"), e->n);
+      Push(S("var"), e->n);
+      break;
+    case NThat:
+      Push(S("that"), 0);
+      break;
+    case NPeek:
+      CheckF(emitExpression(e->a, bufout));
+      Pop(S("pointer"), 1);
+      Push(S("that"), 0);
+      break;
+    default:
+      return "Not an expression.";
+  }
+  return NULL;
+}
+
+char* emitStatements(Node* s, Subroutine* sub, Buffer* bufout) {
+  for(; s; s = s->next) {
+    switch(s->kind) {
+      case NLet:
+        CheckF(emitExpression(s->a, bufout));
+        PopEntry((&s->var));
+        break;
+      case NLetIndex:
+        PushEntry((&s->var));
+        CheckF(emitExpression(s->b, bufout));
+        Arith(add);
+        if(s->op) {
+          Pop(S("pointer"), 1);
+          CheckF(emitExpression(s->a, bufout));
+          Pop(S("that"), 0);
+          break;
+        }
+        CheckF(emitExpression(s->a, bufout));
+        Pop(S("temp"), 0);
+        Pop(S("pointer"), 1);
+        Push(S("temp"), 0);
+        Pop(S("that"), 0);
+        break;
+      case NIf: {
+        CheckF(emitExpression(s->a, bufout));
+        Arith(not);
+        int l1 = labelCount++;
+        int l2 = labelCount++;
+        IfGoto(l1);
+        CheckF(emitStatements(s->list, sub, bufout));
+        Goto(l2);
+        Label(l1);
+        CheckF(emitStatements(s->orElse, sub, bufout));
+        Label(l2);
+        break;
+      }
+      case NWhile: {
+        int l1 = labelCount++;
+        int l2 = labelCount++;
+        Label(l1);
+        CheckF(emitExpression(s->a, bufout));
+        Arith(not);
+        IfGoto(l2);
+        CheckF(emitStatements(s->list, sub, bufout));
+        Goto(l1);
+        Label(l2);
+        break;
+      }
+      case NDo:
+        CheckF(emitExpression(s->a, bufout));
+        Pop(S("temp"), 0);
+        break;
+      case NPool: {
+        int l = labelCount++;
+        Push(S("static"), s->n);
+        IfGoto(l);
+        CheckF(emitExpression(s->a, bufout));
+        Pop(S("static"), s->n);
+        Label(l);
+        break;
+      }
+      case NPoke:
+        CheckF(emitExpression(s->a, bufout));
+        if(simpleOperand(s->b)) { // Does not move THAT
+          Pop(S("pointer"), 1);
+          CheckF(emitExpression(s->b, bufout));
+          Pop(S("that"), 0);
+          break;
+        }
+        CheckF(emitExpression(s->b, bufout));
+        Pop(S("temp"), 0);
+        Pop(S("pointer"), 1);
+        Push(S("temp"), 0);
+        Pop(S("that"), 0);
+        break;
+      case NReturn:
+        if(s->a) CheckF(emitExpression(s->a, bufout));
+        if(sub->isVoid) Push(S("constant"), 0);
+        Return;
+        break;
+      default:
+        return "Not a statement.";
+    }
+  }
+  return NULL;
+}
+
+// Ends in a return, nothing to add after it
+static bool returns(Node* s) {
+  while(s && s->next) s = s->next;
+  return s && s->kind == NReturn;
+}
+
+char* emitSubroutine(Subroutine* sub, Buffer* bufout) {
+  FunctionName(sub->name);
+  FunctionParams(sub->vars);
+
+  if(sub->kind == Kw_method) {
+    Push(S("argument"), 0);
+    Pop(S("pointer"), 0);
+  } else if(sub->kind == Kw_constructor) {
+    Push(S("constant"), sub->fields);
+    Call("Memory.alloc", 1);
+    Pop(S("pointer"), 0);
+  }
+
+  CheckF(emitStatements(sub->body, sub, bufout));
+
+  // void returning functions might not contain a 'return statement'
+  if(sub->isVoid && !(Optimize && returns(sub->body))) {
+    Push(S("constant"), 0);
+    Return;
+  }
+  return NULL;
+}
+
+char* compileTree(Buffer* bufout) {
+  arenaReset();
+  Subroutine* subs;
+  CheckF(nodeClass(&subs));
+  ClassPool = (Pool) { .base = STCount(&St, S("static"), false) };
+  for(Subroutine* sub = subs; sub; sub = sub->next) {
+    if(Optimize) CheckF(optimize(sub));
+    CheckF(emitSubroutine(sub, bufout));
+  }
+
+  Pool* p = &ClassPool;
+  if(PoolReport && p->count) {
+    printf("%.*s: %d pooled in statics %d-%d for %d sites, running each site once saves %d allocations (%d words)"
+           " and %d calls\n", (int)baseName.len, baseName.ptr, p->count, p->base, p->base + p->count - 1,
+           p->sites, 2 * p->sites, (int)p->words, (int)p->calls);
+  }
+  return NULL;
+}
+
+/** END TREE EMITTER **/
+
 /** MAIN LOOP **/
 int themain(int argc, char** argv) {
-  if(argc == 1) {
-    fprintf(stderr, "Usage: %s <jack_files>\n", argv[0]);
+  int first = 1;
+  bool lexOnly = false;
+  for(; first < argc && argv[first][0] == '-'; first++) {
+    if(!strcmp(argv[first], "-b")) Binary = true;
+    else if(!strcmp(argv[first], "-l")) lexOnly = true;
+    else if(!strcmp(argv[first], "-d")) Direct = true;
+    else if(!strcmp(argv[first], "-n")) Optimize = false;
+    else if(!strcmp(argv[first], "-s")) PoolReport = true;
+    else if(!strcmp(argv[first], "-i")) Intrinsics = false;
+    else if(!strcmp(argv[first], "-x")) ListIntrinsics = true;
+    else break;
+  }
+  if(argc == first) {
+    fprintf(stderr, "Usage: %s [-b] [-l] [-d] [-n] [-s] [-i] [-x] <jack_files>\n", argv[0]);
+    fprintf(stderr, "  -b  write binary VM files, X.vmb instead of X.vm\n");
+    fprintf(stderr, "  -l  only lex the files and print how many tokens each has, to time the lexer\n");
+    fprintf(stderr, "  -d  write VM while parsing, in one pass, instead of going through a tree\n");
+    fprintf(stderr, "  -n  go through the tree but leave it as written, without the optimizing passes\n");
+    fprintf(stderr, "  -s  print the string literals each class builds once instead of at each use\n");
+    fprintf(stderr, "  -i  call Memory.peek/poke, Math.abs/min/max and Keyboard.keyPressed instead of doing them inline\n");
+    fprintf(stderr, "  -x  print each of those calls done inline\n");
     return -1;
   }
 
+  initKeywords();
+
   // Processes all files
-  for(int i = 1; i < argc; i++) {
+  for(int i = first; i < argc; i++) {
 
     // Initialize input and output buffers
     #define MAXFILESIZE 1<<20
@@ -847,7 +2316,7 @@ int themain(int argc, char** argv) {
     #ifdef TOKENIZER
     BufferCopy(S("T.vm"), &fileNameBuf);
     #else
-    BufferCopy(S(".vm"), &fileNameBuf);
+    BufferCopy(Binary ? S(".vmb") : S(".vm"), &fileNameBuf);
     #endif
 
     // Load input file
@@ -857,11 +2326,20 @@ int themain(int argc, char** argv) {
       return -1;
     }
 
+    if(lexOnly) {
+      char* error = lexAll(sr.data, &Toks);
+      if(error) fprintf(stderr, "Error: %s\n", error);
+      else printf("%s: %d tokens\n", filePath, Toks.len);
+      continue;
+    }
+
     #ifdef TOKENIZER
     char* error = EmitTokenizerXml(sr.data, &bufout);
     #else
-    rest = sr.data;
-    char* error = compileclass(&bufout);
+    memset(&Strings, 0, sizeof(Strings));
+    pos = -1;
+    char* error = lexAll(sr.data, &Toks);
+    if(!error) error = Direct ? compileclass(&bufout) : compileTree(&bufout);
     #endif
 
     if(error) {
@@ -871,6 +2349,23 @@ int themain(int argc, char** argv) {
 
     Span s = BufferToSpan(&bufout);
 
+    // The string table goes before the commands
+    if(Binary) {
+      static Byte binout[MAXFILESIZE];
+      Buffer bin = BufferInit(binout, MAXFILESIZE);
+      char* binError = BufferCopy(S("VMB1"), &bin).error ? "Output too big" : writeVarint(Strings.len, &bin);
+      for(int32_t j = 0; j < Strings.len && !binError; j++) {
+        binError = writeVarint(Strings.inOrder[j].len, &bin);
+        if(!binError && BufferCopy(Strings.inOrder[j], &bin).error) binError = "Output too big";
+      }
+      if(!binError && BufferCopy(s, &bin).error) binError = "Output too big";
+      if(binError) {
+        fprintf(stderr, "%s\n", binError);
+        return -1;
+      }
+      s = BufferToSpan(&bin);
+    }
+
     BufferPushByte(&fileNameBuf, 0); // make it a proper 0 terminated string
 
     char* writeError = OsFlash((char*)BufferToSpan(&fileNameBuf).ptr, s);
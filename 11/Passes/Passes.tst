@@ -0,0 +1,21 @@
+// Runs Passes.asm, made by 'Taskfile passes' from Main.jack and the OS of ../12. Passes.cmp holds what the
+// program computes without the optimizing passes (JackCompiler -n), the default build and -i must give the same,
+// translated by ../08/vm with or without -s.
+
+load Passes.asm,
+output-file Passes.out,
+compare-to Passes.cmp,
+output-list RAM[8000]%D2.6.1 RAM[8001]%D2.6.1 RAM[8002]%D2.6.1 RAM[8003]%D2.6.1 RAM[8004]%D2.6.1
+            RAM[8005]%D2.6.1 RAM[8006]%D2.6.1 RAM[8007]%D2.6.1 RAM[8008]%D2.6.1 RAM[8009]%D2.6.1
+            RAM[8010]%D2.6.1 RAM[8011]%D2.6.1 RAM[8012]%D2.6.1 RAM[8013]%D2.6.1 RAM[8014]%D2.6.1
+            RAM[8015]%D2.6.1 RAM[8016]%D2.6.1 RAM[8017]%D2.6.1 RAM[8018]%D2.6.1 RAM[8019]%D2.6.1
+            RAM[8020]%D2.6.1 RAM[8021]%D2.6.1 RAM[8022]%D2.6.1 RAM[8023]%D2.6.1 RAM[8024]%D2.6.1
+            RAM[8025]%D2.6.1 RAM[8026]%D2.6.1 RAM[8027]%D2.6.1 RAM[8028]%D2.6.1 RAM[8029]%D2.6.1
+            RAM[8030]%D2.6.1 RAM[8031]%D2.6.1 RAM[8032]%D2.6.1 RAM[8033]%D2.6.1 RAM[8034]%D2.6.1
+            RAM[8035]%D2.6.1 RAM[8036]%D2.6.1 RAM[8037]%D2.6.1 RAM[8038]%D2.6.1;
+
+repeat 1500000 {
+  ticktock;
+}
+
+output;